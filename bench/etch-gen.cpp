@@ -0,0 +1,331 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+#include <vector>
+#include "etch-gen.h"
+
+using namespace std;
+
+/*
+ * splitmix64, so files don't depend on the standard library's
+ * distributions
+ */
+class Rng {
+public:
+    Rng(unsigned long long seed)
+    {
+        state = seed;
+    }
+
+    unsigned long long next()
+    {
+        unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    double uniform(double lo, double hi)
+    {
+        return lo + (hi - lo) * ((next() >> 11) * (1.0 / 9007199254740992.0));
+    }
+
+    unsigned int below(unsigned int n)
+    {
+        return (unsigned int)(next() % n);
+    }
+
+private:
+    unsigned long long state;
+};
+
+class EtchWriter {
+public:
+    EtchWriter(FILE *f, const EtchParams &params) : params(params)
+    {
+        this->f = f;
+        scale = (params.UnitType == UNIT_INCHES)? 1 / 25.4 : 1.0;
+        lines = 0;
+        x = y = 0;
+        setArea(0, 0, params.Width, params.Height);
+    }
+
+    /*
+     * Keeps the following features inside this rectangle
+     */
+    void setArea(double x0, double y0, double x1, double y1)
+    {
+        minX = x0;
+        minY = y0;
+        maxX = x1;
+        maxY = y1;
+    }
+
+    void line(const char *fmt, ...)
+    {
+        va_list ap;
+
+        va_start(ap, fmt);
+        vfprintf(f, fmt, ap);
+        va_end(ap);
+        fputc('\n', f);
+        lines++;
+    }
+
+    void header()
+    {
+        if (params.Style == ETCH_PCB_GCODE) {
+            line("(Generated by pcb-gcode synthetic benchmark)");
+            line("(Etching: %s)", (params.UnitType == UNIT_INCHES)? "inches" : "mm");
+            line((params.UnitType == UNIT_INCHES)? "G20" : "G21");
+            line("G90");
+            line("G00 Z%.4f", 2.0 * scale);
+            line("M03");
+            line("G04 P3.000000");
+        } else {
+            line("( pcb2gcode synthetic benchmark )");
+            line("G94 ( Millimeters per minute feed rate. )");
+            line((params.UnitType == UNIT_INCHES)? "G20 ( Units == Inches. )" : "G21 ( Units == Millimeters. )");
+            line("G90 ( Absolute coordinates. )");
+            line("S10000 ( RPM spindle speed. )");
+            line("G64 P0.01000 ( set maximum deviation from commanded toolpath )");
+            line("G00 Z%.5f ( retract )", 2.0 * scale);
+            line("M3 ( Spindle on clockwise. )");
+        }
+    }
+
+    void footer()
+    {
+        line("G00 Z%.4f", 12.0 * scale);
+        line("M05");
+        line("M02");
+    }
+
+    /*
+     * Starts a cut at (x, y), coordinates in mm
+     */
+    void start(double x, double y)
+    {
+        const char *fmt = (params.Style == ETCH_PCB_GCODE)? "G00 X%.4f Y%.4f" : "G00 X%.5f Y%.5f";
+
+        line(fmt, x * scale, y * scale);
+        if (params.Style == ETCH_PCB_GCODE) {
+            line("G01 Z%.4f F%.4f", -0.1 * scale, 300 * scale);
+        } else {
+            line("G01 Z%.5f", -0.05 * scale);
+            line("G04 P0 ( dwell for no time -- G64 should not smooth over this point )");
+        }
+        this->x = x;
+        this->y = y;
+        first = true;
+    }
+
+    void cut(double x, double y)
+    {
+        x = clamp(x, minX, maxX);
+        y = clamp(y, minY, maxY);
+
+        if (params.Style == ETCH_PCB2GCODE)
+            line("X%.5f Y%.5f", x * scale, y * scale);
+        else if (first)
+            line("G01 X%.4f Y%.4f F%.4f", x * scale, y * scale, 600 * scale);
+        else
+            line("G01 X%.4f Y%.4f", x * scale, y * scale);
+
+        this->x = x;
+        this->y = y;
+        first = false;
+    }
+
+    /*
+     * A full circle back to where the cut is, around (cx, cy)
+     */
+    void circle(double cx, double cy)
+    {
+        const char *fmt = (params.Style == ETCH_PCB_GCODE)? "G03 X%.4f Y%.4f I%.4f J%.4f" : "G03 X%.5f Y%.5f I%.5f J%.5f";
+
+        line(fmt, x * scale, y * scale, (cx - x) * scale, (cy - y) * scale);
+        first = false;
+    }
+
+    void end()
+    {
+        line((params.Style == ETCH_PCB_GCODE)? "G00 Z%.4f" : "G00 Z%.5f", 1.0 * scale);
+    }
+
+    void drill(double x, double y)
+    {
+        line("G82 X%.4f Y%.4f Z%.4f R%.4f P0.2 F%.4f", x * scale, y * scale,
+                -0.3 * scale, 1.0 * scale, 100 * scale);
+    }
+
+    bool inside(double x, double y) const
+    {
+        return x >= minX && x <= maxX && y >= minY && y <= maxY;
+    }
+
+    static double clamp(double v, double lo, double hi)
+    {
+        return (v < lo)? lo : (v > hi)? hi : v;
+    }
+
+    const EtchParams &params;
+    FILE *f;
+    double scale;
+    unsigned long lines;
+    double x, y;
+    bool first;
+    double minX, minY, maxX, maxY;
+};
+
+static const double dir_x[8] = { 1, 0.7071, 0, -0.7071, -1, -0.7071, 0, 0.7071 };
+static const double dir_y[8] = { 0, 0.7071, 1, 0.7071, 0, -0.7071, -1, -0.7071 };
+
+/*
+ * Isolation around a round pad
+ */
+static void pad_outline(EtchWriter &w, Rng &rng, double cx, double cy)
+{
+    double r = rng.uniform(0.6, 1.5);
+    unsigned int n = 8 + rng.below(17);
+
+    w.start(cx + r, cy);
+    if (w.params.Arcs) {
+        w.circle(cx, cy);
+        w.end();
+        return;
+    }
+    for (unsigned int i = 1; i <= n; i++) {
+        double a = 2 * M_PI * i / n;
+        w.cut(cx + r * cos(a), cy + r * sin(a));
+    }
+    w.end();
+}
+
+/*
+ * A fine pitch footprint: a row of small rectangular pads
+ */
+static void dense_field(EtchWriter &w, Rng &rng, vector<double> &pads)
+{
+    double pitch = rng.uniform(0.5, 1.27);
+    unsigned int count = 8 + rng.below(40);
+    bool vertical = rng.below(2) == 0;
+    double room = (vertical? w.maxY - w.minY : w.maxX - w.minX) - 4;
+
+    if (pitch * count > room)
+        count = (unsigned int)(room / pitch) + 1;
+
+    double extent = pitch * (count - 1);
+    double px = rng.uniform(w.minX + 2, w.maxX - 2 - (vertical? 0 : extent));
+    double py = rng.uniform(w.minY + 2, w.maxY - 2 - (vertical? extent : 0));
+    double pw = pitch * 0.3, ph = rng.uniform(0.6, 1.8);
+
+    for (unsigned int i = 0; i < count; i++) {
+        double cx = vertical? px : px + i * pitch;
+        double cy = vertical? py + i * pitch : py;
+        double hw = vertical? ph : pw, hh = vertical? pw : ph;
+
+        w.start(cx - hw, cy - hh);
+        w.cut(cx + hw, cy - hh);
+        w.cut(cx + hw, cy + hh);
+        w.cut(cx - hw, cy + hh);
+        w.cut(cx - hw, cy - hh);
+        w.end();
+        pads.push_back(cx);
+        pads.push_back(cy);
+    }
+}
+
+/*
+ * A trace made of 0/45/90 degree segments
+ */
+static void trace(EtchWriter &w, Rng &rng, double min_len, double max_len, unsigned int segments)
+{
+    unsigned int dir = rng.below(8);
+
+    w.start(rng.uniform(w.minX, w.maxX), rng.uniform(w.minY, w.maxY));
+    for (unsigned int i = 0; i < segments; i++) {
+        double len = min_len * pow(max_len / min_len, rng.uniform(0, 1));
+
+        if (rng.below(3) == 0)
+            dir = (dir + (rng.below(2)? 1 : 7)) & 7;
+
+        //Turn away from the board edges
+        for (unsigned int turn = 0; turn < 8 && !w.inside(w.x + dir_x[dir] * len, w.y + dir_y[dir] * len); turn++)
+            dir = (dir + 3) & 7;
+
+        w.cut(w.x + dir_x[dir] * len, w.y + dir_y[dir] * len);
+    }
+    w.end();
+}
+
+unsigned long GenerateEtchFile(const char *path, const EtchParams &params)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL)
+        return 0;
+
+    static char iobuf[1 << 20];
+    setvbuf(f, iobuf, _IOFBF, sizeof(iobuf));
+
+    Rng rng(params.Seed);
+    EtchWriter w(f, params);
+    vector<double> pads, islands;
+    unsigned long drills = (unsigned long)(params.Lines * params.DrillFraction);
+    unsigned long etch = params.Lines - drills;
+
+    for (unsigned int i = 0; i < params.Islands; i++) {
+        double iw = rng.uniform(0.05, 0.2) * params.Width + 5;
+        double ih = rng.uniform(0.05, 0.2) * params.Height + 5;
+        double ix = rng.uniform(0, params.Width - iw);
+        double iy = rng.uniform(0, params.Height - ih);
+
+        islands.push_back(ix);
+        islands.push_back(iy);
+        islands.push_back(ix + iw);
+        islands.push_back(iy + ih);
+    }
+
+    w.header();
+    while (w.lines < etch) {
+        double pick = rng.uniform(0, 1);
+
+        if (!islands.empty()) {
+            size_t k = 4 * rng.below((unsigned int)(islands.size() / 4));
+            w.setArea(islands[k], islands[k + 1], islands[k + 2], islands[k + 3]);
+        }
+
+        if (pick < params.DenseFraction) {
+            dense_field(w, rng, pads);
+        } else if (pick < params.DenseFraction + params.LongFraction) {
+            trace(w, rng, 5, 60, 3 + rng.below(8));
+        } else if (rng.below(2) == 0) {
+            double cx = rng.uniform(w.minX + 2, w.maxX - 2);
+            double cy = rng.uniform(w.minY + 2, w.maxY - 2);
+
+            pad_outline(w, rng, cx, cy);
+            pads.push_back(cx);
+            pads.push_back(cy);
+        } else {
+            trace(w, rng, 0.3, 8, 2 + rng.below(7));
+        }
+    }
+
+    for (unsigned long i = 0; i < drills; i++) {
+        if (!pads.empty()) {
+            size_t k = 2 * rng.below((unsigned int)(pads.size() / 2));
+            w.drill(pads[k], pads[k + 1]);
+        } else {
+            w.drill(rng.uniform(0, params.Width), rng.uniform(0, params.Height));
+        }
+    }
+    w.footer();
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0)
+        ok = false;
+
+    return ok? w.lines : 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * File:   etch-gen.h
+ *
+ * Synthetic etch files for benchmarking, in the style written by
+ * pcb-gcode (Eagle) and pcb2gcode.  The same parameters and seed always
+ * give the same file.
+ */
+
+#ifndef ETCH_GEN_H
+#define	ETCH_GEN_H
+
+#include "pcb-probe.h"
+
+#define ETCH_PCB_GCODE  0
+#define ETCH_PCB2GCODE  1
+
+struct EtchParams {
+    int Style;              //ETCH_PCB_GCODE or ETCH_PCB2GCODE
+    int UnitType;           //UNIT_MM or UNIT_INCHES
+    double Width;           //Board size in mm
+    double Height;
+    unsigned long Lines;    //Approximate length of the file
+    double DenseFraction;   //Share of the lines spent in dense fine pitch areas
+    double LongFraction;    //Share of the lines spent in long traces
+    double DrillFraction;   //Share of the lines that are G82 drill spots
+    unsigned int Islands;   //Copper only in this many scattered areas, 0 for the whole board
+    bool Arcs;              //Round pads as one G03 circle instead of chords
+    unsigned long long Seed;
+
+    void SetDefaults()
+    {
+        Style = ETCH_PCB_GCODE;
+        UnitType = UNIT_MM;
+        Width = 100;
+        Height = 80;
+        Lines = 100000;
+        DenseFraction = 0.3;
+        LongFraction = 0.2;
+        DrillFraction = 0;
+        Islands = 0;
+        Arcs = false;
+        Seed = 1;
+    }
+};
+
+/*
+ * Writes the file, returns the number of lines written or 0 on error
+ */
+unsigned long GenerateEtchFile(const char *path, const EtchParams &params);
+
+#endif	/* ETCH_GEN_H */
+
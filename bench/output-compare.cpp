@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <vector>
+#include "output-compare.h"
+
+using namespace std;
+
+/*
+ * One output, split where the probing starts and where the etch starts
+ */
+struct OutputFile {
+    vector<string> lines;
+    map<int, double> params;
+    size_t probeStart;      //After the probe subroutine
+    size_t etchStart;       //After the probe complete message
+};
+
+/*
+ * The board both files are given, a few tenths of a mm of warp and tilt
+ */
+static double surface(double x, double y)
+{
+    return 0.15 * sin(x / 17.0) + 0.1 * cos(y / 13.0) + 0.002 * x;
+}
+
+static bool starts_number(const char *p)
+{
+    if (*p == '-' || *p == '.')
+        p++;
+    if (*p == '.')
+        p++;
+
+    return isdigit((unsigned char)*p) != 0;
+}
+
+/*
+ * A sum of products of numbers and parameters, as in [0.25*#2001 + #3],
+ * from p up to the closing bracket.  A parameter never set is 0 as on the
+ * controller (cells outside of the grid are not probed).  scale gets the
+ * sum of the numbers, the weights of a formula.
+ */
+static bool evaluate(const char *&p, const map<int, double> &params, double &value, double &scale)
+{
+    double sign = 1;
+
+    value = 0;
+    scale = 0;
+    for (;;) {
+        double product = sign;
+
+        for (;;) {
+            while (*p == ' ')
+                p++;
+
+            if (*p == '#') {
+                char *end;
+                long n = strtol(p + 1, &end, 10);
+                map<int, double>::const_iterator it = params.find((int)n);
+
+                if (end == p + 1)
+                    return false;
+                product *= (it != params.end())? it->second : 0;
+                p = end;
+            } else if (starts_number(p)) {
+                char *end;
+                double number = strtod(p, &end);
+
+                product *= number;
+                scale += fabs(number);
+                p = end;
+            } else {
+                return false;
+            }
+
+            while (*p == ' ')
+                p++;
+            if (*p != '*')
+                break;
+            p++;
+        }
+
+        value += product;
+        if (*p == ']')
+            return true;
+        if (*p != '+' && *p != '-')
+            return false;
+        sign = (*p == '-')? -1 : 1;
+        p++;
+    }
+}
+
+/*
+ * Reads the file, giving every probe the height of the board at it
+ */
+static bool read_output(const char *path, const function<double(double, double)> &board, OutputFile &file, string &why)
+{
+    ifstream in(path);
+    string line;
+
+    if (!in) {
+        why = string("Unable to open file: ") + path;
+        return false;
+    }
+
+    file.probeStart = file.etchStart = 0;
+    while (getline(in, line)) {
+        file.lines.push_back(line);
+
+        if (line == "O100 endsub")
+            file.probeStart = file.lines.size();
+        else if (line == "(MSG,PROBE: Beginning etch)")
+            file.etchStart = file.lines.size();
+    }
+    if (file.etchStart < file.probeStart)
+        file.etchStart = file.probeStart;
+
+    for (size_t k = 0; k < file.lines.size(); k++) {
+        const char *p = file.lines[k].c_str();
+        double x, y, value, scale;
+        int n, var;
+
+        if (sscanf(p, "(PROBE[%*u,%*u] %lf %lf -> %d)", &x, &y, &var) == 3) {
+            file.params[var] = board(x, y);
+        } else if (sscanf(p, "#%d=%lf", &n, &value) == 2) {
+            file.params[n] = value;
+        } else if (sscanf(p, "#%d = [", &n) == 1 && strchr(p, '[') != NULL) {
+            p = strchr(p, '[') + 1;
+            if (!evaluate(p, file.params, value, scale)) {
+                why = string(path) + ":" + to_string(k + 1) + ": can't work out " + file.lines[k];
+                return false;
+            }
+            file.params[n] = value;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Same text, numbers one unit apart in the last digit, Z formulas within
+ * COMPARE_Z_SLACK once worked out (times the sum of the weights, points
+ * outside of the grid get huge ones)
+ */
+static bool same_line(const char *a, const OutputFile &fileA, const char *b, const OutputFile &fileB)
+{
+    while (*a != '\0' && *b != '\0') {
+        if (a[0] == 'Z' && a[1] == '[' && b[0] == 'Z' && b[1] == '[') {
+            double za, zb, scaleA, scaleB;
+
+            a += 2;
+            b += 2;
+            if (!evaluate(a, fileA.params, za, scaleA) || !evaluate(b, fileB.params, zb, scaleB) ||
+                    fabs(za - zb) > COMPARE_Z_SLACK * max(1.0, max(scaleA, scaleB)))
+                return false;
+            a++;
+            b++;
+        } else if (starts_number(a) && starts_number(b)) {
+            char *endA, *endB;
+            double x = strtod(a, &endA), y = strtod(b, &endB);
+            const char *dot = strchr(a, '.');
+            int decimals = (dot != NULL && dot < endA)? (int)(endA - dot - 1) : 0;
+
+            if (decimals == 0 && x != y)
+                return false;
+            if (fabs(x - y) > 1.01 * pow(10.0, -decimals))
+                return false;
+            a = endA;
+            b = endB;
+        } else if (*a++ != *b++) {
+            return false;
+        }
+    }
+
+    return *a == *b;
+}
+
+bool CompareOutputs(const char *pathA, const char *pathB, string &why)
+{
+    OutputFile a, b;
+
+    if (!read_output(pathA, surface, a, why) || !read_output(pathB, surface, b, why))
+        return false;
+
+    if (a.probeStart != b.probeStart || a.lines.size() - a.etchStart != b.lines.size() - b.etchStart) {
+        why = "The files don't have the same lines outside of the probing";
+        return false;
+    }
+
+    for (size_t k = 0; k < a.lines.size(); k++) {
+        size_t kb = k;
+
+        if (k >= a.probeStart && k < a.etchStart)
+            continue;
+        if (k >= a.etchStart)
+            kb = k - a.etchStart + b.etchStart;
+
+        if (!same_line(a.lines[k].c_str(), a, b.lines[kb].c_str(), b)) {
+            why = string(pathA) + ":" + to_string(k + 1) + ": " + a.lines[k] + "\n" +
+                  pathB + ":" + to_string(kb + 1) + ": " + b.lines[kb];
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Where a line leaves the tool, X and Y as given or as before
+ */
+static void line_position(const char *line, double &x, double &y)
+{
+    for (const char *p = line; *p != '\0'; p++) {
+        if (p[0] == ' ' && p[1] == 'X' && starts_number(p + 2))
+            x = strtod(p + 2, NULL);
+        else if (p[0] == ' ' && p[1] == 'Y' && starts_number(p + 2))
+            y = strtod(p + 2, NULL);
+    }
+}
+
+bool MeasureSurfaceError(const char *path, const HeightMap *reference, SurfaceError &error, string &why)
+{
+    OutputFile file;
+    function<double(double, double)> board = surface;
+    double x = 0, y = 0, sum = 0;
+
+    if (reference != NULL)
+        board = [reference](double x, double y) { return (double)reference->at(x, y); };
+    if (!read_output(path, board, file, why))
+        return false;
+
+    //The depths are left out, Z is then the height of the board
+    map<int, double> params = file.params;
+
+    params[3] = 0;
+    params[7] = 0;
+
+    error.Points = 0;
+    error.MaxError = 0;
+    for (size_t k = file.etchStart; k < file.lines.size(); k++) {
+        const char *line = file.lines[k].c_str();
+        const char *z = strstr(line, "Z[");
+        double value, scale;
+        int n;
+
+        line_position(line, x, y);
+
+        //A long bicubic formula is started in a parameter on the line before
+        if (sscanf(line, "#%d = [", &n) == 1 && strchr(line, '[') != NULL) {
+            const char *p = strchr(line, '[') + 1;
+
+            if (!evaluate(p, params, value, scale)) {
+                why = string(path) + ":" + to_string(k + 1) + ": can't work out " + file.lines[k];
+                return false;
+            }
+            params[n] = value;
+            continue;
+        }
+
+        if (z == NULL || (strstr(z, "#3]") == NULL && strstr(z, "#7]") == NULL))
+            continue;
+
+        z += 2;
+        if (!evaluate(z, params, value, scale)) {
+            why = string(path) + ":" + to_string(k + 1) + ": can't work out " + file.lines[k];
+            return false;
+        }
+
+        double e = fabs(value - board(x, y));
+
+        error.Points++;
+        error.MaxError = max(error.MaxError, e);
+        sum += e * e;
+    }
+    error.RMSError = (error.Points > 0)? sqrt(sum / error.Points) : 0;
+
+    return true;
+}
@@ -0,0 +1,46 @@
+/*
+ * File:   output-compare.h
+ *
+ * Checks that two outputs of pcb-probe (builds with another Real, or
+ * other options that must not change the cut) agree to the digits they
+ * print.  Both files get the heights of the same synthetic board at
+ * their probes, every compensated Z is worked out from them and must
+ * agree within the rounding of the printed weights.  Everything else
+ * must be the same text, with numbers at most one unit apart in their
+ * last printed digit.  The variable numbers and the order of the probes
+ * may differ.
+ *
+ * The same reading of an output also tells how far its compensated Z
+ * strays from the board, for comparing surface models and grid sizes.
+ */
+
+#ifndef OUTPUT_COMPARE_H
+#define	OUTPUT_COMPARE_H
+
+#include <string>
+#include "height-map.h"
+
+using namespace std;
+
+#define COMPARE_Z_SLACK     0.002   //Furthest two compensated Z may be apart
+
+/*
+ * Returns false and says where in why if the files don't agree
+ */
+bool CompareOutputs(const char *pathA, const char *pathB, string &why);
+
+struct SurfaceError {
+    unsigned long Points;   //Compensated lines worked out
+    double MaxError;
+    double RMSError;
+};
+
+/*
+ * Every probe reads the made up board, or reference (a dense height map)
+ * when given, and every compensated line less its depth is set against
+ * the board at its X Y.  Returns false and says why if the file can't be
+ * worked out.
+ */
+bool MeasureSurfaceError(const char *path, const HeightMap *reference, SurfaceError &error, string &why);
+
+#endif	/* OUTPUT_COMPARE_H */
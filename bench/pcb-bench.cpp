@@ -0,0 +1,841 @@
+/*
+ * File:   pcb-bench.cpp
+ *
+ * Benchmarks the pcb-probe pipeline on synthetic etch files.  Every stage
+ * is timed on its own and the results are printed one JSON object per
+ * scenario, so runs can be compared from commit to commit.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "pcb-probe.h"
+#include "parser.h"
+#include "gcode-reader.h"
+#include "etch-gen.h"
+#include "output-compare.h"
+
+using namespace std;
+
+/*
+ * Allocation counting, every operator new goes through here
+ */
+static atomic<unsigned long long> allocCount(0);
+static atomic<unsigned long long> allocBytes(0);
+
+void *operator new(size_t size)
+{
+    allocCount++;
+    allocBytes += size;
+
+    void *p = malloc(size? size : 1);
+    if (p == NULL)
+        throw bad_alloc();
+
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+struct Scenario {
+    const char *Name;
+    int Style;
+    int UnitType;
+    double Width, Height;
+    unsigned long Lines;
+    double DenseFraction;
+    double LongFraction;
+    double DrillFraction;
+    unsigned int Islands;
+};
+
+static const Scenario scenarios[] = {
+    { "pcb-gcode-mm",   ETCH_PCB_GCODE, UNIT_MM,     100, 80,  200000, 0.3, 0.2, 0,   0 },
+    { "pcb-gcode-inch", ETCH_PCB_GCODE, UNIT_INCHES, 100, 80,  200000, 0.3, 0.2, 0,   0 },
+    { "pcb2gcode-mm",   ETCH_PCB2GCODE, UNIT_MM,     100, 80,  200000, 0.3, 0.2, 0,   0 },
+    { "long-traces",    ETCH_PCB_GCODE, UNIT_MM,     160, 100, 200000, 0.0, 0.9, 0,   0 },
+    { "drill-spots",    ETCH_PCB_GCODE, UNIT_MM,     100, 80,  100000, 0.3, 0.1, 0.5, 0 },
+    { "panel-dense",    ETCH_PCB_GCODE, UNIT_MM,     300, 200, 1000000, 0.6, 0.1, 0,  0 },
+    { "sparse-islands", ETCH_PCB_GCODE, UNIT_MM,     200, 150, 100000, 0.3, 0.1, 0,   12 },
+};
+
+/*
+ * Settings every run of a scenario shares
+ */
+struct BenchOptions {
+    double Scale;
+    int Repeat;
+    double Grid;
+    double Merge;
+    bool Adaptive;
+    unsigned int Threads;   //Concurrent jobs checked against serial runs, 0 for none
+    bool Kernels;           //Time the interpolation with every weight kernel
+    unsigned int JobThreads;    //Also run the job on this many threads and check, 0 for none
+    string Dir;
+    bool Keep;
+};
+
+struct StageResult {
+    double Seconds;
+    unsigned long long Allocs;
+    unsigned long long AllocBytes;
+};
+
+class Stopwatch {
+public:
+    void start()
+    {
+        allocs = allocCount;
+        bytes = allocBytes;
+        t0 = chrono::steady_clock::now();
+    }
+
+    void stop(StageResult &r, bool first)
+    {
+        double s = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+        if (first || s < r.Seconds)
+            r.Seconds = s;
+        r.Allocs = allocCount - allocs;
+        r.AllocBytes = allocBytes - bytes;
+    }
+
+private:
+    chrono::steady_clock::time_point t0;
+    unsigned long long allocs;
+    unsigned long long bytes;
+};
+
+/*
+ * Peak RSS is per process, on Linux it can be reset between scenarios
+ */
+static void reset_peak_rss()
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long peak_rss_kb()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "VmHWM:", 6) == 0)
+                kb = atol(line + 6);
+        }
+        fclose(f);
+    }
+
+    if (kb < 0) {
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+
+    return kb;
+}
+
+static unsigned long long file_size(const char *path)
+{
+    struct stat st;
+
+    return (stat(path, &st) == 0)? (unsigned long long)st.st_size : 0;
+}
+
+/*
+ * Parsing alone, no modal state or splitting
+ */
+static unsigned long parse_only(const char *path)
+{
+    GCodeReader in;
+    string_view line;
+    GCodeCommand cmd;
+    ExtraTable extras;
+    unsigned long commands = 0;
+
+    if (!in.open(path))
+        return 0;
+
+    while (in.nextLine(line)) {
+        ParseGCodeLine(line, cmd, extras);
+        if (cmd.opcode != GCODE_NONE)
+            commands++;
+    }
+
+    return commands;
+}
+
+static void print_stage(const char *name, const StageResult &r, double mbytes, bool last)
+{
+    printf("\"%s\":{\"seconds\":%.6f,\"mb_per_s\":%.2f,\"allocs\":%llu,\"alloc_bytes\":%llu}%s",
+            name, r.Seconds, (r.Seconds > 0)? mbytes / r.Seconds : 0.0, r.Allocs, r.AllocBytes, last? "" : ",");
+}
+
+static void setup_job(PCBProbeJob &job, const BenchOptions &opt, double grid)
+{
+    job.info.GridSize = grid;
+    job.info.MergeTolerance = opt.Merge;
+    job.info.Adaptive = opt.Adaptive;
+    job.info.ProbeOrder = PROBE_ORDER_OPTIMIZED;
+}
+
+static void run_job(PCBProbeJob &job, const string &in_path, const string &out_path)
+{
+    job.LoadAndSplitSegments(in_path.c_str());
+    job.MergeSegments();
+    job.DoInterpolation();
+    job.GenerateGCodeWithProbing(out_path.c_str());
+}
+
+static bool read_file(const string &path, string &data)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    char block[65536];
+    size_t n;
+
+    if (f == NULL)
+        return false;
+
+    data.clear();
+    while ((n = fread(block, 1, sizeof(block), f)) > 0)
+        data.append(block, n);
+    fclose(f);
+
+    return true;
+}
+
+/*
+ * Runs opt.Threads jobs one after the other, then all of them at once on
+ * their own threads, and compares the outputs.  Every job has a different
+ * grid so anything shared between them would show.  The probes are put
+ * in the optimized order, its search stops after a fixed amount of work
+ * so it is the same however busy the threads are.
+ */
+static bool check_concurrent(const Scenario &sc, const BenchOptions &opt, const string &in_path)
+{
+    unsigned int n = opt.Threads;
+    vector<string> serial(n), concurrent(n);
+    vector<thread> threads;
+    vector<string> errors(n);
+    bool same = true;
+
+    for (unsigned int k = 0; k < n; k++) {
+        serial[k] = opt.Dir + "/" + sc.Name + ".serial" + to_string(k) + ".ngc";
+        concurrent[k] = opt.Dir + "/" + sc.Name + ".thread" + to_string(k) + ".ngc";
+    }
+
+    for (unsigned int k = 0; k < n; k++) {
+        PCBProbeJob job;
+
+        setup_job(job, opt, opt.Grid * (1 + 0.25 * k));
+        run_job(job, in_path, serial[k]);
+    }
+
+    for (unsigned int k = 0; k < n; k++) {
+        threads.push_back(thread([&, k]() {
+            try {
+                PCBProbeJob job;
+
+                setup_job(job, opt, opt.Grid * (1 + 0.25 * k));
+                run_job(job, in_path, concurrent[k]);
+            } catch (const ProbeError &e) {
+                errors[k] = e.what();
+            }
+        }));
+    }
+    for (unsigned int k = 0; k < n; k++)
+        threads[k].join();
+
+    for (unsigned int k = 0; k < n; k++) {
+        string a, b;
+
+        if (!errors[k].empty() || !read_file(serial[k], a) || !read_file(concurrent[k], b) || a != b) {
+            fprintf(stderr, "%s: job %u on its own thread differs from the serial run %s\n",
+                    sc.Name, k, errors[k].c_str());
+            same = false;
+        }
+        remove(serial[k].c_str());
+        remove(concurrent[k].c_str());
+    }
+
+    return same;
+}
+
+/*
+ * The kernel on its own over the compensated points of a job, in batches
+ * as DoInterpolation gives them.  Returns the best time of opt.Repeat.
+ */
+static double time_kernel(const PCBProbeJob &job, int kernel, int repeat)
+{
+    WeightGrid grid;
+    WeightBatch batch;
+    vector<double> xs, ys;
+    Real x = 0, y = 0;
+    double best = 0;
+
+    grid.MinX = (double)job.info.MillMinX;
+    grid.MinY = (double)job.info.MillMinY;
+    grid.Gx = job.info.Gx;
+    grid.Gy = job.info.Gy;
+    grid.MaxX = (int)job.info.GridMaxX;
+    grid.MaxY = (int)job.info.GridMaxY;
+
+    for (size_t i = 0; i < job.cmdList.size(); i++) {
+        const GCodeCommand &cmd = job.cmdList[i];
+
+        if (cmd.hasXCoord())
+            x = cmd.getXCoord();
+        if (cmd.hasYCoord())
+            y = cmd.getYCoord();
+        if (cmd.hasZFormula) {
+            xs.push_back((double)x);
+            ys.push_back((double)y);
+        }
+    }
+
+    for (int r = 0; r < repeat; r++) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+        for (size_t from = 0; from < xs.size(); from += WEIGHT_BATCH_SIZE) {
+            size_t n = min((size_t)WEIGHT_BATCH_SIZE, xs.size() - from);
+
+            batch.resize(n);
+            memcpy(&batch.X[0], &xs[from], n * sizeof(double));
+            memcpy(&batch.Y[0], &ys[from], n * sizeof(double));
+            ComputeWeights(grid, batch, kernel);
+        }
+
+        double s = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+        if (r == 0 || s < best)
+            best = s;
+    }
+
+    return (xs.empty())? 0 : best / xs.size() * 1e9;
+}
+
+/*
+ * Times the interpolation with every weight kernel the processor runs,
+ * from one point at a time in long double up, and checks the outputs are
+ * the same.  Fills in the best time of the whole pass and the nanoseconds
+ * per point of the kernel alone.
+ */
+static bool check_kernels(const Scenario &sc, const BenchOptions &opt, const string &in_path, vector<double> &seconds, vector<double> &ns_per_point)
+{
+    int best = BestWeightKernel();
+    string reference;
+    bool same = true;
+
+    seconds.assign(best + 1, 0);
+    ns_per_point.assign(best + 1, 0);
+    for (int kernel = WEIGHT_KERNEL_NONE; kernel <= best; kernel++) {
+        string out_path = opt.Dir + "/" + sc.Name + "." + WeightKernelName(kernel) + ".ngc";
+        string data;
+
+        for (int r = 0; r < opt.Repeat; r++) {
+            PCBProbeJob job;
+            StageResult interp = { 0, 0, 0 };
+            Stopwatch sw;
+
+            setup_job(job, opt, opt.Grid);
+            job.info.ProbeOrder = PROBE_ORDER_SERPENTINE;
+            job.info.WeightKernel = kernel;
+            job.LoadAndSplitSegments(in_path.c_str());
+            job.MergeSegments();
+
+            sw.start();
+            job.DoInterpolation();
+            sw.stop(interp, true);
+
+            if (r == 0 || interp.Seconds < seconds[kernel])
+                seconds[kernel] = interp.Seconds;
+            if (r == 0) {
+                job.GenerateGCodeWithProbing(out_path.c_str());
+                if (kernel != WEIGHT_KERNEL_NONE)
+                    ns_per_point[kernel] = time_kernel(job, kernel, opt.Repeat);
+            }
+        }
+
+        if (!read_file(out_path, data)) {
+            same = false;
+        } else if (kernel == WEIGHT_KERNEL_NONE) {
+            reference.swap(data);
+        } else if (data != reference) {
+            fprintf(stderr, "%s: the %s weight kernel differs from the long double path\n", sc.Name, WeightKernelName(kernel));
+            same = false;
+        }
+        remove(out_path.c_str());
+    }
+
+    return same;
+}
+
+/*
+ * The stages of a job that run on job.info.Threads, timed in one pass and
+ * on opt.JobThreads threads
+ */
+struct ThreadedResult {
+    double Seconds[2][2];   //[parse, interpolate][one pass, threads]
+    unsigned int Chunks;    //Pieces the file was parsed in
+};
+
+/*
+ * Runs the job in one pass and on opt.JobThreads threads and checks the
+ * outputs are the same, keeping the best time of every stage
+ */
+static bool check_threaded(const Scenario &sc, const BenchOptions &opt, const string &in_path, ThreadedResult &result)
+{
+    string outputs[2];
+
+    for (int pass = 0; pass < 2; pass++) {
+        string out_path = opt.Dir + "/" + sc.Name + ".threaded.ngc";
+
+        for (int r = 0; r < opt.Repeat; r++) {
+            PCBProbeJob job;
+
+            setup_job(job, opt, opt.Grid);
+            job.stats.Enabled = true;
+            job.info.Threads = (pass == 0)? 1 : opt.JobThreads;
+            job.LoadAndSplitSegments(in_path.c_str());
+            job.MergeSegments();
+            job.DoInterpolation();
+
+            double parse = job.stats.Seconds[STAGE_PARSE];
+            double interp = job.stats.Seconds[STAGE_INTERPOLATE];
+
+            if (r == 0 || parse < result.Seconds[0][pass])
+                result.Seconds[0][pass] = parse;
+            if (r == 0 || interp < result.Seconds[1][pass])
+                result.Seconds[1][pass] = interp;
+            if (r == 0) {
+                result.Chunks = job.stats.ParseChunks;
+                job.GenerateGCodeWithProbing(out_path.c_str());
+                if (!read_file(out_path, outputs[pass]))
+                    outputs[pass] = "unreadable";
+                remove(out_path.c_str());
+            }
+        }
+    }
+
+    if (outputs[0] != outputs[1]) {
+        fprintf(stderr, "%s: the job on %u threads differs from one pass\n", sc.Name, opt.JobThreads);
+        return false;
+    }
+
+    return true;
+}
+
+static bool run_scenario(const Scenario &sc, const BenchOptions &opt)
+{
+    EtchParams params;
+    string in_path = opt.Dir + "/" + sc.Name + ".ngc";
+    string out_path = opt.Dir + "/" + sc.Name + ".out.ngc";
+
+    params.SetDefaults();
+    params.Style = sc.Style;
+    params.UnitType = sc.UnitType;
+    params.Width = sc.Width;
+    params.Height = sc.Height;
+    params.Lines = (unsigned long)(sc.Lines * opt.Scale);
+    params.DenseFraction = sc.DenseFraction;
+    params.LongFraction = sc.LongFraction;
+    params.DrillFraction = sc.DrillFraction;
+    params.Islands = sc.Islands;
+
+    unsigned long lines = GenerateEtchFile(in_path.c_str(), params);
+
+    if (lines == 0) {
+        fprintf(stderr, "Unable to write file: %s\n", in_path.c_str());
+        exit(1);
+    }
+
+    StageResult parse = { 0, 0, 0 }, load = parse, interp = parse, output = parse;
+    Stopwatch sw;
+    unsigned long parsed = 0, split = 0;
+    PCBProbeInfo info = PCBProbeInfo();
+
+    reset_peak_rss();
+    for (int r = 0; r < opt.Repeat; r++) {
+        PCBProbeJob job;
+
+        sw.start();
+        parsed = parse_only(in_path.c_str());
+        sw.stop(parse, r == 0);
+
+        setup_job(job, opt, opt.Grid);
+
+        sw.start();
+        job.LoadAndSplitSegments(in_path.c_str());
+        job.MergeSegments();
+        sw.stop(load, r == 0);
+
+        sw.start();
+        job.DoInterpolation();
+        sw.stop(interp, r == 0);
+
+        sw.start();
+        job.GenerateGCodeWithProbing(out_path.c_str());
+        sw.stop(output, r == 0);
+
+        info = job.info;
+        split = job.cmdList.size();
+    }
+
+    double in_mb = file_size(in_path.c_str()) / 1e6;
+    double out_mb = file_size(out_path.c_str()) / 1e6;
+    double total = load.Seconds + interp.Seconds + output.Seconds;
+    bool same = (opt.Threads > 0)? check_concurrent(sc, opt, in_path) : true;
+    vector<double> kernels, kernel_ns;
+    bool kernels_same = opt.Kernels? check_kernels(sc, opt, in_path, kernels, kernel_ns) : true;
+    ThreadedResult threaded = {};
+    bool threaded_same = (opt.JobThreads > 0)? check_threaded(sc, opt, in_path, threaded) : true;
+
+    printf("{\"scenario\":\"%s\",\"real_bytes\":%u,\"grid\":%g,\"input_bytes\":%llu,\"input_lines\":%lu,"
+            "\"commands_parsed\":%lu,\"commands_split\":%lu,\"merged_lines\":%lu,\"output_bytes\":%llu,\"probes\":%u,"
+            "\"grid_cells\":%u,\"adaptive\":%s,\"uniform_probes\":%u,\"probe_travel\":%.1f,\"probe_travel_serpentine\":%.1f,\"stages\":{",
+            sc.Name, (unsigned int)sizeof(Real), opt.Grid, file_size(in_path.c_str()), lines,
+            parsed, split, info.MergedLines, file_size(out_path.c_str()), info.ProbeCount,
+            (info.GridMaxX + 1) * (info.GridMaxY + 1), info.Adaptive? "true" : "false",
+            info.Adaptive? info.UniformProbeCount : info.ProbeCount, (double)info.ProbeTravel, (double)info.ProbeTravelSerpentine);
+    print_stage("parse", parse, in_mb, false);
+    print_stage("load_split", load, in_mb, false);
+    print_stage("interpolate", interp, in_mb, false);
+    print_stage("output", output, out_mb, true);
+    printf("},\"total_seconds\":%.6f,\"mb_per_s\":%.2f,\"peak_rss_kb\":%ld",
+            total, (total > 0)? in_mb / total : 0.0, peak_rss_kb());
+    if (opt.Threads > 0)
+        printf(",\"concurrent_jobs\":%u,\"concurrent_match\":%s", opt.Threads, same? "true" : "false");
+    if (opt.Kernels) {
+        printf(",\"weight_kernels\":{");
+        for (size_t k = 0; k < kernels.size(); k++)
+            printf("%s\"%s\":%.6f", (k > 0)? "," : "", WeightKernelName((int)k), kernels[k]);
+        printf("},\"weight_kernel_ns_per_point\":{");
+        for (size_t k = WEIGHT_KERNEL_SCALAR; k < kernel_ns.size(); k++)
+            printf("%s\"%s\":%.2f", (k > WEIGHT_KERNEL_SCALAR)? "," : "", WeightKernelName((int)k), kernel_ns[k]);
+        printf("},\"weight_kernels_match\":%s", kernels_same? "true" : "false");
+    }
+    if (opt.JobThreads > 0) {
+        static const char *names[2] = { "parse", "interpolate" };
+
+        printf(",\"job_threads\":%u,\"parse_chunks\":%u,\"threaded\":{", opt.JobThreads, threaded.Chunks);
+        for (int s = 0; s < 2; s++) {
+            double one = threaded.Seconds[s][0], many = threaded.Seconds[s][1];
+
+            printf("%s\"%s\":{\"serial_seconds\":%.6f,\"seconds\":%.6f,\"speedup\":%.2f}", (s > 0)? "," : "",
+                    names[s], one, many, (many > 0)? one / many : 0.0);
+        }
+        printf("},\"threaded_match\":%s", threaded_same? "true" : "false");
+    }
+    printf("}\n");
+    fflush(stdout);
+
+    if (!opt.Keep) {
+        remove(in_path.c_str());
+        remove(out_path.c_str());
+    }
+
+    return same && kernels_same && threaded_same;
+}
+
+/*
+ * Runs the generated file on every grid size with both surface models and
+ * prints how far the compensated Z strays from the board, one line of
+ * JSON each.  The board is the one --compare gives the probes, or a dense
+ * height map measured beforehand.
+ */
+static bool surface_report(const EtchParams &params, const BenchOptions &opt, const vector<double> &grids, const char *reference_path)
+{
+    static const int models[2] = { SURFACE_BILINEAR, SURFACE_BICUBIC };
+    static const char *names[2] = { "bilinear", "bicubic" };
+    string in_path = opt.Dir + "/surface-report.ngc";
+    string out_path = opt.Dir + "/surface-report.out.ngc";
+    HeightMap reference;
+
+    if (reference_path != NULL && !reference.load(reference_path)) {
+        fprintf(stderr, "Unable to read height map: %s\n", reference_path);
+        return false;
+    }
+    if (GenerateEtchFile(in_path.c_str(), params) == 0) {
+        fprintf(stderr, "Unable to write file: %s\n", in_path.c_str());
+        return false;
+    }
+
+    for (size_t g = 0; g < grids.size(); g++) {
+        for (int m = 0; m < 2; m++) {
+            PCBProbeJob job;
+            SurfaceError error;
+            string why;
+
+            setup_job(job, opt, grids[g]);
+            job.info.Surface = models[m];
+            run_job(job, in_path, out_path);
+
+            if (!MeasureSurfaceError(out_path.c_str(), (reference_path != NULL)? &reference : NULL, error, why)) {
+                fprintf(stderr, "%s\n", why.c_str());
+                return false;
+            }
+
+            printf("{\"surface\":\"%s\",\"grid\":%g,\"reference\":\"%s\",\"probes\":%u,\"points\":%lu,"
+                    "\"max_error\":%.5f,\"rms_error\":%.5f,\"output_bytes\":%llu}\n",
+                    names[m], grids[g], (reference_path != NULL)? reference_path : "synthetic", job.info.ProbeCount,
+                    error.Points, error.MaxError, error.RMSError, file_size(out_path.c_str()));
+        }
+    }
+
+    if (!opt.Keep) {
+        remove(in_path.c_str());
+        remove(out_path.c_str());
+    }
+
+    return true;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "       %s --generate=<file> [generator options]\n"
+            "       %s --compare=<file>,<file>\n"
+            "       %s --surface-report[=<mm>,<mm>...] [--reference=<map>] [generator options]\n"
+            "\n"
+            "Options:\n"
+            "  --scenario=<name>    Run only this scenario (can be repeated)\n"
+            "  --scale=<f>          Multiply the line count of every scenario\n"
+            "  --repeat=<n>         Runs per scenario, the best time is kept (default 3)\n"
+            "  --grid=<mm>          Grid size (default 5)\n"
+            "  --dir=<path>         Where the files are written (default /tmp)\n"
+            "  --keep               Keep the generated files\n"
+            "  --adaptive           Use the adaptive probe mesh\n"
+            "  --threads=<n>        Also run n jobs at once and check they match serial runs\n"
+            "  --kernels            Also time the interpolation with every weight kernel\n"
+            "  --job-threads=<n>    Also time parsing and interpolation on n threads and\n"
+            "                       check the output matches\n"
+            "  --merge-tolerance=<mm>\n"
+            "                       Merge nearly collinear cutting moves (default 0, off)\n"
+            "  --list               List the scenarios\n"
+            "\n"
+            "Surface report:\n"
+            "  --surface-report[=<mm>,<mm>...]\n"
+            "                       Error of the bilinear and bicubic surfaces against\n"
+            "                       the board on these grid sizes (default 2.5 to 15)\n"
+            "  --reference=<map>    The board is this dense height map instead of the\n"
+            "                       made up one, set --size and --units to match it\n"
+            "\n"
+            "Generator options:\n"
+            "  --style=pcb-gcode|pcb2gcode\n"
+            "  --units=mm|inch\n"
+            "  --size=<w>x<h>       Board size in mm\n"
+            "  --lines=<n>\n"
+            "  --dense=<f>          Share of lines in fine pitch areas\n"
+            "  --long=<f>           Share of lines in long traces\n"
+            "  --drill=<f>          Share of lines that are G82 drill spots\n"
+            "  --islands=<n>        Copper only in n scattered areas\n"
+            "  --arcs               Cut round pads as G03 circles\n"
+            "  --seed=<n>\n",
+            progname, progname, progname, progname);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    EtchParams params;
+    const char *generate = NULL;
+    const char *compare = NULL;
+    const char *reference = NULL;
+    bool report = false;
+    vector<double> grids;
+    BenchOptions opt;
+    bool selected[sizeof(scenarios) / sizeof(scenarios[0])] = { false };
+    bool any_selected = false;
+    const unsigned int nscenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+    params.SetDefaults();
+    opt.Scale = 1;
+    opt.Repeat = 3;
+    opt.Grid = 5;
+    opt.Merge = 0;
+    opt.Adaptive = false;
+    opt.Threads = 0;
+    opt.Kernels = false;
+    opt.JobThreads = 0;
+    opt.Dir = "/tmp";
+    opt.Keep = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = strchr(arg, '=');
+
+        value = (value != NULL)? value + 1 : "";
+
+        if (strncmp(arg, "--generate=", 11) == 0) {
+            generate = value;
+        } else if (strncmp(arg, "--compare=", 10) == 0) {
+            compare = value;
+        } else if (strncmp(arg, "--surface-report", 16) == 0 && (arg[16] == '\0' || arg[16] == '=')) {
+            report = true;
+            for (const char *p = value; *p != '\0'; p += (*p == ',')) {
+                char *end;
+
+                grids.push_back(strtod(p, &end));
+                if (end == p || grids.back() <= 0)
+                    usage(argv[0]);
+                p = end;
+            }
+        } else if (strncmp(arg, "--reference=", 12) == 0) {
+            reference = value;
+        } else if (strncmp(arg, "--style=", 8) == 0) {
+            params.Style = (strcmp(value, "pcb2gcode") == 0)? ETCH_PCB2GCODE : ETCH_PCB_GCODE;
+        } else if (strncmp(arg, "--units=", 8) == 0) {
+            params.UnitType = (strcmp(value, "inch") == 0)? UNIT_INCHES : UNIT_MM;
+        } else if (strncmp(arg, "--size=", 7) == 0) {
+            if (sscanf(value, "%lfx%lf", &params.Width, &params.Height) != 2)
+                usage(argv[0]);
+        } else if (strncmp(arg, "--lines=", 8) == 0) {
+            params.Lines = strtoul(value, NULL, 10);
+        } else if (strncmp(arg, "--dense=", 8) == 0) {
+            params.DenseFraction = atof(value);
+        } else if (strncmp(arg, "--long=", 7) == 0) {
+            params.LongFraction = atof(value);
+        } else if (strncmp(arg, "--drill=", 8) == 0) {
+            params.DrillFraction = atof(value);
+        } else if (strncmp(arg, "--islands=", 10) == 0) {
+            params.Islands = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--arcs") == 0) {
+            params.Arcs = true;
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            params.Seed = strtoull(value, NULL, 10);
+        } else if (strncmp(arg, "--scenario=", 11) == 0) {
+            unsigned int k;
+
+            for (k = 0; k < nscenarios && strcmp(scenarios[k].Name, value) != 0; k++)
+                ;
+            if (k == nscenarios) {
+                fprintf(stderr, "Unknown scenario: %s\n", value);
+                exit(1);
+            }
+            selected[k] = any_selected = true;
+        } else if (strncmp(arg, "--scale=", 8) == 0) {
+            opt.Scale = atof(value);
+        } else if (strncmp(arg, "--repeat=", 9) == 0) {
+            opt.Repeat = atoi(value);
+        } else if (strncmp(arg, "--grid=", 7) == 0) {
+            opt.Grid = atof(value);
+        } else if (strncmp(arg, "--dir=", 6) == 0) {
+            opt.Dir = value;
+        } else if (strncmp(arg, "--merge-tolerance=", 18) == 0) {
+            opt.Merge = atof(value);
+        } else if (strcmp(arg, "--adaptive") == 0) {
+            opt.Adaptive = true;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            opt.Threads = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--kernels") == 0) {
+            opt.Kernels = true;
+        } else if (strncmp(arg, "--job-threads=", 14) == 0) {
+            opt.JobThreads = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--keep") == 0) {
+            opt.Keep = true;
+        } else if (strcmp(arg, "--list") == 0) {
+            for (unsigned int k = 0; k < nscenarios; k++)
+                printf("%s\n", scenarios[k].Name);
+            return 0;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (generate != NULL) {
+        unsigned long lines = GenerateEtchFile(generate, params);
+
+        if (lines == 0) {
+            fprintf(stderr, "Unable to write file: %s\n", generate);
+            return 1;
+        }
+        fprintf(stderr, "%s: %lu lines\n", generate, lines);
+        return 0;
+    }
+
+    if (compare != NULL) {
+        string a = compare, why;
+        size_t comma = a.find(',');
+
+        if (comma == string::npos)
+            usage(argv[0]);
+        if (!CompareOutputs(a.substr(0, comma).c_str(), a.substr(comma + 1).c_str(), why)) {
+            fprintf(stderr, "%s\n", why.c_str());
+            return 1;
+        }
+        fprintf(stderr, "%s: the same to the digits printed\n", compare);
+        return 0;
+    }
+
+    if (report) {
+        static const double default_grids[] = { 2.5, 5, 7.5, 10, 12.5, 15 };
+
+        if (grids.empty())
+            grids.assign(default_grids, default_grids + sizeof(default_grids) / sizeof(default_grids[0]));
+
+        try {
+            return surface_report(params, opt, grids, reference)? 0 : 1;
+        } catch (const ProbeError &e) {
+            fprintf(stderr, "%s\n", e.what());
+            return e.getStatus();
+        }
+    }
+
+    if (opt.Scale <= 0 || opt.Repeat < 1 || opt.Grid <= 0 || opt.Merge < 0)
+        usage(argv[0]);
+
+    bool same = true;
+
+    try {
+        for (unsigned int k = 0; k < nscenarios; k++) {
+            if (!any_selected || selected[k])
+                same = run_scenario(scenarios[k], opt) && same;
+        }
+    } catch (const ProbeError &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return e.getStatus();
+    }
+
+    return same? 0 : 1;
+}
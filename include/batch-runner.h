@@ -0,0 +1,56 @@
+/*
+ * File:   batch-runner.h
+ *
+ * Runs the whole pipeline on many etch files at once.  Every file is a
+ * job of its own on a pool of threads with a queue per thread, idle
+ * threads steal from the others.  The largest files are started first so
+ * a big one doesn't end up running alone at the end.
+ */
+
+#ifndef BATCH_RUNNER_H
+#define	BATCH_RUNNER_H
+
+#include <string>
+#include <vector>
+#include "pcb-probe.h"
+
+using namespace std;
+
+struct BatchFile
+{
+    string InPath;
+    string OutPath;
+    unsigned long long Size;    //Input bytes
+
+    //Filled in by RunBatch
+    int Status;                 //0, or the ProbeError status (PROBE_ERROR_FILE for other exceptions)
+    string Error;
+    unsigned int ProbeCount;
+    double Seconds;
+    bool CacheSkipped;          //Cache was set but the toolpath cache was neither used nor written
+    string Stats;               //The --stats report of the job, if enabled
+};
+
+struct BatchOptions
+{
+    PCBProbeInfo Info;          //Options every job starts from
+    const char *HeightMapPath;  //NULL for none
+    bool Stats;
+    bool StatsJSON;
+    bool Cache;                 //Keep a toolpath cache next to every input
+    unsigned int Threads;
+};
+
+/*
+ * Reads a list of "infile [outfile]" lines, or every G-Code file in a
+ * directory.  Files without an output go to outDir with the same name.
+ * Throws a ProbeError if the list can't be read or an output is missing.
+ */
+void ReadBatchList(const char *path, const char *outDir, vector<BatchFile> &files);
+
+/*
+ * Processes every file, returns the wall time in seconds
+ */
+double RunBatch(vector<BatchFile> &files, const BatchOptions &options);
+
+#endif	/* BATCH_RUNNER_H */
@@ -0,0 +1,79 @@
+/*
+ * File:   cell-grid.h
+ *
+ * Dense per-cell storage for the probe grid, one value per cell in a flat
+ * row major array.  Cells outside the grid (drill spots beyond the etched
+ * area end up there) are kept aside in a map so nothing gets lost.
+ */
+
+#ifndef CELL_GRID_H
+#define	CELL_GRID_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+template <typename T>
+class CellGrid {
+public:
+    CellGrid()
+    {
+        width = 0;
+        height = 0;
+    }
+
+    /*
+     * Sizes the grid to width x height cells, all set to T()
+     */
+    void reset(unsigned int width, unsigned int height)
+    {
+        this->width = width;
+        this->height = height;
+        cells.assign((size_t)width * height, T());
+        outside.clear();
+    }
+
+    bool inside(unsigned int gx, unsigned int gy) const
+    {
+        return gx < width && gy < height;
+    }
+
+    T &at(unsigned int gx, unsigned int gy)
+    {
+        if (inside(gx, gy))
+            return cells[(size_t)gy * width + gx];
+
+        return outside[((unsigned long long)gx << 32) | gy];
+    }
+
+    T get(unsigned int gx, unsigned int gy) const
+    {
+        if (inside(gx, gy))
+            return cells[(size_t)gy * width + gx];
+
+        typename map<unsigned long long, T>::const_iterator it = outside.find(((unsigned long long)gx << 32) | gy);
+
+        return (it != outside.end())? it->second : T();
+    }
+
+    unsigned int getWidth() const
+    {
+        return width;
+    }
+
+    unsigned int getHeight() const
+    {
+        return height;
+    }
+
+private:
+    unsigned int width;
+    unsigned int height;
+    vector<T> cells;
+    map<unsigned long long, T> outside;
+};
+
+#endif	/* CELL_GRID_H */
+
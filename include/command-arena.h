@@ -0,0 +1,165 @@
+/*
+ * File:   command-arena.h
+ *
+ * Chunked storage for the G-Code program.  Commands are stored in fixed
+ * size chunks that never move, so indexes and references stay valid while
+ * new commands are appended, and all memory is released at once.  What
+ * a command has past its fixed sizes is kept in a table of the arena,
+ * copied there as the command is stored.
+ */
+
+#ifndef COMMAND_ARENA_H
+#define	COMMAND_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include "parser.h"
+
+#define ARENA_CHUNK_SHIFT   12
+#define ARENA_CHUNK_SIZE    (1 << ARENA_CHUNK_SHIFT) //Commands per chunk
+
+class CommandArena {
+public:
+    CommandArena()
+    {
+        count = 0;
+        capacity = 0;
+        extras = new ExtraTable();
+    }
+
+    ~CommandArena()
+    {
+        clear();
+        delete extras;
+    }
+
+    /*
+     * Makes room for at least n commands using a single allocation
+     */
+    void reserve(size_t n)
+    {
+        if (n <= capacity)
+            return;
+
+        size_t nchunks = (n - capacity + ARENA_CHUNK_SIZE - 1) >> ARENA_CHUNK_SHIFT;
+        addBlock(nchunks);
+    }
+
+    size_t push_back(const GCodeCommand &command)
+    {
+        if (count == capacity)
+            addBlock(1);
+
+        size_t index = count++;
+        put(index, command);
+
+        return index;
+    }
+
+    /*
+     * Appends n commands to be filled in with put(), threads can fill
+     * separate ranges at once.  Returns the index of the first one.
+     */
+    size_t extend(size_t n)
+    {
+        reserve(count + n);
+
+        size_t first = count;
+        count += n;
+
+        return first;
+    }
+
+    void put(size_t index, const GCodeCommand &command)
+    {
+        GCodeCommand *stored = new (&(*this)[index]) GCodeCommand(command);
+
+        stored->extraTable = extras;
+        if (command.extra != NULL)
+            stored->extra = extras->add(*command.extra);
+    }
+
+    GCodeCommand &operator[](size_t index)
+    {
+        return chunks[index >> ARENA_CHUNK_SHIFT][index & (ARENA_CHUNK_SIZE - 1)];
+    }
+
+    const GCodeCommand &operator[](size_t index) const
+    {
+        return chunks[index >> ARENA_CHUNK_SHIFT][index & (ARENA_CHUNK_SIZE - 1)];
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    void swap(CommandArena &other)
+    {
+        blocks.swap(other.blocks);
+        chunks.swap(other.chunks);
+        std::swap(count, other.count);
+        std::swap(capacity, other.capacity);
+        std::swap(extras, other.extras);
+    }
+
+    /*
+     * Drops the commands from n on, their memory is kept for reuse.  The
+     * extras go too once no command is left, before that a dropped
+     * command may have been moved down and still share its extra.
+     */
+    void truncate(size_t n)
+    {
+        if (n < count)
+            count = n;
+        if (count == 0)
+            extras->clear();
+    }
+
+    /*
+     * Releases every command, GCodeCommand has no destructor to run
+     */
+    void clear()
+    {
+        for (size_t i = 0; i < blocks.size(); i++)
+            ::operator delete(blocks[i]);
+
+        blocks.clear();
+        chunks.clear();
+        count = 0;
+        capacity = 0;
+        extras->clear();
+    }
+
+private:
+    CommandArena(const CommandArena &);
+    CommandArena &operator=(const CommandArena &);
+
+    void addBlock(size_t nchunks)
+    {
+        GCodeCommand *block = static_cast<GCodeCommand *>(
+                ::operator new(nchunks * ARENA_CHUNK_SIZE * sizeof(GCodeCommand)));
+
+        blocks.push_back(block);
+        for (size_t i = 0; i < nchunks; i++)
+            chunks.push_back(block + i * ARENA_CHUNK_SIZE);
+
+        capacity += nchunks * ARENA_CHUNK_SIZE;
+    }
+
+    vector<GCodeCommand *> blocks;  //Allocations, a block holds one or more chunks
+    vector<GCodeCommand *> chunks;
+    size_t count;
+    size_t capacity;
+    ExtraTable *extras;     //On the heap, the extraTable of the commands stays right through swap()
+};
+
+#endif	/* COMMAND_ARENA_H */
+
@@ -0,0 +1,91 @@
+/*
+ * File:   gcode-reader.h
+ *
+ * Memory mapped G-Code input.  Lines are handed out as views into the
+ * mapping, nothing is copied.
+ */
+
+#ifndef GCODE_READER_H
+#define	GCODE_READER_H
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+#define READER_RELEASE_BYTES    (4 << 20)   //Read text given back at a time with setRelease
+
+class GCodeReader {
+public:
+    GCodeReader();
+    ~GCodeReader();
+
+    bool open(const char *path);
+    void close();
+
+    /*
+     * Returns the next line without its '\n', like getline() the text after
+     * the last newline is returned as a final (possibly empty) line
+     */
+    bool nextLine(string_view &line)
+    {
+        if (pos > length)
+            return false;
+
+        const char *start = data + pos;
+        const char *nl = static_cast<const char *>(memchr(start, '\n', length - pos));
+        size_t len = (nl != NULL)? (size_t)(nl - start) : length - pos;
+
+        line = string_view(start, len);
+        pos += len + 1;
+        if (pos >= releaseAt)
+            release();
+
+        return true;
+    }
+
+    /*
+     * With release set, the pages of a mapped file are dropped from memory
+     * once read, so reading a file from start to end doesn't keep it
+     * resident.  They are read again if needed.
+     */
+    void setRelease(bool release);
+
+    /*
+     * Starts again from the first line
+     */
+    void rewind()
+    {
+        pos = 0;
+        releaseAt = releasing? READER_RELEASE_BYTES : (size_t)-1;
+    }
+
+    string_view contents() const
+    {
+        return string_view(data, length);
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    GCodeReader(const GCodeReader &);
+    GCodeReader &operator=(const GCodeReader &);
+
+    void release();
+
+    const char *data;
+    size_t length;
+    size_t pos;
+    size_t releaseAt;   //Where the pages before pos are next dropped
+    bool releasing;
+    bool mapped;
+    vector<char> buffer;    //File contents when it can't be mapped
+};
+
+#endif	/* GCODE_READER_H */
+
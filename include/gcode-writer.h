@@ -0,0 +1,98 @@
+/*
+ * File:   gcode-writer.h
+ *
+ * Buffered G-Code output.  Text is formatted straight into one reusable
+ * buffer that is written out in large blocks, numbers are formatted by
+ * hand and give the same text as an ostream in the "C" locale.
+ */
+
+#ifndef GCODE_WRITER_H
+#define	GCODE_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "parser.h"
+
+using namespace std;
+
+#define WRITER_BUFFER_SIZE  (1 << 20)
+#define WRITER_MAX_FIELD    64      //Longest single formatted value
+#define WRITER_CUBIC_TERMS  8       //Bicubic terms on the line itself, LinuxCNC reads at most 255 characters
+#define WRITER_CUBIC_PARAM  8       //Holds the other terms, set on a line of its own just before
+
+class GCodeWriter {
+public:
+    GCodeWriter();
+    ~GCodeWriter();
+
+    /*
+     * A NULL path writes nothing and only counts the bytes
+     */
+    bool open(const char *path);
+
+    /*
+     * Flushes and closes the file, returns false if anything failed to
+     * be written
+     */
+    bool close();
+
+    GCodeWriter &operator<<(const char *text)
+    {
+        write(text, strlen(text));
+        return *this;
+    }
+
+    GCodeWriter &operator<<(char c)
+    {
+        reserve(1);
+        buffer[used++] = c;
+        return *this;
+    }
+
+    GCodeWriter &operator<<(int n);
+    GCodeWriter &operator<<(unsigned int n);
+
+    /*
+     * Same as an ostream with its default precision of 6 significant digits
+     */
+    GCodeWriter &operator<<(Real value);
+
+    /*
+     * Same as an ostream with fixed and precision(decimals)
+     */
+    void putFixed(Real value, int decimals);
+
+    /*
+     * Z with a formula is written from quad or cubic when one is given
+     */
+    void putCommand(const GCodeCommand &command, const QuadFormula *quad = NULL, const CubicFormula *cubic = NULL);
+
+    void write(const char *data, size_t length);
+
+    unsigned long long size() const
+    {
+        return written + used;
+    }
+
+private:
+    GCodeWriter(const GCodeWriter &);
+    GCodeWriter &operator=(const GCodeWriter &);
+
+    void reserve(size_t n)
+    {
+        if (used + n > buffer.size())
+            flush();
+    }
+
+    void flush();
+
+    FILE *file;
+    vector<char> buffer;
+    size_t used;
+    unsigned long long written;
+    bool failed;
+};
+
+#endif	/* GCODE_WRITER_H */
+
@@ -0,0 +1,185 @@
+/*
+ * File:   height-map.h
+ *
+ * Measured board heights, read from a LinuxCNC probe log (x y z ... per
+ * line) or a CSV of x,y,z, kept as a dense grid for bilinear or bicubic
+ * lookups.
+ */
+
+#ifndef HEIGHT_MAP_H
+#define	HEIGHT_MAP_H
+
+#include <vector>
+#include "parser.h"
+
+using namespace std;
+
+#define HEIGHTMAP_LEVEL_TOLERANCE   1e-4    //Points closer than this fraction of the map's extent share a row or column
+#define HEIGHTMAP_MAX_FILL          4       //A lattice may have this many nodes per point before it counts as scattered
+
+#define SURFACE_BILINEAR    0   //Blend of the four nodes around a point
+#define SURFACE_BICUBIC     1   //Catmull-Rom patch over the sixteen around it
+
+/*
+ * Catmull-Rom weights of the nodes before, at the start, at the end and
+ * after the span a point is t of the way along.  They add up to 1, the
+ * curve goes through every node.
+ */
+inline void CatmullRomWeights(Real t, Real w[4])
+{
+    Real t2 = t * t;
+    Real t3 = t2 * t;
+
+    w[0] = (-t3 + 2 * t2 - t) / 2;
+    w[1] = (3 * t3 - 5 * t2 + 2) / 2;
+    w[2] = (-3 * t3 + 4 * t2 + t) / 2;
+    w[3] = (t3 - t2) / 2;
+}
+
+/*
+ * The nodes a bicubic patch weighs along one axis and their weights, u in
+ * nodes from the first one.  Past the outer nodes the surface stays
+ * level.  The node the first and last spans lack is carried on in a
+ * straight line from the two inside it.  Returns how many nodes there
+ * are, one to four.
+ */
+inline int CubicAxis(Real u, unsigned int lastNode, unsigned int nodes[4], Real weights[4])
+{
+    Real w[4];
+
+    if (lastNode == 0) {
+        nodes[0] = 0;
+        weights[0] = 1;
+        return 1;
+    }
+
+    if (!(u > 0))
+        u = 0;
+    if (u > lastNode)
+        u = lastNode;
+
+    int first = (u >= lastNode)? (int)lastNode - 1 : (int)u;
+    int lo = (first > 0)? first - 1 : 0;
+    int hi = (first + 2 <= (int)lastNode)? first + 2 : (int)lastNode;
+    int count = hi - lo + 1;
+
+    CatmullRomWeights(u - first, w);
+    for (int k = 0; k < count; k++) {
+        nodes[k] = (unsigned int)(lo + k);
+        weights[k] = w[lo + k - first + 1];
+    }
+    if (first == 0) {
+        weights[0] += 2 * w[0];
+        weights[1] -= w[0];
+    }
+    if (first + 2 > (int)lastNode) {
+        weights[count - 1] += 2 * w[3];
+        weights[count - 2] -= w[3];
+    }
+
+    return count;
+}
+
+class HeightMap {
+public:
+    HeightMap();
+
+    /*
+     * Returns false if the file can't be read or has no points
+     */
+    bool load(const char *path);
+
+    /*
+     * Bilinear height at (x, y), points outside take the height of the
+     * nearest edge
+     */
+    Real at(Real x, Real y) const
+    {
+        Real u = (x - originX) * invStepX;
+        Real v = (y - originY) * invStepY;
+        unsigned int i = cell(u, nodesX);
+        unsigned int j = cell(v, nodesY);
+        Real fu = (nodesX > 1)? clampFraction(u - i) : 0;
+        Real fv = (nodesY > 1)? clampFraction(v - j) : 0;
+        const Real *row = &heights[(size_t)j * nodesX + i];
+        size_t dx = (nodesX > 1)? 1 : 0;
+        size_t dy = (nodesY > 1)? nodesX : 0;
+        Real bottom = row[0] + (row[dx] - row[0]) * fu;
+        Real top = row[dy] + (row[dy + dx] - row[dy]) * fu;
+
+        return bottom + (top - bottom) * fv;
+    }
+
+    /*
+     * Bicubic height at (x, y) through the same nodes, level past the
+     * outer ones
+     */
+    Real cubicAt(Real x, Real y) const;
+
+    bool contains(Real x, Real y) const
+    {
+        return x >= minX && x <= maxX && y >= minY && y <= maxY;
+    }
+
+    size_t getPointCount() const
+    {
+        return pointCount;
+    }
+
+    unsigned int getNodesX() const
+    {
+        return nodesX;
+    }
+
+    unsigned int getNodesY() const
+    {
+        return nodesY;
+    }
+
+    Real getOriginX() const
+    {
+        return originX;
+    }
+
+    Real getOriginY() const
+    {
+        return originY;
+    }
+
+    Real getStepX() const
+    {
+        return stepX;
+    }
+
+    Real getStepY() const
+    {
+        return stepY;
+    }
+
+private:
+    static unsigned int cell(Real u, unsigned int nodes)
+    {
+        if (nodes < 2 || !(u > 0))
+            return 0;
+
+        return (u >= nodes - 1)? nodes - 2 : (unsigned int)u;
+    }
+
+    static Real clampFraction(Real f)
+    {
+        return (f < 0)? 0 : (f > 1)? 1 : f;
+    }
+
+    void fill(vector<unsigned char> &known);
+
+    vector<Real> heights;   //Row major, nodesX by nodesY
+    unsigned int nodesX, nodesY;
+    Real originX, originY;
+    Real stepX, stepY;
+    Real invStepX, invStepY;
+    Real minX, minY, maxX, maxY;
+    size_t pointCount;
+};
+
+#endif	/* HEIGHT_MAP_H */
+
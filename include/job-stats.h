@@ -0,0 +1,116 @@
+/*
+ * File:   job-stats.h
+ *
+ * Where the time of a job goes and how much work each stage did.  Every
+ * stage sets its own figures when it runs.  The counters are plain
+ * additions done once per stage or per move, the clock is only read when
+ * the stats are enabled.
+ */
+
+#ifndef JOB_STATS_H
+#define	JOB_STATS_H
+
+#include <chrono>
+#include <ostream>
+
+using namespace std;
+
+enum JobStage {
+    STAGE_HEIGHTMAP,
+    STAGE_PARSE,
+    STAGE_SPLIT,
+    STAGE_MERGE,
+    STAGE_INTERPOLATE,
+    STAGE_OUTPUT,
+    STAGE_COUNT
+};
+
+/*
+ * The queues between the threads of a pipelined pass
+ */
+enum PipelineQueue {
+    QUEUE_READ,         //Parsed commands on their way to be split and compensated
+    QUEUE_WRITE,        //Compensated commands on their way to be written
+    QUEUE_COUNT
+};
+
+/*
+ * How one queue of batches went, added up over the passes
+ */
+struct QueueStats
+{
+    unsigned long Batches;
+    unsigned long long OccupancySum;    //Batches queued after every one sent
+    unsigned int MaxOccupancy;
+    unsigned int Capacity;
+    unsigned long ProducerStalls;       //Times the producer waited for an empty batch
+    double ProducerStallSeconds;
+    unsigned long ConsumerStalls;       //Times the consumer waited for a full one
+    double ConsumerStallSeconds;
+};
+
+struct JobStats
+{
+    bool Enabled;
+    double Seconds[STAGE_COUNT];
+
+    unsigned long LinesParsed;
+    unsigned int ParseChunks;       //Pieces of the file parsed at once, 1 for a single pass
+    unsigned long CommandsStored;   //Commands kept from the input file
+    unsigned long MovesSplit;       //Cutting moves cut in more than one piece
+    unsigned long PiecesAdded;      //Moves added by splitting
+    unsigned long MostPieces;       //Most pieces a single move was cut in
+    unsigned long Interpolations;   //Points given a Z formula
+    unsigned long CellsAllocated;   //Cells given a variable
+    unsigned long long OutputBytes;
+    bool Pipelined;                 //The passes ran as a pipeline of threads
+    QueueStats Queues[QUEUE_COUNT];
+};
+
+class PCBProbeJob;
+
+/*
+ * Times a stage until stop() is called or it goes out of scope
+ */
+class StageTimer {
+public:
+    StageTimer(JobStats &stats, JobStage stage) : stats(stats)
+    {
+        this->stage = stage;
+        running = stats.Enabled;
+        if (running)
+            start = chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        stop();
+    }
+
+    void stop()
+    {
+        if (running) {
+            stats.Seconds[stage] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            running = false;
+        }
+    }
+
+private:
+    JobStats &stats;
+    JobStage stage;
+    bool running;
+    chrono::steady_clock::time_point start;
+};
+
+const char *StageName(JobStage stage);
+const char *QueueName(PipelineQueue queue);
+
+/*
+ * Peak resident memory of the process in KB, 0 if it is not known
+ */
+long PeakMemoryKB();
+
+void PrintStats(ostream &out, const PCBProbeJob &job, double totalSeconds);
+void PrintStatsJSON(ostream &out, const PCBProbeJob &job, double totalSeconds);
+
+#endif	/* JOB_STATS_H */
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   parser.h
  * Author: ideras
  *
@@ -9,122 +9,387 @@
 #define	PARSER_H
 
 #include <string>
-#include <map>
+#include <cstring>
+#include <string_view>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
 
 using namespace std;
 
+/*
+ * Every coordinate, argument and weight.  Build with -DPCBPROBE_REAL_DOUBLE
+ * for double: half the memory and SSE instead of x87 arithmetic, while the
+ * output agrees to the digits printed (inputs are read as double anyway).
+ */
+#ifdef PCBPROBE_REAL_DOUBLE
+typedef double Real;
+#else
 typedef long double Real;
+#endif
+
+/*
+ * Commands the processing stages dispatch on, everything else
+ * is carried through as GCODE_OTHER with its original name
+ */
+enum GCodeOpcode {
+    GCODE_NONE,     //Empty line or comment only
+    GCODE_G00,
+    GCODE_G01,
+    GCODE_G02,      //Clockwise arc
+    GCODE_G03,      //Counterclockwise arc
+    GCODE_G20,
+    GCODE_G21,
+    GCODE_G82,
+    GCODE_M,
+    GCODE_S,
+    GCODE_OTHER
+};
+
+#define GCODE_MAX_NAME      15  //Longest command name kept in place (G38.2, S20000, ...)
+#define GCODE_MAX_ARGS      8   //Distinct argument letters kept in place
+#define GCODE_MAX_WORDS     12  //Argument words kept in place, repeated letters included
+
+//Exit status of the command line tool for every kind of error
+#define PROBE_ERROR_FILE        1
+#define PROBE_ERROR_SYNTAX      2
+#define PROBE_ERROR_ARGUMENTS   3
+
+/*
+ * Thrown when a file can't be read, parsed or written
+ */
+class ProbeError : public runtime_error {
+public:
+    ProbeError(int status, const string &message) : runtime_error(message)
+    {
+        this->status = status;
+    }
+
+    int getStatus() const
+    {
+        return status;
+    }
+
+private:
+    int status;
+};
+
+/*
+ * Interpolated Z: w0*#v0 + w1*#v1 + w2*#v2 + w3*#v3 + #depthParam
+ */
+struct ZFormula {
+    Real weights[4];
+    int vars[4];
+    int depthParam;
+};
+
+/*
+ * Interpolated Z from the coefficient parameters of a grid quad:
+ * #param + u*#(param+1) + v*#(param+2) + u*v*#(param+3), the depth is part
+ * of #param.  A quad flat along X has no u terms, one flat along Y no v
+ * terms, and the parameters after #param are numbered without them.
+ */
+struct QuadFormula {
+    int param;
+    bool hasU;
+    bool hasV;
+    Real u;
+    Real v;
+};
+
+#define CUBIC_TERMS     16      //Nodes of a bicubic patch
 
+/*
+ * Interpolated Z from the nodes of a bicubic patch: w0*#v0 + ... +
+ * w(count-1)*#v(count-1) + #depthParam, some weights are negative
+ */
+struct CubicFormula {
+    int count;
+    Real weights[CUBIC_TERMS];
+    int vars[CUBIC_TERMS];
+    int depthParam;
+};
+
+/*
+ * What doesn't fit in place in a GCodeCommand: a longer name, the letters
+ * past its slots with their values, and the words past argWords
+ */
+struct GCodeExtra {
+    string name;
+    string letters;
+    vector<Real> values;
+    string words;
+};
+
+/*
+ * The GCodeExtra of the commands of one CommandArena, or of the command a
+ * loop parses into.  They are changed in place, one a command lets go of
+ * is used again, and all of them are freed at once.  Lines that need one
+ * are rare, so add and release take a lock and threads filling the same
+ * arena can share it.
+ */
+class ExtraTable {
+public:
+    GCodeExtra *add();
+    GCodeExtra *add(const GCodeExtra &extra);
+    void release(GCodeExtra *extra);
+    void clear();
+
+private:
+    deque<GCodeExtra> items;    //Never move, commands point to them
+    vector<GCodeExtra *> unused;
+    mutex lock;
+};
+
+/*
+ * Fixed layout G-Code command, no heap memory is used.  Argument values are
+ * kept in slots ordered by letter, argMask has one bit per letter so the
+ * slot of a letter is the number of lower letters present.  argWords keeps
+ * the letters in the order they must be written out.  Anything past the
+ * fixed sizes goes to extra, NULL for nearly every command.
+ */
 struct GCodeCommand {
 
-    GCodeCommand(string name, Real x, Real y) {
-        this->name = name;
-        argNameList = "XY";
-        arguments['X'] = x;
-        arguments['Y'] = y;
-        zformula = "";
+    GCodeCommand(int opcode, const char *name, Real x, Real y) {
+        extra = NULL;
+        extraTable = NULL;
+        Clear();
+        setName(opcode, name, strlen(name));
+        addArgument('X', x);
+        addArgument('Y', y);
     }
-    
+
     GCodeCommand()
     {
-        name = "";
-        zformula = "";
-        argNameList = "";
+        extra = NULL;
+        extraTable = NULL;
+        Clear();
+    }
+
+    void setName(int opcode, const char *name, unsigned int len) {
+        if (len > GCODE_MAX_NAME) {
+            setExtraName(name, len);
+            len = GCODE_MAX_NAME;
+        } else if (extra != NULL) {
+            extra->name.clear();
+        }
+
+        memcpy(this->name, name, len);
+        this->name[len] = '\0';
+        this->opcode = (unsigned char)opcode;
+    }
+
+    const char *getName() const {
+        return (extra != NULL && !extra->name.empty())? extra->name.c_str() : name;
     }
 
     void setXCoord(Real x) {
-        arguments['X'] = x;
+        setArgument('X', x);
     }
 
     void setYCoord(Real y) {
-        arguments['Y'] = y;
+        setArgument('Y', y);
     }
 
     void setZCoord(Real z) {
-        arguments['Z'] = z;
+        setArgument('Z', z);
     }
-    
-    void setZFormula(string &zformula) {
+
+    void setZFormula(const ZFormula &zformula) {
         if (!hasZCoord())
-            argNameList += "Z";
-        
+            addWord('Z');
+
         this->zformula = zformula;
+        hasZFormula = true;
     }
 
     void setFeedRate(Real f) {
-        arguments['F'] = f;
+        setArgument('F', f);
+    }
+
+    Real getXCoord() const {
+        return getArgument('X');
     }
 
-    Real getXCoord() {
-        return arguments['X'];
+    Real getYCoord() const {
+        return getArgument('Y');
     }
 
-    Real getYCoord() {
-        return arguments['Y'];
+    Real getZCoord() const {
+        return getArgument('Z');
     }
 
-    Real getZCoord() {
-        return arguments['Z'];
+    Real getFeedRate() const {
+        return getArgument('F');
     }
 
-    Real getFeedRate() {
-        return arguments['F'];
+    bool hasXCoord() const {
+        return hasArgument('X');
     }
 
-    bool hasXCoord() {
-        return arguments.find('X') != arguments.end();
+    bool hasYCoord() const {
+        return hasArgument('Y');
     }
 
-    bool hasYCoord() {
-        return arguments.find('Y') != arguments.end();
+    bool hasZCoord() const {
+        return hasArgument('Z');
     }
-    
-    bool hasZCoord() {
-        return arguments.find('Z') != arguments.end();
+
+    bool hasFeedRate() const {
+        return hasArgument('F');
+    }
+
+    bool hasArgument(char argName) const {
+        return (argMask & letterBit(argName)) != 0 ||
+               (extra != NULL && extra->letters.find(argName) != string::npos);
     }
 
-    bool hasFeedRate() {
-        return arguments.find('F') != arguments.end();
+    Real getArgument(char argName) const {
+        if (argMask & letterBit(argName))
+            return argValues[slotOf(argName)];
+        if (extra != NULL && extra->letters.find(argName) != string::npos)
+            return extra->values[extra->letters.find(argName)];
+
+        return 0;
+    }
+
+    /*
+     * Sets the value of an argument without writing it out
+     */
+    void setArgument(char argName, Real argValue) {
+        unsigned long long bit = letterBit(argName);
+        unsigned int slot = slotOf(argName);
+
+        if (!(argMask & bit)) {
+            if (argCount == GCODE_MAX_ARGS || (extra != NULL && extra->letters.find(argName) != string::npos)) {
+                setExtraArgument(argName, argValue);
+                return;
+            }
+
+            for (unsigned int i = argCount; i > slot; i--)
+                argValues[i] = argValues[i - 1];
+
+            argMask |= bit;
+            argCount++;
+        }
+        argValues[slot] = argValue;
     }
-    
+
     void addArgument(char argName, Real argValue)
     {
-        argNameList += argName;
-        arguments[argName] = argValue;
+        setArgument(argName, argValue);
+        addWord(argName);
     }
-    
-    void Clear()
+
+    /*
+     * Words in output order, argWords and then those of extra
+     */
+    unsigned int getWordCount() const
     {
-        arguments.clear();
-        name = "";
-        zformula = "";
-        argNameList = "";
+        return wordCount + ((extra != NULL)? (unsigned int)extra->words.size() : 0);
     }
-    
-    void operator=(GCodeCommand &cmd)
+
+    char getWord(unsigned int i) const
     {
-        Clear();
-        this->name = cmd.name;
-        argNameList = cmd.argNameList;
-        zformula = cmd.zformula;
-        
-        for (unsigned int i = 0; i < argNameList.length(); i++ ) {
-                char argName = argNameList[i];
-                Real value = arguments[argName];
-        
-                arguments[argName] = value;
+        return (i < wordCount)? argWords[i] : extra->words[i - wordCount];
+    }
+
+    /*
+     * Removes an argument and every word that writes it out
+     */
+    void removeArgument(char argName)
+    {
+        if (extra != NULL)
+            removeExtra(argName);
+
+        if (argMask & letterBit(argName)) {
+            unsigned int slot = slotOf(argName);
+
+            for (unsigned int i = slot + 1; i < argCount; i++)
+                argValues[i - 1] = argValues[i];
+
+            argMask &= ~letterBit(argName);
+            argCount--;
+        }
+
+        unsigned int n = 0;
+
+        for (unsigned int i = 0; i < wordCount; i++) {
+            if (argWords[i] != argName)
+                argWords[n++] = argWords[i];
         }
+        wordCount = n;
     }
-    
-    string ToString();
 
-    string name;
-    string zformula;     //Interpolation Formula for Z Coordinate
-    string argNameList;  //Argument Names
-    map<char, Real> arguments;
+    /*
+     * Gives extra back to extraTable, which is kept
+     */
+    void Clear()
+    {
+        opcode = GCODE_NONE;
+        name[0] = '\0';
+        argCount = 0;
+        wordCount = 0;
+        hasZFormula = false;
+        argMask = 0;
+        if (extra != NULL)
+            extraTable->release(extra);
+        extra = NULL;
+    }
+
+    static unsigned long long letterBit(char argName) {
+        if (argName >= 'A' && argName <= 'Z')
+            return 1ULL << (argName - 'A');
+        if (argName >= 'a' && argName <= 'z')
+            return 1ULL << (argName - 'a' + 26);
+
+        return 0;
+    }
+
+    unsigned char opcode;
+    unsigned char argCount;     //Used value slots
+    unsigned char wordCount;    //Used entries in argWords
+    bool hasZFormula;
+    char name[GCODE_MAX_NAME + 1];
+    char argWords[GCODE_MAX_WORDS];  //Argument Names, in output order
+    unsigned long long argMask;
+    Real argValues[GCODE_MAX_ARGS];
+    ZFormula zformula;     //Interpolation Formula for Z Coordinate
+    GCodeExtra *extra;
+    ExtraTable *extraTable;     //Where extra comes from, NULL outside an arena or parse loop
+
+private:
+    unsigned int slotOf(char argName) const {
+        return __builtin_popcountll(argMask & (letterBit(argName) - 1));
+    }
+
+    void addWord(char argName) {
+        if (wordCount == GCODE_MAX_WORDS)
+            addExtraWord(argName);
+        else
+            argWords[wordCount++] = argName;
+    }
+
+    //Change extra in place, taking one from extraTable if there is none
+    GCodeExtra &ownExtra();
+    void setExtraName(const char *name, unsigned int len);
+    void setExtraArgument(char argName, Real argValue);
+    void addExtraWord(char argName);
+    void removeExtra(char argName);
 };
 
-void ParseGCodeLine(string &line, GCodeCommand &command);
+/*
+ * Throws a ProbeError on a line it can't parse.  What doesn't fit in
+ * place goes to extras, command gives back the extra of its last line.
+ */
+void ParseGCodeLine(string_view line, GCodeCommand &command, ExtraTable &extras);
+
+/*
+ * False for a line ParseGCodeLine gives GCODE_NONE, without parsing it
+ * (a line it would reject counts as a command)
+ */
+bool HasCommand(string_view line);
 
 #endif	/* PARSER_H */
 
@@ -8,11 +8,33 @@
 #ifndef PCB_GCODE_H
 #define	PCB_GCODE_H
 
+#include <exception>
+#include <functional>
+#include <map>
+#include <tuple>
+#include <vector>
 #include "parser.h"
+#include "command-arena.h"
+#include "cell-grid.h"
+#include "probe-order.h"
+#include "probe-mesh.h"
+#include "height-map.h"
+#include "job-stats.h"
+#include "weight-kernel.h"
 
 #define UNIT_INCHES     0
 #define UNIT_MM         1
 
+#define SPLIT_MIN_FRACTION  0.4     //Shortest piece a move is split into, in cells
+#define QUAD_FIRST_PARAM    31      //Quad coefficients go in #31 to #1999, never used by the
+#define QUAD_LAST_PARAM     1999    //probing (#1 to #8) or the probes (#2000 up), then after the
+#define LAST_KEPT_PARAM     5000    //probes up to the last parameter LinuxCNC keeps
+#define PARSE_CHUNK_BYTES   (8 << 20)   //Least input each parsing thread is given
+#define INTERPOLATE_CHUNK_COMMANDS  (1 << 18)   //Least commands each interpolating thread is given
+#define PIPELINE_BATCH_COMMANDS (1 << 10)   //Commands passed between pipeline threads at a time
+#define PIPELINE_BATCHES        8           //Batches between two pipeline threads, full or not
+#define CUBIC_MIN_WEIGHT        0.0005      //Bicubic weights printed as zero aren't probed for
+
 struct Position {
     Real x;
     Real y;
@@ -25,7 +47,9 @@ struct PCBProbeInfo
     Position Pos;
     double GridSize;
 	double Gx, Gy; //Adjusted GridSize on X and Y axes
-    double SplitOver;
+    double SplitOver;   //Longest cutting move, 0 for no limit
+    double MergeTolerance;  //Furthest a merged cutting move may stray, 0 to keep every move
+    unsigned long MergedLines;  //Moves dropped by MergeSegments
     
     //Board boundaries
     Real MillMinX;
@@ -43,6 +67,36 @@ struct PCBProbeInfo
     //Number of cells in Grid
     unsigned int GridMaxX;
     unsigned int GridMaxY;
+
+    //Probe mesh refined where there is more cutting, uniform otherwise
+    bool Adaptive;
+    double AdaptiveDensity; //Cut length per cell, in cells, over which the mesh stays fine
+
+    //Z comes from a measured height map instead of probing
+    bool UseHeightMap;
+    unsigned long HeightMapOutside; //Compensated points outside of the map
+
+    bool CacheHit;      //The commands came from the toolpath cache
+    bool CacheWritten;  //The toolpath cache was written for the next run
+    unsigned int Threads;       //Threads a large file is parsed and interpolated on, 1 for one pass
+    bool Pipeline;      //StreamGCode parses, compensates and writes on threads of their own
+    bool ProbedBefore;  //An earlier program of the session probed, this one only reads its parameters
+
+    int WeightKernel;   //WEIGHT_KERNEL_*, how the uniform grid weights are found
+    int Surface;        //SURFACE_BILINEAR or SURFACE_BICUBIC, the heights between the probes
+
+    //Cutting lines read the coefficients of their quad instead of four weights
+    bool QuadParams;
+    unsigned int QuadCount;         //Quads given coefficient parameters
+    unsigned long QuadLines;        //Lines written with a QuadFormula
+    unsigned long long BlendBytes;  //Output size with four weights on every line
+
+    //Probes written by GenerateGCodeWithProbing
+    unsigned int ProbeCount;
+    unsigned int UniformProbeCount;  //Probes the uniform grid would take
+    int ProbeOrder;             //PROBE_ORDER_SERPENTINE or PROBE_ORDER_OPTIMIZED
+    Real ProbeTravelSerpentine; //Distance between probes row by row
+    Real ProbeTravel;           //Distance between probes in the order written
     
     void ResetPos()
     {
@@ -53,11 +107,151 @@ struct PCBProbeInfo
     
 };
 
-extern PCBProbeInfo info;
+/*
+ * With the adaptive mesh, a node on the edge of a coarser leaf is not
+ * probed, its parameter is blended from the two ends of the edge
+ */
+struct DerivedVariable {
+    int var;
+    int varA;
+    int varB;
+    Real weightA;
+};
+
+/*
+ * Coefficient parameters of the quad between nodes x0..x1 and y0..y1 for
+ * one depth, x0 == x1 or y0 == y1 if it is flat along that axis
+ */
+struct QuadBlock {
+    unsigned int x0, y0;
+    unsigned int x1, y1;
+    int depthParam;
+    int param;
+};
+
+typedef tuple<unsigned int, unsigned int, unsigned int, unsigned int, int> QuadKey;  //x0, y0, x1, y1, depthParam
+
+/*
+ * A compensated point waiting for the weight kernel
+ */
+struct PendingPoint {
+    size_t command;
+    Real x;
+    Real y;
+};
+
+struct SplitGrid;
+struct ToolpathExtent;
+struct ParseChunk;
+struct InterpolationChunk;
+struct ArcGeometry;
+struct MoveRun;
+struct ToolpathSummary;
+struct BatchLink;
+class GCodeReader;
+class GCodeWriter;
+
+/*
+ * One board going through the pipeline.  A job keeps all of its state, so
+ * jobs on separate threads don't share anything.  Every stage throws a
+ * ProbeError if it can't go on.
+ */
+class PCBProbeJob {
+public:
+    PCBProbeJob();
+
+    void LoadHeightMap(const char *path);
+    void LoadAndSplitSegments(const char *infile_path, const char *cache_path = NULL);
+
+    /*
+     * LoadAndSplitSegments a step at a time, so the bounds can be changed
+     * before the grid is laid over them
+     */
+    void LoadSegments(const char *infile_path, const char *cache_path = NULL);
+    void SizeGrid();
+    void SplitSegments();
+
+    void ShareVariables(const PCBProbeJob &other);
+    void MergeSegments();
+    void DoInterpolation();
+    void GenerateGCodeWithProbing(const char *outfile_path);
 
-void LoadAndSplitSegments(const char *infile_path);
-void DoInterpolation();
-void GenerateGCodeWithProbing(const char *outfile_path);
+    /*
+     * All of the above on the uniform grid or a height map, reading the
+     * file again instead of keeping its commands
+     */
+    void StreamGCode(const char *infile_path, const char *outfile_path);
+
+    PCBProbeInfo info;
+    CommandArena cmdList;
+    JobStats stats;
+
+private:
+    PCBProbeJob(const PCBProbeJob &);
+    PCBProbeJob &operator=(const PCBProbeJob &);
+
+    void moveTo(const GCodeCommand &command);
+    void parse_input(GCodeReader &in, ToolpathSummary &summary, bool keep = true);
+    void parse_chunks(GCodeReader &in, unsigned int nchunks, ToolpathSummary &summary);
+    void set_units(int opcode, ToolpathSummary &summary);
+    void use_extent(const ToolpathExtent &extent, ToolpathSummary &summary);
+    void use_summary(const ToolpathSummary &summary);
+    void split_segment(const GCodeCommand &command, const SplitGrid &grid, vector<Real> &cuts, CommandArena &out);
+    void split_arc(const GCodeCommand &command, const ArcGeometry &arc, const SplitGrid &grid, vector<Real> &cuts, CommandArena &out);
+    SplitGrid split_grid() const;
+    size_t flush_run(MoveRun &run, vector<char> &keep, size_t out);
+    bool is_mergeable(const GCodeCommand &cmd, bool first) const;
+    int ensure_cell_variable(unsigned int gx, unsigned int gy);
+    bool cellHasVariable(unsigned int gx, unsigned int gy) const;
+    bool cellIsProbed(unsigned int gx, unsigned int gy) const;
+    int cell_variable(unsigned int gx, unsigned int gy) const;
+    void grid_ref(Real x, Real y, unsigned int &ref_x, unsigned int &ref_y) const;
+    void uniform_cells(Real x, Real y, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const;
+    void mesh_cells(Real x, Real y, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const;
+    int cubic_cells(Real x, Real y, unsigned int gx[CUBIC_TERMS], unsigned int gy[CUBIC_TERMS], Real weights[CUBIC_TERMS]) const;
+    void cubic_formula(Real x, Real y, int depthParam, CubicFormula &cubic) const;
+    void build_mesh();
+    void interpolate(Real x, Real y, bool isLinearMotionCommand, ZFormula &zformula);
+    void make_formula(const unsigned int gx[4], const unsigned int gy[4], const Real weights[4], bool isLinearMotionCommand, ZFormula &zformula);
+    void run_weight_kernel(WeightBatch &batch, const vector<PendingPoint> &points) const;
+    void batch_cells(const WeightBatch &batch, size_t p, const PendingPoint &point, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const;
+    void interpolate_batch(WeightBatch &batch, vector<PendingPoint> &points);
+    void interpolate_chunk(InterpolationChunk &chunk);
+    void interpolate_chunks(unsigned int nchunks);
+    void set_height(GCodeCommand &cmd, Real depth);
+    void compensate(GCodeCommand &cmd);
+    void ResolveHeights();
+    void stream_command(const GCodeCommand &cmd, const SplitGrid &grid, vector<Real> &cuts, CommandArena &pieces);
+    void write_piece(GCodeWriter &out, const GCodeCommand &piece);
+    void write_stage(BatchLink &link, GCodeWriter &out, exception_ptr &failure);
+    unsigned long run_pipeline(GCodeReader &in, GCodeWriter *out, const function<void(const GCodeCommand &, CommandArena &)> &process);
+    void scan_pipelined(GCodeReader &in, ToolpathSummary &summary);
+    void stream_pass(GCodeReader &in, GCodeWriter *out);
+    void assign_quads();
+    bool quad_key(const ZFormula &zformula, QuadFormula &quad, QuadKey &key) const;
+    bool quad_formula(const ZFormula &zformula, QuadFormula &quad) const;
+    void put_quad_block(GCodeWriter &out, const QuadBlock &block) const;
+    void put_probes(GCodeWriter &out, Real initial_probe);
+    void put_header(GCodeWriter &out, const GCodeCommand &cmd, bool useQuads, unsigned long long &quadBytes);
+
+    CellGrid<int> cellVariables; //GCode parameters associated with every cell in the Grid, 0 if none
+    int nextVariableNumber;
+    int firstVariable;      //Numbered by the last DoInterpolation from here
+    bool sharedVariables;   //ShareVariables was called, DoInterpolation keeps them
+    unsigned long currentLine;
+
+    ProbeMesh probeMesh;
+    bool meshBuilt;     //The mesh was built before the moves were merged
+    CellGrid<unsigned char> cellDerived;
+    CellGrid<unsigned char> uniformProbes;  //Cells the uniform grid would probe
+    vector<DerivedVariable> derivedVariables;
+
+    vector<QuadBlock> quadBlocks;
+    map<QuadKey, size_t> quadIndex;    //Index in quadBlocks
+    vector<pair<unsigned int, unsigned int> > variableCells;   //Cell of every variable, from 2000
+
+    HeightMap heightMap;
+};
 
 
 #endif	/* PCB_GCODE_H */
@@ -0,0 +1,77 @@
+/*
+ * File:   probe-mesh.h
+ *
+ * Adaptive probe mesh.  The probe points are the cell centres of the grid
+ * (the nodes), the mesh is a quadtree over the squares between them that
+ * stays fine where there is a lot of cutting and grows coarse where there
+ * is little.  Heights are blended bilinearly over each leaf.
+ */
+
+#ifndef PROBE_MESH_H
+#define	PROBE_MESH_H
+
+#include <vector>
+#include "parser.h"
+#include "cell-grid.h"
+
+using namespace std;
+
+#define MESH_MAX_SIZE       2       //Largest leaf, in cells
+#define MESH_SPLIT_DENSITY  8.0     //Default cutting weight per cell over which a leaf is split
+#define MESH_POINT_WEIGHT   0.1     //Cutting weight of every cutting point, a cut adds its length in cells
+#define MESH_MIN_WEIGHT     0.0005  //Smaller blending weights print as zero, the node is not used
+
+struct MeshLeaf {
+    unsigned int x0, y0;    //Corner nodes
+    unsigned int x1, y1;
+    Real weight;            //Cutting weight inside, 0 if nothing is cut here
+};
+
+/*
+ * A node in the middle of the edge of a coarser leaf takes its height from
+ * the ends of that edge, so the surface has no steps between leaves
+ */
+struct MeshEdge {
+    unsigned int ax, ay;
+    unsigned int bx, by;
+    Real weightA;
+};
+
+class ProbeMesh {
+public:
+    /*
+     * Nodes go from 0 to maxX and maxY, node coordinates below are in cells
+     * from node 0
+     */
+    void reset(unsigned int maxX, unsigned int maxY);
+    void addCut(Real u0, Real v0, Real u1, Real v1);
+    void addPoint(Real u, Real v);
+    void build(unsigned int maxSize, Real splitDensity);
+
+    /*
+     * The four corners (ordered as in ZFormula) and the blending weights
+     * for a point
+     */
+    void locate(Real u, Real v, unsigned int nx[4], unsigned int ny[4], Real w[4]) const;
+    bool onEdge(unsigned int x, unsigned int y, MeshEdge &edge) const;
+
+    size_t getLeafCount() const
+    {
+        return leaves.size();
+    }
+
+private:
+    unsigned int cellOf(Real u, unsigned int count) const;
+    Real weightIn(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) const;
+    void subdivide(unsigned int x0, unsigned int y0, unsigned int size, unsigned int maxSize, Real splitDensity);
+
+    unsigned int maxX, maxY;
+    unsigned int cellsX, cellsY;
+    CellGrid<Real> cellWeight;
+    vector<Real> weightSum;         //Summed area table of cellWeight
+    CellGrid<unsigned int> leafOf;
+    vector<MeshLeaf> leaves;
+};
+
+#endif	/* PROBE_MESH_H */
+
@@ -0,0 +1,41 @@
+/*
+ * File:   probe-order.h
+ *
+ * Orders the probe points so the machine travels as little as possible
+ * between them.
+ */
+
+#ifndef PROBE_ORDER_H
+#define	PROBE_ORDER_H
+
+#include <vector>
+#include "parser.h"
+
+using namespace std;
+
+#define PROBE_ORDER_SERPENTINE  0
+#define PROBE_ORDER_OPTIMIZED   1
+
+#define PROBE_ORDER_NEIGHBORS   8       //Candidates per point for the improvement moves
+#define PROBE_ORDER_WORK_LIMIT  100000000ULL    //Points and moves looked at, about a second of CPU
+
+struct ProbePoint {
+    Real x;
+    Real y;
+    unsigned int gx;    //Cell
+    unsigned int gy;
+    int var;            //Parameter that receives the probed height
+};
+
+Real TourLength(const vector<ProbePoint> &points);
+
+/*
+ * Reorders points into a short open path that starts at points[0]: a
+ * nearest neighbour tour improved with 2-opt and Or-opt moves until
+ * workLimit points and moves have been looked at.  The same points always
+ * give the same order.  The original order is kept if it is shorter.
+ */
+void OrderProbes(vector<ProbePoint> &points, unsigned long long workLimit);
+
+#endif	/* PROBE_ORDER_H */
+
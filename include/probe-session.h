@@ -0,0 +1,32 @@
+/*
+ * File:   probe-session.h
+ *
+ * Several files cut on the same board probed once, the etch file and then
+ * the drill spots for example.  The grid is laid over the bounds of all of
+ * them and the cells get their parameters across the files, in file
+ * order.  Only the first output probes, every cell any of the files needs;
+ * the others start from the parameters it leaves, without probing.
+ */
+
+#ifndef PROBE_SESSION_H
+#define	PROBE_SESSION_H
+
+#include <string>
+#include <vector>
+#include "pcb-probe.h"
+
+using namespace std;
+
+struct SessionFile
+{
+    string InPath;
+    string OutPath;
+};
+
+/*
+ * Runs jobs[k] on files[k], the jobs come with their options set.  Throws
+ * a ProbeError naming the file that failed.
+ */
+void RunSession(const vector<SessionFile> &files, vector<PCBProbeJob> &jobs);
+
+#endif	/* PROBE_SESSION_H */
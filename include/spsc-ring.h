@@ -0,0 +1,194 @@
+/*
+ * File:   spsc-ring.h
+ *
+ * Bounded queue between one producer thread and one consumer thread, a
+ * ring of slots with both ends kept in atomics and no locks.  A side that
+ * finds the ring full (or empty) spins a little, then yields, then sleeps,
+ * and counts how often and how long it waited.
+ */
+
+#ifndef SPSC_RING_H
+#define	SPSC_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define RING_SPIN_TRIES     64      //Checks before a waiting side yields
+#define RING_YIELD_TRIES    1024    //Checks before it sleeps between them
+#define RING_SLEEP_US       50
+
+/*
+ * What a ring went through, taken once both sides are done
+ */
+struct RingStats {
+    unsigned long Pushes;
+    unsigned long long OccupancySum;    //Items in the ring after every push
+    unsigned int MaxOccupancy;
+    unsigned long PushWaits;            //Pushes that found the ring full
+    double PushWaitSeconds;
+    unsigned long PopWaits;             //Pops that found it empty
+    double PopWaitSeconds;
+};
+
+template <typename T>
+class SpscRing {
+public:
+    /*
+     * Holds at least capacity items, rounded up to a power of two
+     */
+    explicit SpscRing(size_t capacity)
+    {
+        size_t size = 1;
+
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+        head = 0;
+        tail = 0;
+        closed = false;
+        aborted = false;
+        producer = SideStats();
+        consumer = SideStats();
+    }
+
+    /*
+     * Waits for room, returns false if the ring was aborted
+     */
+    bool push(const T &item)
+    {
+        size_t t = tail.load(memory_order_relaxed);
+
+        if (t - head.load(memory_order_acquire) > mask &&
+                !wait([this, t]() { return t - head.load(memory_order_acquire) <= mask; },
+                      producer.waits, producer.seconds)) {
+            return false;
+        }
+
+        slots[t & mask] = item;
+        tail.store(t + 1, memory_order_release);
+
+        unsigned int n = (unsigned int)(t + 1 - head.load(memory_order_relaxed));
+
+        producer.pushes++;
+        producer.occupancySum += n;
+        if (n > producer.maxOccupancy)
+            producer.maxOccupancy = n;
+
+        return true;
+    }
+
+    /*
+     * Waits for an item, returns false once the ring is closed and empty
+     * or if it was aborted
+     */
+    bool pop(T &item)
+    {
+        size_t h = head.load(memory_order_relaxed);
+
+        if (tail.load(memory_order_acquire) == h &&
+                !wait([this, h]() { return tail.load(memory_order_acquire) != h || closed.load(memory_order_acquire); },
+                      consumer.waits, consumer.seconds)) {
+            return false;
+        }
+        if (tail.load(memory_order_acquire) == h)
+            return false;
+
+        item = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+
+        return true;
+    }
+
+    /*
+     * The producer is done, the consumer gets what is left
+     */
+    void close()
+    {
+        closed.store(true, memory_order_release);
+    }
+
+    /*
+     * Either side gave up, both stop waiting
+     */
+    void abort()
+    {
+        aborted.store(true, memory_order_release);
+    }
+
+    size_t capacity() const
+    {
+        return slots.size();
+    }
+
+    RingStats stats() const
+    {
+        RingStats stats;
+
+        stats.Pushes = producer.pushes;
+        stats.OccupancySum = producer.occupancySum;
+        stats.MaxOccupancy = producer.maxOccupancy;
+        stats.PushWaits = producer.waits;
+        stats.PushWaitSeconds = producer.seconds;
+        stats.PopWaits = consumer.waits;
+        stats.PopWaitSeconds = consumer.seconds;
+
+        return stats;
+    }
+
+private:
+    SpscRing(const SpscRing &);
+    SpscRing &operator=(const SpscRing &);
+
+    /*
+     * Counted by one side only, on a cache line of its own
+     */
+    struct alignas(64) SideStats {
+        unsigned long pushes;
+        unsigned long long occupancySum;
+        unsigned int maxOccupancy;
+        unsigned long waits;
+        double seconds;
+    };
+
+    template <typename Ready>
+    bool wait(Ready ready, unsigned long &waits, double &seconds)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool done = true;
+
+        waits++;
+        for (unsigned int tries = 0; !ready(); tries++) {
+            if (aborted.load(memory_order_acquire)) {
+                done = false;
+                break;
+            }
+
+            if (tries >= RING_YIELD_TRIES)
+                this_thread::sleep_for(chrono::microseconds(RING_SLEEP_US));
+            else if (tries >= RING_SPIN_TRIES)
+                this_thread::yield();
+        }
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        return done;
+    }
+
+    vector<T> slots;
+    size_t mask;
+
+    alignas(64) atomic<size_t> head;    //Next slot the consumer takes
+    alignas(64) atomic<size_t> tail;    //Next slot the producer fills
+    atomic<bool> closed;
+    atomic<bool> aborted;
+
+    SideStats producer;
+    SideStats consumer;
+};
+
+#endif	/* SPSC_RING_H */
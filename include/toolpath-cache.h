@@ -0,0 +1,61 @@
+/*
+ * File:   toolpath-cache.h
+ *
+ * Binary form of a parsed etch file, so runs with another grid size don't
+ * parse the text again.  The file is a header followed by the unsplit
+ * commands, one record each with only the values the command has, laid
+ * out so the file can be mapped and read in place.  The header holds a
+ * hash of the text it came from, a cache made from any other text is
+ * never used.
+ */
+
+#ifndef TOOLPATH_CACHE_H
+#define	TOOLPATH_CACHE_H
+
+#include <cstdint>
+#include <string_view>
+#include "parser.h"
+#include "command-arena.h"
+
+using namespace std;
+
+#define CACHE_MAGIC     "PCBPCMD"   //7 characters and the terminator
+#define CACHE_VERSION   2           //Bump when the parser or GCodeCommand changes
+#define CACHE_ALIGN     64          //Offset of the commands in the file
+#define CACHE_SUFFIX    ".pcbcache" //Appended to the input name by default
+
+/*
+ * What parsing found out about the file besides the commands
+ */
+struct ToolpathSummary {
+    int UnitType;
+    unsigned int InchSwitches;  //G20 commands, each scaled the lengths once
+    bool HasDrillSpots;
+    Real MillMinX;
+    Real MillMinY;
+    Real MillMaxX;
+    Real MillMaxY;
+    Real MillRouteDepth;
+    Real DrillSpotDepth;
+    unsigned long LineCount;
+};
+
+/*
+ * 64 bit hash of the input text
+ */
+uint64_t HashContents(string_view data);
+
+/*
+ * Loads the commands of a cache made from text with this hash and size.
+ * Returns false, leaving commands empty, if there is no such cache.
+ */
+bool ReadToolpathCache(const char *path, uint64_t hash, uint64_t size, ToolpathSummary &summary, CommandArena &commands);
+
+/*
+ * Writes through a temporary file that is renamed in place, so a reader
+ * never sees half a cache.  Returns false if it can't be written, or if
+ * a command has more than fits in place (GCodeCommand::extra).
+ */
+bool WriteToolpathCache(const char *path, uint64_t hash, uint64_t size, const ToolpathSummary &summary, const CommandArena &commands);
+
+#endif	/* TOOLPATH_CACHE_H */
@@ -0,0 +1,75 @@
+/*
+ * File:   weight-kernel.h
+ *
+ * Cells and bilinear weights of many points on the uniform grid at once.
+ * The points are kept as arrays of X and of Y and worked on in double
+ * precision, four at a time with AVX2 or two with SSE4.1 when the
+ * processor has it.  A point where double precision could come out
+ * differently from the long double path once printed (on a cell edge,
+ * halfway between two nodes, outside of the grid or with a weight next to
+ * a rounding boundary) is left to that path.
+ */
+
+#ifndef WEIGHT_KERNEL_H
+#define	WEIGHT_KERNEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#define WEIGHT_KERNEL_NONE      0   //One point at a time in long double
+#define WEIGHT_KERNEL_SCALAR    1
+#define WEIGHT_KERNEL_SSE41     2
+#define WEIGHT_KERNEL_AVX2      3
+
+#define WEIGHT_BATCH_SIZE       1024    //Points gathered before the kernel runs
+
+struct WeightGrid {
+    double MinX;
+    double MinY;
+    double Gx;
+    double Gy;
+    int MaxX;       //Last cell on each axis
+    int MaxY;
+};
+
+/*
+ * The points of one batch and what the kernel found for them.  The
+ * corners are ordered as in ZFormula: the cell, its neighbour along X,
+ * along Y and the diagonal one.
+ */
+struct WeightBatch {
+    void resize(size_t n);
+
+    size_t size() const
+    {
+        return X.size();
+    }
+
+    vector<double> X;
+    vector<double> Y;
+
+    vector<int32_t> CellX;
+    vector<int32_t> CellY;
+    vector<int32_t> NextX;      //The cell itself at the edge of the grid
+    vector<int32_t> NextY;
+    vector<double> Weights[4];
+    vector<unsigned char> Exact;    //0 if the point must go through the long double path
+};
+
+/*
+ * The fastest kernel this processor runs
+ */
+int BestWeightKernel();
+
+const char *WeightKernelName(int kernel);
+
+/*
+ * Fills in the cells, weights and Exact of every point, with the given
+ * kernel or the best one there is if the processor lacks it
+ */
+void ComputeWeights(const WeightGrid &grid, WeightBatch &batch, int kernel);
+
+#endif	/* WEIGHT_KERNEL_H */
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "batch-runner.h"
+#include "toolpath-cache.h"
+
+using namespace std;
+
+static const char *gcodeExtensions[] = { ".ngc", ".nc", ".gc", ".gcode", ".tap" };
+
+static bool is_gcode_file(const filesystem::path &path)
+{
+    string ext = path.extension().string();
+
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    for (size_t k = 0; k < sizeof(gcodeExtensions) / sizeof(gcodeExtensions[0]); k++)
+        if (ext == gcodeExtensions[k])
+            return true;
+
+    return false;
+}
+
+static void add_file(const string &in, const string &out, const char *outDir, vector<BatchFile> &files)
+{
+    BatchFile file;
+    error_code ec;
+
+    file.InPath = in;
+    if (!out.empty()) {
+        file.OutPath = out;
+    } else if (outDir != NULL) {
+        file.OutPath = (filesystem::path(outDir) / filesystem::path(in).filename()).string();
+    } else {
+        throw ProbeError(PROBE_ERROR_FILE, "No output file for " + in + ", give one or use --out-dir");
+    }
+
+    if (filesystem::equivalent(file.InPath, file.OutPath, ec))
+        throw ProbeError(PROBE_ERROR_FILE, "Output would overwrite its input: " + in);
+
+    file.Size = filesystem::file_size(in, ec);
+    if (ec)
+        file.Size = 0;
+
+    file.Status = 0;
+    file.ProbeCount = 0;
+    file.Seconds = 0;
+    file.CacheSkipped = false;
+    files.push_back(file);
+}
+
+void ReadBatchList(const char *path, const char *outDir, vector<BatchFile> &files)
+{
+    error_code ec;
+
+    if (filesystem::is_directory(path, ec)) {
+        vector<string> names;
+
+        for (filesystem::directory_iterator it(path, ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->is_regular_file(ec) && is_gcode_file(it->path()))
+                names.push_back(it->path().string());
+        }
+        if (ec)
+            throw ProbeError(PROBE_ERROR_FILE, string("Unable to read directory: ") + path);
+
+        sort(names.begin(), names.end());
+        for (size_t k = 0; k < names.size(); k++)
+            add_file(names[k], "", outDir, files);
+
+        return;
+    }
+
+    ifstream list(path);
+    string line;
+
+    if (!list)
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to open file: ") + path);
+
+    while (getline(list, line)) {
+        istringstream words(line);
+        string in, out;
+
+        if (!(words >> in) || in[0] == '#')
+            continue;
+
+        words >> out;
+        add_file(in, out, outDir, files);
+    }
+}
+
+/*
+ * A deque of file indices per thread, largest first.  A thread takes from
+ * the front of its own, once that is empty it steals the largest file
+ * another thread has left, so the big ones still go first.
+ */
+class WorkStealingPool {
+public:
+    WorkStealingPool(unsigned int threads) : queues(threads), locks(threads)
+    {
+    }
+
+    void push(unsigned int worker, size_t item)
+    {
+        lock_guard<mutex> guard(locks[worker]);
+
+        queues[worker].push_back(item);
+    }
+
+    bool pop(unsigned int worker, size_t &item)
+    {
+        {
+            lock_guard<mutex> guard(locks[worker]);
+
+            if (!queues[worker].empty()) {
+                item = queues[worker].front();
+                queues[worker].pop_front();
+                return true;
+            }
+        }
+
+        //Nothing left here, steal from the others
+        for (size_t k = 1; k < queues.size(); k++) {
+            size_t victim = (worker + k) % queues.size();
+            lock_guard<mutex> guard(locks[victim]);
+
+            if (!queues[victim].empty()) {
+                item = queues[victim].front();
+                queues[victim].pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    vector<deque<size_t> > queues;
+    vector<mutex> locks;
+};
+
+static void run_file(BatchFile &file, const BatchOptions &options)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    PCBProbeJob job;
+
+    job.info = options.Info;
+    job.stats.Enabled = options.Stats;
+
+    try {
+        if (options.HeightMapPath != NULL)
+            job.LoadHeightMap(options.HeightMapPath);
+        string cache = file.InPath + CACHE_SUFFIX;
+
+        job.LoadAndSplitSegments(file.InPath.c_str(), options.Cache? cache.c_str() : NULL);
+        job.MergeSegments();
+        job.DoInterpolation();
+        job.GenerateGCodeWithProbing(file.OutPath.c_str());
+    } catch (const ProbeError &e) {
+        file.Status = e.getStatus();
+        file.Error = e.what();
+    } catch (const exception &e) {
+        //Out of memory or no threads left, only this file fails
+        file.Status = PROBE_ERROR_FILE;
+        file.Error = string("Unable to process the file: ") + e.what();
+    }
+
+    file.ProbeCount = job.info.ProbeCount;
+    file.CacheSkipped = options.Cache && !job.info.CacheHit && !job.info.CacheWritten;
+    file.Seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (options.Stats && file.Status == 0) {
+        ostringstream report;
+
+        if (options.StatsJSON)
+            PrintStatsJSON(report, job, file.Seconds);
+        else
+            PrintStats(report, job, file.Seconds);
+        file.Stats = report.str();
+    }
+}
+
+double RunBatch(vector<BatchFile> &files, const BatchOptions &options)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    unsigned int threads = max(1u, min(options.Threads, (unsigned int)files.size()));
+    WorkStealingPool pool(threads);
+    vector<size_t> order(files.size());
+    vector<thread> workers;
+
+    for (size_t k = 0; k < order.size(); k++)
+        order[k] = k;
+
+    //Largest first, dealt out in turn so every thread starts on a big one
+    stable_sort(order.begin(), order.end(), [&files](size_t a, size_t b) {
+        return files[a].Size > files[b].Size;
+    });
+    for (size_t k = 0; k < order.size(); k++)
+        pool.push(k % threads, order[k]);
+
+    for (unsigned int w = 0; w < threads; w++) {
+        workers.push_back(thread([&, w]() {
+            size_t item;
+
+            while (pool.pop(w, item))
+                run_file(files[item], options);
+        }));
+    }
+    for (unsigned int w = 0; w < threads; w++)
+        workers[w].join();
+
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
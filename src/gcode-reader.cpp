@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "gcode-reader.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+GCodeReader::GCodeReader()
+{
+    data = "";
+    length = 0;
+    pos = 0;
+    releaseAt = (size_t)-1;
+    releasing = false;
+    mapped = false;
+}
+
+GCodeReader::~GCodeReader()
+{
+    close();
+}
+
+bool GCodeReader::open(const char *path)
+{
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            data = static_cast<const char *>(p);
+            length = st.st_size;
+            mapped = true;
+        }
+    }
+    ::close(fd);
+
+    if (mapped)
+        return true;
+#endif
+
+    /*
+     * Not a regular file (or no mmap), read it into memory
+     */
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL)
+        return false;
+
+    char block[65536];
+    size_t n;
+
+    while ((n = fread(block, 1, sizeof(block), f)) > 0)
+        buffer.insert(buffer.end(), block, block + n);
+
+    fclose(f);
+
+    data = buffer.empty()? "" : &buffer[0];
+    length = buffer.size();
+
+    return true;
+}
+
+void GCodeReader::close()
+{
+#ifndef _WIN32
+    if (mapped)
+        munmap(const_cast<char *>(data), length);
+#endif
+
+    buffer.clear();
+    data = "";
+    length = 0;
+    pos = 0;
+    releaseAt = (size_t)-1;
+    releasing = false;
+    mapped = false;
+}
+
+void GCodeReader::setRelease(bool release)
+{
+    releasing = release;
+    releaseAt = release? pos + READER_RELEASE_BYTES : (size_t)-1;
+}
+
+void GCodeReader::release()
+{
+#ifndef _WIN32
+    if (mapped) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t end = min(pos, length) / page * page;
+
+        if (end > 0)
+            madvise(const_cast<char *>(data), end, MADV_DONTNEED);
+    }
+#endif
+
+    releaseAt = pos + READER_RELEASE_BYTES;
+}
@@ -0,0 +1,260 @@
+#include <cmath>
+#include <limits>
+#include "gcode-writer.h"
+
+static const unsigned long long pow10u[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+static char *put_uint(char *p, unsigned long long n)
+{
+    char digits[20];
+    int len = 0;
+
+    do {
+        digits[len++] = '0' + (char)(n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    while (len > 0)
+        *p++ = digits[--len];
+
+    return p;
+}
+
+GCodeWriter::GCodeWriter()
+{
+    file = NULL;
+    used = 0;
+    written = 0;
+    failed = false;
+}
+
+GCodeWriter::~GCodeWriter()
+{
+    close();
+}
+
+bool GCodeWriter::open(const char *path)
+{
+    close();
+
+    if (path != NULL) {
+        file = fopen(path, "wb");
+        if (file == NULL)
+            return false;
+    }
+
+    buffer.resize(WRITER_BUFFER_SIZE);
+    used = 0;
+    written = 0;
+    failed = false;
+
+    return true;
+}
+
+bool GCodeWriter::close()
+{
+    if (file == NULL)
+        return !failed;
+
+    flush();
+    if (fclose(file) != 0)
+        failed = true;
+
+    file = NULL;
+    buffer.clear();
+
+    return !failed;
+}
+
+void GCodeWriter::flush()
+{
+    if (used == 0)
+        return;
+
+    if (file != NULL && fwrite(&buffer[0], 1, used, file) != used)
+        failed = true;
+
+    written += used;
+    used = 0;
+}
+
+void GCodeWriter::write(const char *data, size_t length)
+{
+    if (length > buffer.size() - used) {
+        flush();
+
+        if (length > buffer.size()) {
+            if (file != NULL && fwrite(data, 1, length, file) != length)
+                failed = true;
+
+            written += length;
+            return;
+        }
+    }
+
+    memcpy(&buffer[used], data, length);
+    used += length;
+}
+
+GCodeWriter &GCodeWriter::operator<<(int n)
+{
+    reserve(WRITER_MAX_FIELD);
+
+    char *p = &buffer[used];
+
+    if (n < 0) {
+        *p++ = '-';
+        p = put_uint(p, -(unsigned long long)n);
+    } else {
+        p = put_uint(p, n);
+    }
+    used = p - &buffer[0];
+
+    return *this;
+}
+
+GCodeWriter &GCodeWriter::operator<<(unsigned int n)
+{
+    reserve(WRITER_MAX_FIELD);
+    used = put_uint(&buffer[used], n) - &buffer[0];
+
+    return *this;
+}
+
+GCodeWriter &GCodeWriter::operator<<(Real value)
+{
+    char text[WRITER_MAX_FIELD];
+    int len = snprintf(text, sizeof(text), "%.6Lg", (long double)value);
+
+    write(text, len);
+
+    return *this;
+}
+
+/*
+ * Values are scaled to an integer count of the last decimal and rounded.
+ * The product is only trusted when it is small enough to be exact to
+ * 1e-7 and not close to a rounding tie, everything else goes to printf
+ * which rounds the exact binary value the way an ostream does.
+ */
+void GCodeWriter::putFixed(Real value, int decimals)
+{
+    static const Real fast_limit = 1e-7 / numeric_limits<Real>::epsilon();
+
+    reserve(WRITER_MAX_FIELD);
+
+    char *p = &buffer[used];
+    Real scaled = fabs(value) * (Real)pow10u[decimals];
+
+    if (scaled < fast_limit) {
+        Real ip = floor(scaled);
+        Real frac = scaled - ip;
+
+        if (fabs(frac - 0.5) > 1e-6) {
+            unsigned long long n = (unsigned long long)ip + (frac > 0.5? 1 : 0);
+            unsigned long long f = n % pow10u[decimals];
+
+            if (signbit(value))
+                *p++ = '-';
+
+            p = put_uint(p, n / pow10u[decimals]);
+
+            if (decimals > 0) {
+                *p++ = '.';
+                for (int i = decimals - 1; i >= 0; i--) {
+                    p[i] = '0' + (char)(f % 10);
+                    f /= 10;
+                }
+                p += decimals;
+            }
+            used = p - &buffer[0];
+
+            return;
+        }
+    }
+
+    int len = snprintf(p, WRITER_MAX_FIELD, "%.*Lf", decimals, (long double)value);
+
+    if (len < WRITER_MAX_FIELD) {
+        used += len;
+    } else {
+        vector<char> text(len + 1);
+
+        snprintf(&text[0], text.size(), "%.*Lf", decimals, (long double)value);
+        write(&text[0], len);
+    }
+}
+
+void GCodeWriter::putCommand(const GCodeCommand &command, const QuadFormula *quad, const CubicFormula *cubic)
+{
+    int firstTerm = 0;  //Of the cubic formula, on the line itself
+
+    if (cubic != NULL && cubic->count > WRITER_CUBIC_TERMS) {
+        firstTerm = cubic->count - WRITER_CUBIC_TERMS;
+
+        *this << '#' << WRITER_CUBIC_PARAM << " = [";
+        for (int k = 0; k < firstTerm; k++) {
+            if (k > 0)
+                *this << " + ";
+            putFixed(cubic->weights[k], 3);
+            *this << "*#" << cubic->vars[k];
+        }
+        *this << "]\n";
+    }
+
+    *this << command.getName();
+
+    for (unsigned int i = 0; i < command.getWordCount(); i++) {
+        char argName = command.getWord(i);
+
+        reserve(2);
+        buffer[used++] = ' ';
+        buffer[used++] = argName;
+
+        if (argName != 'Z' || !command.hasZFormula) {
+            putFixed(command.getArgument(argName), 4);
+        } else if (quad != NULL) {
+            int param = quad->param;
+
+            *this << "[#" << param;
+            if (quad->hasU) {
+                *this << '+';
+                putFixed(quad->u, 3);
+                *this << "*#" << ++param;
+            }
+            if (quad->hasV) {
+                *this << '+';
+                putFixed(quad->v, 3);
+                *this << "*#" << ++param;
+            }
+            if (quad->hasU && quad->hasV) {
+                *this << '+';
+                putFixed(quad->u * quad->v, 3);
+                *this << "*#" << ++param;
+            }
+            *this << ']';
+        } else if (cubic != NULL) {
+            *this << '[';
+            if (firstTerm > 0)
+                *this << '#' << WRITER_CUBIC_PARAM << " + ";
+            for (int k = firstTerm; k < cubic->count; k++) {
+                putFixed(cubic->weights[k], 3);
+                *this << "*#" << cubic->vars[k] << " + ";
+            }
+            *this << '#' << cubic->depthParam << ']';
+        } else {
+            const ZFormula &zformula = command.zformula;
+
+            *this << '[';
+            for (int k = 0; k < 4; k++) {
+                putFixed(zformula.weights[k], 3);
+                *this << "*#" << zformula.vars[k] << " + ";
+            }
+            *this << '#' << zformula.depthParam << ']';
+        }
+    }
+    *this << '\n';
+}
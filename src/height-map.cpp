@@ -0,0 +1,230 @@
+#include <cmath>
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+#include "height-map.h"
+#include "gcode-reader.h"
+
+using namespace std;
+
+static bool is_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == ',' || c == ';' || c == '\r';
+}
+
+/*
+ * Reads the first three numbers of a line, anything else (headers,
+ * comments, blank lines) is skipped
+ */
+static bool read_point(string_view line, double xyz[3])
+{
+    const char *p = line.data();
+    const char *end = p + line.size();
+
+    for (int k = 0; k < 3; k++) {
+        while (p < end && is_separator(*p))
+            p++;
+
+        if (p < end && *p == '+')
+            p++;
+
+        from_chars_result r = from_chars(p, end, xyz[k]);
+
+        if (r.ec != errc() || (r.ptr < end && !is_separator(*r.ptr)))
+            return false;
+
+        p = r.ptr;
+    }
+
+    return true;
+}
+
+HeightMap::HeightMap()
+{
+    nodesX = nodesY = 0;
+    originX = originY = 0;
+    stepX = stepY = 1;
+    invStepX = invStepY = 1;
+    minX = minY = maxX = maxY = 0;
+    pointCount = 0;
+}
+
+/*
+ * Finds the rows (or columns) of a probed lattice.  Returns false if the
+ * values don't sit on evenly spaced levels.
+ */
+static bool fit_lattice(vector<Real> &values, Real span, Real &origin, Real &step, unsigned int &nodes)
+{
+    Real tol = span * HEIGHTMAP_LEVEL_TOLERANCE;
+    vector<Real> levels;
+
+    sort(values.begin(), values.end());
+
+    for (size_t i = 0; i < values.size(); ) {
+        size_t first = i;
+        Real sum = 0;
+
+        while (i < values.size() && values[i] - values[first] <= tol)
+            sum += values[i++];
+
+        levels.push_back(sum / (i - first));
+    }
+
+    origin = levels[0];
+    if (levels.size() == 1) {
+        step = 1;
+        nodes = 1;
+        return true;
+    }
+
+    step = span;
+    for (size_t i = 1; i < levels.size(); i++)
+        step = min(step, levels[i] - levels[i - 1]);
+
+    nodes = (unsigned int)floor((levels.back() - origin) / step + 0.5) + 1;
+
+    //The ends are further apart than the closest levels, they give the better step
+    step = (levels.back() - origin) / (nodes - 1);
+
+    for (size_t i = 0; i < levels.size(); i++) {
+        Real k = (levels[i] - origin) / step;
+
+        if (fabs(k - floor(k + 0.5)) > 0.1)
+            return false;
+    }
+
+    return true;
+}
+
+bool HeightMap::load(const char *path)
+{
+    GCodeReader in;
+    string_view line;
+    vector<Real> xs, ys, zs;
+    double xyz[3];
+
+    if (!in.open(path))
+        return false;
+
+    while (in.nextLine(line)) {
+        if (read_point(line, xyz)) {
+            xs.push_back(xyz[0]);
+            ys.push_back(xyz[1]);
+            zs.push_back(xyz[2]);
+        }
+    }
+    in.close();
+
+    pointCount = xs.size();
+    if (pointCount == 0)
+        return false;
+
+    minX = *min_element(xs.begin(), xs.end());
+    maxX = *max_element(xs.begin(), xs.end());
+    minY = *min_element(ys.begin(), ys.end());
+    maxY = *max_element(ys.begin(), ys.end());
+
+    vector<Real> sorted_x(xs), sorted_y(ys);
+    bool lattice = fit_lattice(sorted_x, maxX - minX, originX, stepX, nodesX) &&
+                   fit_lattice(sorted_y, maxY - minY, originY, stepY, nodesY) &&
+                   (size_t)nodesX * nodesY <= HEIGHTMAP_MAX_FILL * pointCount;
+
+    if (!lattice) {
+        //Scattered points, a grid with about one node per point
+        Real w = maxX - minX, h = maxY - minY;
+        Real step = (w > 0 && h > 0)? sqrt(w * h / pointCount) : max(w, h) / (pointCount - 1);
+
+        if (!(step > 0))
+            step = 1;
+
+        originX = minX;
+        originY = minY;
+        stepX = stepY = step;
+        nodesX = (unsigned int)ceil(w / step) + 1;
+        nodesY = (unsigned int)ceil(h / step) + 1;
+    }
+
+    invStepX = 1 / stepX;
+    invStepY = 1 / stepY;
+
+    vector<unsigned int> count((size_t)nodesX * nodesY, 0);
+    vector<unsigned char> known(count.size(), 0);
+
+    heights.assign(count.size(), 0);
+
+    for (size_t p = 0; p < pointCount; p++) {
+        unsigned int i = min((unsigned int)floor((xs[p] - originX) * invStepX + 0.5), nodesX - 1);
+        unsigned int j = min((unsigned int)floor((ys[p] - originY) * invStepY + 0.5), nodesY - 1);
+        size_t k = (size_t)j * nodesX + i;
+
+        heights[k] += zs[p];
+        count[k]++;
+        known[k] = 1;
+    }
+
+    for (size_t k = 0; k < heights.size(); k++)
+        if (count[k] > 1)
+            heights[k] /= count[k];
+
+    fill(known);
+
+    return true;
+}
+
+/*
+ * Nodes with no probe take the height of the closest node that has one
+ */
+void HeightMap::fill(vector<unsigned char> &known)
+{
+    vector<size_t> queue;
+
+    for (size_t k = 0; k < known.size(); k++)
+        if (known[k])
+            queue.push_back(k);
+
+    for (size_t q = 0; q < queue.size(); q++) {
+        size_t k = queue[q];
+        unsigned int i = k % nodesX;
+        unsigned int j = k / nodesX;
+        size_t next[4];
+        int n = 0;
+
+        if (i > 0)
+            next[n++] = k - 1;
+        if (i + 1 < nodesX)
+            next[n++] = k + 1;
+        if (j > 0)
+            next[n++] = k - nodesX;
+        if (j + 1 < nodesY)
+            next[n++] = k + nodesX;
+
+        for (int m = 0; m < n; m++) {
+            if (!known[next[m]]) {
+                known[next[m]] = 1;
+                heights[next[m]] = heights[k];
+                queue.push_back(next[m]);
+            }
+        }
+    }
+}
+
+
+Real HeightMap::cubicAt(Real x, Real y) const
+{
+    unsigned int nx[4], ny[4];
+    Real wx[4], wy[4];
+    int cx = CubicAxis((x - originX) * invStepX, nodesX - 1, nx, wx);
+    int cy = CubicAxis((y - originY) * invStepY, nodesY - 1, ny, wy);
+    Real z = 0;
+
+    for (int b = 0; b < cy; b++) {
+        const Real *row = &heights[(size_t)ny[b] * nodesX];
+        Real sum = 0;
+
+        for (int a = 0; a < cx; a++)
+            sum += wx[a] * row[nx[a]];
+        z += wy[b] * sum;
+    }
+
+    return z;
+}
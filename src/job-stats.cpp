@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <sys/resource.h>
+#include "job-stats.h"
+#include "pcb-probe.h"
+
+using namespace std;
+
+static const char *stageNames[STAGE_COUNT] = {
+    "heightmap", "parse", "split", "merge", "interpolate", "output"
+};
+
+static const char *queueNames[QUEUE_COUNT] = {
+    "read", "write"
+};
+
+const char *StageName(JobStage stage)
+{
+    return stageNames[stage];
+}
+
+const char *QueueName(PipelineQueue queue)
+{
+    return queueNames[queue];
+}
+
+long PeakMemoryKB()
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+
+    return ru.ru_maxrss;
+}
+
+static void print_seconds(ostream &out, double seconds)
+{
+    char text[32];
+
+    snprintf(text, sizeof(text), "%.6f", seconds);
+    out << text;
+}
+
+void PrintStats(ostream &out, const PCBProbeJob &job, double totalSeconds)
+{
+    const PCBProbeInfo &info = job.info;
+    const JobStats &stats = job.stats;
+
+    out << "Stage times (s):" << endl;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        if (s == STAGE_HEIGHTMAP && !info.UseHeightMap)
+            continue;
+        if (s == STAGE_MERGE && !(info.MergeTolerance > 0))
+            continue;
+
+        out << "  " << StageName((JobStage)s) << ": ";
+        print_seconds(out, stats.Seconds[s]);
+        out << endl;
+    }
+    out << "  total: ";
+    print_seconds(out, totalSeconds);
+    out << endl;
+
+    out << "Lines parsed: " << stats.LinesParsed << (info.CacheHit? " (from the cache)" : "");
+    if (stats.ParseChunks > 1)
+        out << " (in " << stats.ParseChunks << " chunks)";
+    out << endl
+        << "Commands stored: " << stats.CommandsStored << endl
+        << "Moves split: " << stats.MovesSplit << " (" << stats.PiecesAdded << " pieces added, at most "
+        << stats.MostPieces << " from one move)" << endl
+        << "Lines merged: " << info.MergedLines << endl
+        << "Interpolations: " << stats.Interpolations << endl
+        << "Cells with a variable: " << stats.CellsAllocated << endl
+        << "Probes: " << info.ProbeCount << endl
+        << "Output bytes: " << stats.OutputBytes << endl
+        << "Peak memory (KB): " << PeakMemoryKB() << endl;
+
+    if (!stats.Pipelined)
+        return;
+
+    out << "Pipeline queues (batches of " << PIPELINE_BATCH_COMMANDS << " commands):" << endl;
+    for (int q = 0; q < QUEUE_COUNT; q++) {
+        const QueueStats &queue = stats.Queues[q];
+        double mean = (queue.Batches > 0)? (double)queue.OccupancySum / queue.Batches : 0;
+
+        if (queue.Batches == 0)
+            continue;
+
+        out << "  " << QueueName((PipelineQueue)q) << ": " << queue.Batches << " batches, "
+            << mean << " queued on average, " << queue.MaxOccupancy << " at most of " << queue.Capacity << endl
+            << "    producer waited " << queue.ProducerStalls << " times (";
+        print_seconds(out, queue.ProducerStallSeconds);
+        out << " s), consumer waited " << queue.ConsumerStalls << " times (";
+        print_seconds(out, queue.ConsumerStallSeconds);
+        out << " s)" << endl;
+    }
+}
+
+void PrintStatsJSON(ostream &out, const PCBProbeJob &job, double totalSeconds)
+{
+    const PCBProbeInfo &info = job.info;
+    const JobStats &stats = job.stats;
+
+    out << "{\"stages\":{";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        out << (s > 0? "," : "") << "\"" << StageName((JobStage)s) << "\":";
+        print_seconds(out, stats.Seconds[s]);
+    }
+    out << "},\"total_seconds\":";
+    print_seconds(out, totalSeconds);
+    out << ",\"cache_hit\":" << (info.CacheHit? "true" : "false")
+        << ",\"lines_parsed\":" << stats.LinesParsed
+        << ",\"parse_chunks\":" << stats.ParseChunks
+        << ",\"commands_stored\":" << stats.CommandsStored
+        << ",\"moves_split\":" << stats.MovesSplit
+        << ",\"pieces_added\":" << stats.PiecesAdded
+        << ",\"most_pieces\":" << stats.MostPieces
+        << ",\"lines_merged\":" << info.MergedLines
+        << ",\"interpolations\":" << stats.Interpolations
+        << ",\"cells_allocated\":" << stats.CellsAllocated
+        << ",\"probes\":" << info.ProbeCount
+        << ",\"output_bytes\":" << stats.OutputBytes
+        << ",\"peak_rss_kb\":" << PeakMemoryKB();
+
+    if (stats.Pipelined) {
+        out << ",\"queues\":{";
+        for (int q = 0; q < QUEUE_COUNT; q++) {
+            const QueueStats &queue = stats.Queues[q];
+
+            out << (q > 0? "," : "") << "\"" << QueueName((PipelineQueue)q) << "\":{"
+                << "\"batches\":" << queue.Batches
+                << ",\"occupancy_sum\":" << queue.OccupancySum
+                << ",\"max_occupancy\":" << queue.MaxOccupancy
+                << ",\"capacity\":" << queue.Capacity
+                << ",\"producer_stalls\":" << queue.ProducerStalls
+                << ",\"producer_stall_seconds\":";
+            print_seconds(out, queue.ProducerStallSeconds);
+            out << ",\"consumer_stalls\":" << queue.ConsumerStalls
+                << ",\"consumer_stall_seconds\":";
+            print_seconds(out, queue.ConsumerStallSeconds);
+            out << "}";
+        }
+        out << "}";
+    }
+    out << "}" << endl;
+}
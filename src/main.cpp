@@ -6,48 +6,372 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <thread>
+#include <vector>
 #include "parser.h"
 #include "pcb-probe.h"
+#include "probe-mesh.h"
+#include "job-stats.h"
+#include "batch-runner.h"
+#include "toolpath-cache.h"
+#include "probe-session.h"
 
 using namespace std;
 
+static void usage(const char *progname)
+{
+    cerr << "Usage: " << progname << " [options] [<grid size in mm>] infile outfile" << endl
+         << "       " << progname << " [options] --batch=<list or directory> [<grid size in mm>]" << endl
+         << "       " << progname << " [options] --session [<grid size in mm>] infile outfile infile outfile ..." << endl
+         << endl
+         << "Options:" << endl
+         << "  --max-segment=<mm>   Split cutting moves longer than this (default: no limit)" << endl
+         << "  --merge-tolerance=<mm>" << endl
+         << "                       Merge cutting moves that stay this close to a straight" << endl
+         << "                       line (default: 0, keep every move)" << endl
+         << "  --probe-order=<order>" << endl
+         << "                       Probe visiting order: optimized (default) or serpentine" << endl
+         << "  --adaptive[=<n>]     Probe coarser where there is little to cut, cells" << endl
+         << "                       with more than n cells of cuts stay fine (default " << MESH_SPLIT_DENSITY << ")" << endl
+         << "  --quad-params        Give every grid quad coefficient parameters, cutting" << endl
+         << "                       lines only weigh those of their own quad" << endl
+         << "  --heightmap=<file>   Take the heights from a probe log or x,y,z CSV and" << endl
+         << "                       write plain Z values, no probing" << endl
+         << "  --surface=<model>    Heights between the probes: bilinear (default) or" << endl
+         << "                       bicubic, smoother and fit for a coarser grid" << endl
+         << "  --stats[=json]       Print the time of every stage and what it did to" << endl
+         << "                       stderr, as text or one line of JSON" << endl
+         << "  --cache[=<file>]     Keep the parsed file in a binary cache (default:" << endl
+         << "                       infile" << CACHE_SUFFIX << ") and use it while the file is unchanged" << endl
+         << "  --batch=<path>       Process many files at once, path is a directory of" << endl
+         << "                       G-Code files or a list of \"infile [outfile]\" lines" << endl
+         << "  --out-dir=<dir>      Where batch files without an outfile are written" << endl
+         << "  --jobs=<n>           Files processed at once, or threads parsing a single" << endl
+         << "                       large file (default: one per core)" << endl
+         << "  --stream             Read the file again for every pass instead of keeping" << endl
+         << "                       it in memory, for files too large for it" << endl
+         << "  --pipeline           --stream with the parsing, the compensation and the" << endl
+         << "                       writing on threads of their own" << endl
+         << "  --session            The files are cut on the same board: probe once for all" << endl
+         << "                       of them in the first output, the others reuse the heights" << endl;
+    exit(1);
+}
+
+/*
+ * Runs the files of one board as a session, the first output probes for
+ * all of them.  Returns the exit status.
+ */
+static int run_session(const vector<char *> &args, const PCBProbeInfo &info, bool stats, bool stats_json,
+                       chrono::steady_clock::time_point start)
+{
+    vector<SessionFile> files;
+    size_t first = args.size() % 2;
+    PCBProbeInfo options = info;
+
+    if (first == 1) {
+        double gsize = atof(args[0]);
+
+        options.GridSize = gsize == 0.0? 5.0 : gsize;
+    }
+    for (size_t k = first; k < args.size(); k += 2) {
+        SessionFile file;
+
+        file.InPath = args[k];
+        file.OutPath = args[k + 1];
+        files.push_back(file);
+    }
+
+    vector<PCBProbeJob> jobs(files.size());
+
+    for (size_t k = 0; k < jobs.size(); k++) {
+        jobs[k].info = options;
+        jobs[k].stats.Enabled = stats;
+    }
+
+    try {
+        RunSession(files, jobs);
+    } catch (const ProbeError &e) {
+        cerr << e.what() << endl;
+        return e.getStatus();
+    }
+
+    const PCBProbeInfo &board = jobs[0].info;
+    string unit = (board.UnitType == UNIT_INCHES)? "Inches" : "mm";
+
+    cout << "Board Size (" << unit << "): " << fabs(board.MillMaxX - board.MillMinX) << "x"
+         << fabs(board.MillMinY - board.MillMaxY) << " (all files)" << endl;
+    for (size_t k = 0; k < files.size(); k++) {
+        cout << files[k].InPath << " -> " << files[k].OutPath << ": ";
+        if (k == 0)
+            cout << board.ProbeCount << " probes, travel " << board.ProbeTravel << endl;
+        else
+            cout << "no probing, " << jobs[k].stats.CellsAllocated << " cells more than the files before it" << endl;
+    }
+
+    if (stats) {
+        double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        for (size_t k = 0; k < jobs.size(); k++) {
+            if (stats_json) {
+                PrintStatsJSON(cerr, jobs[k], total);
+            } else {
+                cerr << files[k].InPath << ":" << endl;
+                PrintStats(cerr, jobs[k], total);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Runs every file of a batch and prints how each went, returns the exit
+ * status of the first file that failed
+ */
+static int run_batch(const char *list_path, const char *out_dir, const BatchOptions &options)
+{
+    vector<BatchFile> files;
+
+    try {
+        ReadBatchList(list_path, out_dir, files);
+    } catch (const ProbeError &e) {
+        cerr << e.what() << endl;
+        return e.getStatus();
+    }
+
+    cout << "Processing " << files.size() << " files on " << options.Threads << " threads" << endl;
+
+    double seconds = RunBatch(files, options);
+    unsigned long long bytes = 0;
+    unsigned int failed = 0;
+    int status = 0;
+
+    for (size_t k = 0; k < files.size(); k++) {
+        const BatchFile &file = files[k];
+
+        if (file.Status != 0) {
+            cerr << file.InPath << ": " << file.Error << endl;
+            if (failed++ == 0)
+                status = file.Status;
+            continue;
+        }
+
+        bytes += file.Size;
+        cout << file.InPath << " -> " << file.OutPath << ": " << file.ProbeCount << " probes, "
+             << file.Seconds << " s" << (file.CacheSkipped? ", toolpath cache not written" : "") << endl;
+        if (!file.Stats.empty())
+            cerr << file.Stats;
+    }
+
+    cout << "Done: " << files.size() - failed << " files, " << failed << " failed, "
+         << bytes / 1e6 << " MB in " << seconds << " s ("
+         << ((seconds > 0)? bytes / 1e6 / seconds : 0) << " MB/s)" << endl;
+
+    return status;
+}
+
 int main(int argc, char** argv) {
 	char *infile_path, *outfile_path;
+    vector<char *> args;
+    const char *heightmap_path = NULL;
+    const char *batch_path = NULL;
+    const char *out_dir = NULL;
+    const char *cache_path = NULL;
+    string default_cache;
+    bool use_cache = false;
+    bool stream = false;
+    unsigned int threads = thread::hardware_concurrency();
+    bool stats_json = false;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool session = false;
+    PCBProbeJob job;
+    PCBProbeInfo &info = job.info;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--max-segment=", 14) == 0) {
+            info.SplitOver = atof(argv[i] + 14);
+        } else if (strncmp(argv[i], "--merge-tolerance=", 18) == 0) {
+            info.MergeTolerance = atof(argv[i] + 18);
+        } else if (strcmp(argv[i], "--probe-order=optimized") == 0) {
+            info.ProbeOrder = PROBE_ORDER_OPTIMIZED;
+        } else if (strcmp(argv[i], "--probe-order=serpentine") == 0) {
+            info.ProbeOrder = PROBE_ORDER_SERPENTINE;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            info.Adaptive = true;
+        } else if (strcmp(argv[i], "--quad-params") == 0) {
+            info.QuadParams = true;
+        } else if (strcmp(argv[i], "--surface=bilinear") == 0) {
+            info.Surface = SURFACE_BILINEAR;
+        } else if (strcmp(argv[i], "--surface=bicubic") == 0) {
+            info.Surface = SURFACE_BICUBIC;
+        } else if (strncmp(argv[i], "--heightmap=", 12) == 0) {
+            heightmap_path = argv[i] + 12;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            job.stats.Enabled = true;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            job.stats.Enabled = true;
+            stats_json = true;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = true;
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            use_cache = true;
+            cache_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--out-dir=", 10) == 0) {
+            out_dir = argv[i] + 10;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            threads = (unsigned int)atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            stream = true;
+            info.Pipeline = true;
+        } else if (strncmp(argv[i], "--adaptive=", 11) == 0) {
+            info.Adaptive = true;
+            info.AdaptiveDensity = atof(argv[i] + 11);
+        } else if (strcmp(argv[i], "--session") == 0) {
+            session = true;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            usage(argv[0]);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    int nargs = (int)args.size();
+
+    //The bicubic patch has no adaptive or quad-params form and is only streamed with a height map
+    if (info.Surface == SURFACE_BICUBIC && (info.Adaptive || info.QuadParams || (stream && heightmap_path == NULL)))
+        usage(argv[0]);
+
+    if (session) {
+        if (batch_path != NULL || stream || use_cache || heightmap_path != NULL || info.Adaptive || nargs < 2)
+            usage(argv[0]);
+
+        info.Threads = (threads > 0)? threads : 1;
+        return run_session(args, info, job.stats.Enabled, stats_json, start);
+    }
+
+    if (batch_path != NULL) {
+        BatchOptions options;
+
+        if (nargs > 1 || cache_path != NULL || stream)
+            usage(argv[0]);
+        if (nargs == 1) {
+            double gsize = atof(args[0]);
+
+            info.GridSize = gsize == 0.0? 5.0 : gsize;
+        }
+
+        options.Info = info;
+        options.HeightMapPath = heightmap_path;
+        options.Stats = job.stats.Enabled;
+        options.StatsJSON = stats_json;
+        options.Cache = use_cache;
+        options.Threads = (threads > 0)? threads : 1;
+
+        return run_batch(batch_path, out_dir, options);
+    }
+
+    if (((nargs != 2) && (nargs != 3)) ||
+            (stream && (use_cache || info.Adaptive || info.QuadParams || info.MergeTolerance > 0)))
+        usage(argv[0]);
+
+    if (nargs == 2) {
+        infile_path = args[0];
+        outfile_path = args[1];
+    } else {
+        double gsize = atof(args[0]);
+
+        info.GridSize = gsize == 0.0? 5.0 : gsize;
+        infile_path = args[1];
+        outfile_path = args[2];
+    }
+
+    info.Threads = (threads > 0)? threads : 1;
+
+    if (use_cache && cache_path == NULL) {
+        default_cache = string(infile_path) + CACHE_SUFFIX;
+        cache_path = default_cache.c_str();
+    }
+
+    try {
+        if (heightmap_path != NULL) {
+            job.LoadHeightMap(heightmap_path);
+            cout << "Height map: " << heightmap_path << endl;
+        }
+
+        cout << "Processing input file ... " << infile_path << endl;
+        if (stream) {
+            cout << "Streaming GCode output to " << outfile_path << endl;
+            job.StreamGCode(infile_path, outfile_path);
+        } else {
+            job.LoadAndSplitSegments(infile_path, cache_path);
+            if (cache_path != NULL && (info.CacheHit || info.CacheWritten)) {
+                cout << "Toolpath cache: " << (info.CacheHit? "used " : "written to ") << cache_path << endl;
+            } else if (cache_path != NULL) {
+                cout << "Warning: toolpath cache not written to " << cache_path
+                     << " (it can't be written there, or a command has more than a cache record holds)" << endl;
+            }
+            job.MergeSegments();
+        }
+
+        string unit = (info.UnitType == UNIT_INCHES)? "Inches" : "mm";
+        cout << "Board Size (" << unit << "): " << fabs(info.MillMaxX - info.MillMinX) << "x" << fabs(info.MillMinY - info.MillMaxY) << endl << endl;
+
+        if (info.MergeTolerance > 0)
+            cout << "Merged moves: " << info.MergedLines << " lines removed" << endl;
+
+        if (!stream) {
+            cout << "Generating GCode output in " << outfile_path;
+            job.DoInterpolation();
+            cout << " ." << endl;
+            job.GenerateGCodeWithProbing(outfile_path);
+        }
+        if (info.UseHeightMap) {
+            if (info.HeightMapOutside > 0) {
+                cout << "Warning: " << info.HeightMapOutside << " points outside of the height map, "
+                        "they use the height at its edge" << endl;
+            }
+        } else {
+            cout << "Probes: " << info.ProbeCount;
+            if (info.Adaptive) {
+                cout << " (uniform grid: " << info.UniformProbeCount << ", "
+                     << (int)info.UniformProbeCount - (int)info.ProbeCount << " saved)";
+            }
+            cout << endl;
+            cout << "Probe travel (" << unit << "): " << info.ProbeTravel
+                 << " (row by row: " << info.ProbeTravelSerpentine << ")" << endl;
+            if (info.QuadParams) {
+                double bytes = job.stats.OutputBytes;
+                double change = (info.BlendBytes > 0)? 100.0 * (bytes - info.BlendBytes) / info.BlendBytes : 0;
+
+                cout << "Quad coefficients: " << info.QuadCount << " quads, " << info.QuadLines << " lines, "
+                     << job.stats.OutputBytes << " bytes (four weights: " << info.BlendBytes << ", "
+                     << fabs(change) << ((change > 0)? "% larger)" : "% smaller)") << endl;
+            }
+        }
+        cout << "Done." << endl;
+    } catch (const ProbeError &e) {
+        cerr << e.what() << endl;
+        return e.getStatus();
+    }
+
+    if (job.stats.Enabled) {
+        double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (stats_json)
+            PrintStatsJSON(cerr, job, total);
+        else
+            PrintStats(cerr, job, total);
+    }
 
-    if ((argc != 3) && (argc != 4)) {
-        cerr << "Usage: " << argv[0] << " [<grid size in mm>] infile outfile" << endl;
-        exit(1);
-    }
-
-	info.GridSize = 5; //5 mm by default
-
-	if (argc == 3) {
-		infile_path = argv[1];
-		outfile_path = argv[2];
-	} else {
-        double gsize = atof(argv[1]);
-		
-		info.GridSize = gsize == 0.0? 5.0 : gsize;
-		infile_path = argv[2];
-		outfile_path = argv[3];
-	}
-
-    cout << "Processing input file ... " << infile_path << endl;
-    LoadAndSplitSegments(infile_path);
-    
-    string unit = (info.UnitType == UNIT_INCHES)? "Inches" : "mm";
-    cout << "Board Size (" << unit << "): " << fabs(info.MillMaxX - info.MillMinX) << "x" << fabs(info.MillMinY - info.MillMaxY) << endl << endl;
-    
-    cout << "Generating GCode output in " << outfile_path;
-    DoInterpolation();
-    cout << " ." << endl;
-    GenerateGCodeWithProbing(outfile_path);
-    cout << "Done." << endl;
-    
     return 0;
 }
 
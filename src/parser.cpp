@@ -1,39 +1,274 @@
 #include <stdlib.h>
-#include <iostream>
-#include <sstream>
+#include <stdint.h>
+#include <algorithm>
+#include <charconv>
 
 #include "parser.h"
 
-extern int currentLine;
+static const double pow10tab[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-double ParseNumber(string &line, unsigned int &pos)
+static inline bool IsSpace(char c)
 {
-    double result = 0.0;
-    string str = "";
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-    while (pos < line.length() && line[pos] != ' ')
-        str += line[pos++];
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
 
-    result = atof(str.c_str());
+static inline bool IsAlpha(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+/*
+ * Forms atof() accepts that CAM tools never write (hexadecimal, inf, nan
+ * and out of range values)
+ */
+static double ScanNumberSlow(const char *start, const char *end, bool negative)
+{
+    string text(start, end - start);
+    double result = strtod(text.c_str(), NULL);
 
-    return result;
+    return negative? -result : result;
 }
 
-void SkipSpaces(string &line, unsigned int &pos)
+/*
+ * Converts the number at the start of [p, end) the way atof() does, but
+ * without depending on the locale.  Numbers with up to 15 digits and a
+ * small exponent (all that CAM tools write) are exact with a single
+ * multiplication or division, anything else is left to from_chars().
+ */
+static double ScanNumber(const char *p, const char *end)
 {
-    while (pos < line.length() && isspace(line[pos]))
+    while (p < end && IsSpace(*p))
+        p++;
+
+    bool negative = false;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    const char *start = p;
+    uint64_t mantissa = 0;
+    int digits = 0;         //Significant digits
+    int fraction = 0;       //Digits after the decimal point
+    bool any = false;
+
+    while (p < end && IsDigit(*p)) {
+        if (mantissa != 0 || *p != '0') {
+            if (digits < 19)
+                mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+        }
+        any = true;
+        p++;
+    }
+
+    if (p - start == 1 && *start == '0' && p < end && (*p == 'x' || *p == 'X'))
+        return ScanNumberSlow(start, end, negative); //Hexadecimal
+
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && IsDigit(*p)) {
+            if (mantissa != 0 || *p != '0') {
+                if (digits < 19)
+                    mantissa = mantissa * 10 + (*p - '0');
+                digits++;
+            }
+            fraction++;
+            any = true;
+            p++;
+        }
+    }
+
+    if (!any) {
+        if (start < end && (*start == 'i' || *start == 'I' || *start == 'n' || *start == 'N'))
+            return ScanNumberSlow(start, end, negative); //inf or nan
+
+        return 0.0;
+    }
+
+    int exponent = 0;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExp = false;
+
+        if (q < end && (*q == '-' || *q == '+'))
+            negativeExp = (*q++ == '-');
+
+        if (q < end && IsDigit(*q)) {
+            while (q < end && IsDigit(*q)) {
+                if (exponent < 100000)
+                    exponent = exponent * 10 + (*q - '0');
+                q++;
+            }
+            if (negativeExp)
+                exponent = -exponent;
+            p = q;
+        }
+    }
+
+    double result;
+    int scale = exponent - fraction;
+
+    if (mantissa == 0) {
+        result = 0.0;
+    } else if (digits <= 15 && scale >= -22 && scale <= 22) {
+        result = (scale < 0)? (double)mantissa / pow10tab[-scale] : (double)mantissa * pow10tab[scale];
+    } else {
+        from_chars_result r = from_chars(start, p, result);
+
+        if (r.ec == errc::result_out_of_range)
+            return ScanNumberSlow(start, p, negative);
+    }
+
+    return negative? -result : result;
+}
+
+/*
+ * Argument values run up to the next blank
+ */
+double ParseNumber(string_view line, size_t &pos)
+{
+    size_t start = pos;
+
+    while (pos < line.length() && line[pos] != ' ')
+        pos++;
+
+    return ScanNumber(line.data() + start, line.data() + pos);
+}
+
+void SkipSpaces(string_view line, size_t &pos)
+{
+    while (pos < line.length() && IsSpace(line[pos]))
         pos++;
 }
 
-string NextToken(string &line, unsigned int &pos)
+GCodeExtra *ExtraTable::add()
+{
+    lock_guard<mutex> guard(lock);
+
+    if (!unused.empty()) {
+        GCodeExtra *extra = unused.back();
+
+        unused.pop_back();
+        return extra;
+    }
+
+    items.emplace_back();
+    return &items.back();
+}
+
+GCodeExtra *ExtraTable::add(const GCodeExtra &extra)
+{
+    GCodeExtra *copy = add();
+
+    *copy = extra;
+    return copy;
+}
+
+/*
+ * Keeps the memory of its strings for the next line that needs one
+ */
+void ExtraTable::release(GCodeExtra *extra)
+{
+    extra->name.clear();
+    extra->letters.clear();
+    extra->values.clear();
+    extra->words.clear();
+
+    lock_guard<mutex> guard(lock);
+
+    unused.push_back(extra);
+}
+
+void ExtraTable::clear()
+{
+    items.clear();
+    unused.clear();
+}
+
+GCodeExtra &GCodeCommand::ownExtra()
 {
-    string result = "";
+    if (extra == NULL)
+        extra = extraTable->add();
+
+    return *extra;
+}
+
+void GCodeCommand::setExtraName(const char *name, unsigned int len)
+{
+    ownExtra().name.assign(name, len);
+}
+
+void GCodeCommand::setExtraArgument(char argName, Real argValue)
+{
+    GCodeExtra &e = ownExtra();
+    size_t k = e.letters.find(argName);
+
+    if (k == string::npos) {
+        e.letters += argName;
+        e.values.push_back(argValue);
+    } else {
+        e.values[k] = argValue;
+    }
+}
+
+void GCodeCommand::addExtraWord(char argName)
+{
+    ownExtra().words += argName;
+}
+
+void GCodeCommand::removeExtra(char argName)
+{
+    size_t k = extra->letters.find(argName);
+
+    if (k != string::npos) {
+        extra->letters.erase(k, 1);
+        extra->values.erase(extra->values.begin() + k);
+    }
+    extra->words.erase(remove(extra->words.begin(), extra->words.end(), argName), extra->words.end());
+}
+
+static int GetOpcode(const char *name, unsigned int len)
+{
+    if (len == 0)
+        return GCODE_NONE;
+
+    if (len == 3 && name[0] == 'G') {
+        if (name[1] == '0' && name[2] == '0') return GCODE_G00;
+        if (name[1] == '0' && name[2] == '1') return GCODE_G01;
+        if (name[1] == '0' && name[2] == '2') return GCODE_G02;
+        if (name[1] == '0' && name[2] == '3') return GCODE_G03;
+        if (name[1] == '2' && name[2] == '0') return GCODE_G20;
+        if (name[1] == '2' && name[2] == '1') return GCODE_G21;
+        if (name[1] == '8' && name[2] == '2') return GCODE_G82;
+    }
+
+    switch (name[0]) {
+        case 'M': return GCODE_M;
+        case 'S': return GCODE_S;
+        default:  return GCODE_OTHER;
+    }
+}
 
+/*
+ * Reads the command name into command.name, returns false
+ * if there is no command on the line
+ */
+bool NextToken(string_view line, size_t &pos, GCodeCommand &command)
+{
     while (1) {
         SkipSpaces(line, pos);
 
-        if (pos == line.length())
-            return result;
+        if (pos >= line.length())
+            return false;
 
         switch (line[pos]) {
             case '(': //Comment
@@ -45,34 +280,55 @@ string NextToken(string &line, unsigned int &pos)
                 continue;
             case 'X': //pcb2gcode generate lines with no commands, we assume G01
                 pos = 0;
-                return "G01";
+                command.setName(GCODE_G01, "G01", 3);
+                return true;
             case 'S':
             case 'M':
-            case 'G':
-                while (pos < line.length() && !isspace(line[pos]))
-                    result += line[pos++];
+            case 'G': {
+                size_t start = pos;
+
+                while (pos < line.length() && !IsSpace(line[pos]))
+                    pos++;
 
-                return result;
+                command.setName(GetOpcode(&line[start], pos - start), &line[start], pos - start);
+                return true;
+            }
             default:
-                cerr << currentLine << ": Unknown symbol '" << line[pos] << "'" << endl;
-                exit(2);
+                throw ProbeError(PROBE_ERROR_SYNTAX, string("Unknown symbol '") + line[pos] + "'");
         }
     }
 
-    return result;
+    return false;
 }
 
-void ParseGCodeLine(string& line, GCodeCommand& command)
+bool HasCommand(string_view line)
 {
-    unsigned int i = 0;
+    size_t pos = 0;
 
-    //Get command name
-    string cmd_name = NextToken(line, i);
+    while (1) {
+        SkipSpaces(line, pos);
+
+        if (pos >= line.length())
+            return false;
+        if (line[pos] != '(')
+            return true;
+
+        while (pos < line.length() && line[pos] != ')')
+            pos++;
+
+        pos++;
+    }
+}
+
+void ParseGCodeLine(string_view line, GCodeCommand& command, ExtraTable &extras)
+{
+    size_t i = 0;
 
     command.Clear();
-    command.name = cmd_name;
+    command.extraTable = &extras;
 
-    if (i >= line.length()) //No command, just a comment
+    //Get command name
+    if (!NextToken(line, i, command) || i >= line.length()) //No command, just a comment
         return;
 
     //Get command arguments
@@ -86,9 +342,10 @@ void ParseGCodeLine(string& line, GCodeCommand& command)
         if (i >= line.length())
             break;
 
-        if (isalpha(line[i])) {
+        if (IsAlpha(line[i])) {
             argName = line[i++];
             argValue = ParseNumber(line, i);
+
             command.addArgument(argName, argValue);
         } else {
             if (line[i] == '(') { //Is a comment
@@ -97,32 +354,9 @@ void ParseGCodeLine(string& line, GCodeCommand& command)
 
                 i++;
             } else {
-                cerr << currentLine << ": Unknown argument '" << line[i] << "'" << endl;
-                exit(3);
+                throw ProbeError(PROBE_ERROR_ARGUMENTS, string("Unknown argument '") + line[i] + "'");
             }
         }
 
     }
 }
-
-string GCodeCommand::ToString()
-{
-    stringstream ss;
-
-    ss.precision(4);
-
-    ss << name;
-
-    for (unsigned int i = 0; i < argNameList.length(); i++) {
-        char argName = argNameList[i];
-        Real value = arguments[argName];
-
-        if (argName != 'Z' || zformula.empty()) {
-            ss << " " << argName << fixed << value;
-        } else {
-            ss << " " << argName << "[" << zformula << "]";
-        }
-    }
-
-    return ss.str();
-}
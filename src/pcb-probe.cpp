@@ -1,434 +1,2660 @@
 #include <cmath>
-#include <iostream>
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <list>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <thread>
 #include "pcb-probe.h"
+#include "command-arena.h"
+#include "gcode-reader.h"
+#include "cell-grid.h"
+#include "gcode-writer.h"
+#include "probe-mesh.h"
+#include "height-map.h"
+#include "job-stats.h"
+#include "toolpath-cache.h"
+#include "spsc-ring.h"
 
 using namespace std;
 
-PCBProbeInfo info;
-list<GCodeCommand> cmdList;
-map<string, int> cellVariables; //GCode parameters associated with every cell in the Grid
-int nextVariableNumber = 2000;
-int currentLine = 0;
+PCBProbeJob::PCBProbeJob()
+{
+    info = PCBProbeInfo();
+    info.UnitType = UNIT_MM;
+    info.GridSize = 5; //5 mm by default
+    info.ProbeOrder = PROBE_ORDER_OPTIMIZED;
+    info.WeightKernel = BestWeightKernel();
+    info.Surface = SURFACE_BILINEAR;
+    info.AdaptiveDensity = MESH_SPLIT_DENSITY;
+    info.Threads = 1;
+
+    stats = JobStats();
+    nextVariableNumber = 2000;
+    firstVariable = 2000;
+    sharedVariables = false;
+    currentLine = 0;
+    meshBuilt = false;
+}
+
+static inline void move_to(Position &pos, const GCodeCommand &command)
+{
+    if (command.hasXCoord())
+        pos.x = command.getXCoord();
+
+    if (command.hasYCoord())
+        pos.y = command.getYCoord();
+
+    if (command.hasZCoord())
+        pos.z = command.getZCoord();
+}
+
+/*
+ * Where the moves of a stretch of commands leave the tool on each axis
+ * they set, so the stretch after it knows where it starts without going
+ * through them again
+ */
+struct MoveTrail {
+    Position last;
+    bool hasX, hasY, hasZ;
+
+    void reset()
+    {
+        last = Position();
+        hasX = hasY = hasZ = false;
+    }
+
+    void follow(const GCodeCommand &command)
+    {
+        hasX = hasX || command.hasXCoord();
+        hasY = hasY || command.hasYCoord();
+        hasZ = hasZ || command.hasZCoord();
+        move_to(last, command);
+    }
+
+    void apply(Position &pos) const
+    {
+        if (hasX)
+            pos.x = last.x;
+        if (hasY)
+            pos.y = last.y;
+        if (hasZ)
+            pos.z = last.z;
+    }
+};
+
+inline void PCBProbeJob::moveTo(const GCodeCommand &command)
+{
+    move_to(info.Pos, command);
+}
+
+static inline bool is_arc(int opcode)
+{
+    return opcode == GCODE_G02 || opcode == GCODE_G03;
+}
 
 /*
- * This routine will split up long distances into chunks
- * if recursively halves the values (so we don't have to
- * worry about being proportional)
+ * Commands that take the tool somewhere, cutting if it is below zero
  */
-static void distance_split(Real from_x, Real from_y, GCodeCommand &command)
+static inline bool is_move(int opcode)
 {
-    Real to_x = command.getXCoord();
-    Real to_y = command.getYCoord();
+    return opcode == GCODE_G00 || opcode == GCODE_G01 || is_arc(opcode) || opcode == GCODE_G82;
+}
+
+/*
+ * An arc in the XY plane from where the tool is.  Angles are in radians,
+ * sweep is how far it turns in its own direction, up to a full circle.
+ */
+struct ArcGeometry {
+    Real cx, cy;
+    Real r;
+    Real start;
+    Real sweep;
+    bool clockwise;
+};
 
-    Real dist_x = to_x - from_x;
-    Real dist_y = to_y - from_y;
+#define ARC_MAX_SWEEP   (M_PI / 2)  //Arcs are split in pieces of at most a quarter turn
+
+/*
+ * Centre from I J (relative to the start) or from R (negative for more
+ * than half a turn).  Returns false if the arc has neither or no radius.
+ */
+static bool arc_geometry(const GCodeCommand &cmd, Real fromX, Real fromY, ArcGeometry &arc)
+{
+    Real toX = cmd.hasXCoord()? cmd.getXCoord() : fromX;
+    Real toY = cmd.hasYCoord()? cmd.getYCoord() : fromY;
 
-    if (fabs(dist_x) > info.SplitOver || fabs(dist_y) > info.SplitOver) {
-        Real mp_x = from_x + (dist_x / 2);
-        Real mp_y = from_y + (dist_y / 2);
+    arc.clockwise = cmd.opcode == GCODE_G02;
 
-        GCodeCommand cmd1(command.name, mp_x, mp_y);
-        GCodeCommand cmd2(command.name, to_x, to_y);
+    if (cmd.hasArgument('I') || cmd.hasArgument('J')) {
+        arc.cx = fromX + cmd.getArgument('I');
+        arc.cy = fromY + cmd.getArgument('J');
+    } else if (cmd.hasArgument('R')) {
+        Real r = cmd.getArgument('R');
+        Real dx = toX - fromX, dy = toY - fromY;
+        Real d = sqrt(dx * dx + dy * dy);
 
-        if (command.hasFeedRate())
-            cmd1.setFeedRate(command.getFeedRate());
+        if (d == 0)
+            return false;
 
+        //The centre is left of the chord for a short counterclockwise arc
+        Real h = sqrt(max(r * r - d * d / 4, (Real)0));
+        Real side = (arc.clockwise? -1 : 1) * (r < 0? -1 : 1);
 
-        distance_split(from_x, from_y, cmd1);
-        distance_split(mp_x, mp_y, cmd2);
+        arc.cx = (fromX + toX) / 2 - side * h * dy / d;
+        arc.cy = (fromY + toY) / 2 + side * h * dx / d;
     } else {
-        cmdList.push_back(command);
+        return false;
     }
+
+    arc.r = sqrt((fromX - arc.cx) * (fromX - arc.cx) + (fromY - arc.cy) * (fromY - arc.cy));
+    if (arc.r == 0)
+        return false;
+
+    Real end = atan2(toY - arc.cy, toX - arc.cx);
+
+    arc.start = atan2(fromY - arc.cy, fromX - arc.cx);
+    arc.sweep = fmod(arc.clockwise? arc.start - end : end - arc.start, 2 * M_PI);
+    if (arc.sweep < 0)
+        arc.sweep += 2 * M_PI;
+    if (arc.sweep < 1e-9)
+        arc.sweep += 2 * M_PI;   //Back where it started, a full circle
+
+    return true;
 }
 
-static void split_if_needed(GCodeCommand &command)
+static Real arc_angle(const ArcGeometry &arc, Real t)
 {
-    if (info.Pos.z >= 0 || !command.hasXCoord() || !command.hasYCoord()) {
-        cmdList.push_back(command);
-    } else {
-
-        /*
-         * We now have a start and end position, we can call our recursive routine...
-         */
-        distance_split(info.Pos.x, info.Pos.y, command);
-    }
+    return arc.start + (arc.clockwise? -arc.sweep : arc.sweep) * t;
 }
 
-static inline void moveTo(GCodeCommand &command)
+/*
+ * How far along the arc (0 to 1) the point at this angle is
+ */
+static Real arc_fraction(const ArcGeometry &arc, Real angle)
 {
-    if (command.hasXCoord())
-        info.Pos.x = command.getXCoord();
+    Real turned = fmod(arc.clockwise? arc.start - angle : angle - arc.start, 2 * M_PI);
 
-    if (command.hasYCoord())
-        info.Pos.y = command.getYCoord();
+    if (turned < 0)
+        turned += 2 * M_PI;
 
-    if (command.hasZCoord())
-        info.Pos.z = command.getZCoord();
+    return turned / arc.sweep;
 }
 
-void LoadAndSplitSegments(const char *infile_path)
+/*
+ * Probes are taken at the centre of every cell and the depth is blended
+ * linearly between the centres, so the compensated surface bends along
+ * the lines through the cell centres.  This adds the points (as a fraction
+ * of the move) where a move on one axis crosses those lines.
+ */
+static void grid_crossings(Real from, Real to, Real origin, double g, unsigned int maxCell, vector<Real> &cuts)
 {
-    string line;
-    ifstream in(infile_path);
+    Real dist = to - from;
 
-    if (!in.is_open()) {
-        cerr << "Unable to open file: " << infile_path << endl;
+    if (dist == 0)
         return;
-    }
-
-    GCodeCommand cmd;
-    bool definedMillMinX = false;
-    bool definedMillMaxX = false;
-    bool definedMillMinY = false;
-    bool definedMillMaxY = false;
-    bool definedMillRouteDepth = false;
-	bool definedDrillSpotDepth = false;
-
-    info.ResetPos();
-    info.SplitOver = info.GridSize;
-	info.HasDrillSpots = false;
 
-    while (in.good()) {
+    Real lo = (min(from, to) - origin) / g - 0.5;
+    Real hi = (max(from, to) - origin) / g - 0.5;
+    long first = (long)max(ceil(lo), (Real)0);
+    long last = (long)min(floor(hi), (Real)maxCell);
 
-        currentLine++;
-        getline(in, line);
-        ParseGCodeLine(line, cmd);
-        
-        if (cmd.name == "G20") {
-            //Units in inches
-            info.GridSize = info.GridSize / 25.4;
-            info.SplitOver = info.SplitOver / 25.4;
-            info.UnitType = UNIT_INCHES;
-        } else if (cmd.name == "G21") {
-            info.UnitType = UNIT_MM;
-        }
+    for (long k = first; k <= last; k++) {
+        Real t = (origin + (k + 0.5) * g - from) / dist;
 
-        if (cmd.name == "G00" || cmd.name == "G01") {
-            /*
-             * We have a move command, if our z is below zero then this will
-             * count towards our area
-             */
-            split_if_needed(cmd);
-            moveTo(cmd);
+        if (t > 0 && t < 1)
+            cuts.push_back(t);
+    }
+}
 
-            if (info.Pos.z < 0) {
-                if (!definedMillRouteDepth || (info.Pos.z < info.MillRouteDepth))
-                    info.MillRouteDepth = info.Pos.z;
+/*
+ * The same for an arc, crossing the lines of one axis up to twice each
+ */
+static void arc_crossings(const ArcGeometry &arc, bool alongX, Real origin, double g, unsigned int maxCell, vector<Real> &cuts)
+{
+    Real centre = alongX? arc.cx : arc.cy;
+    Real lo = (centre - arc.r - origin) / g - 0.5;
+    Real hi = (centre + arc.r - origin) / g - 0.5;
+    long first = (long)max(ceil(lo), (Real)0);
+    long last = (long)min(floor(hi), (Real)maxCell);
 
-                if (!definedMillMinX || (info.Pos.x < info.MillMinX)) {
-                    definedMillMinX = true;
-                    info.MillMinX = info.Pos.x;
-                }
-                if (!definedMillMaxX || (info.Pos.x > info.MillMaxX)) {
-                    definedMillMaxX = true;
-                    info.MillMaxX = info.Pos.x;
-                }
-                if (!definedMillMinY || (info.Pos.y < info.MillMinY)) {
-                    definedMillMinY = true;
-                    info.MillMinY = info.Pos.y;
-                }
-                if (!definedMillMaxY || (info.Pos.y > info.MillMaxY)) {
-                    definedMillMaxY = true;
-                    info.MillMaxY = info.Pos.y;
-                }
-            }
+    for (long k = first; k <= last; k++) {
+        Real offset = (origin + (k + 0.5) * g - centre) / arc.r;
 
-		} else if (cmd.name == "G82") {
-			moveTo(cmd);
+        if (fabs(offset) >= 1)
+            continue;
 
-			info.HasDrillSpots = true;
-			if (!definedDrillSpotDepth && cmd.hasZCoord())
-				info.DrillSpotDepth = cmd.getZCoord();
+        Real a = alongX? acos(offset) : asin(offset);
+        Real angles[2] = { a, alongX? -a : (Real)M_PI - a };
 
-			cmdList.push_back(cmd);
+        for (int n = 0; n < 2; n++) {
+            Real t = arc_fraction(arc, angles[n]);
 
-		} else if (!cmd.name.empty()) {
-            cmdList.push_back(cmd);
+            if (t > 0 && t < 1)
+                cuts.push_back(t);
         }
     }
-    in.close();
+}
 
-	info.GridMaxX = (unsigned int)ceil((info.MillMaxX - info.MillMinX) / info.GridSize);
-    info.GridMaxY = (unsigned int)ceil((info.MillMaxY - info.MillMinY) / info.GridSize);
+/*
+ * Where the tool can get to on an arc, to include in the board size: the
+ * end and the sides of the circle the arc goes through
+ */
+static void arc_extent(const ArcGeometry &arc, Real &minX, Real &minY, Real &maxX, Real &maxY)
+{
+    for (int q = 0; q < 4; q++) {
+        Real t = arc_fraction(arc, q * M_PI / 2);
 
-	info.MillMinX -= info.GridSize / 2.0;
-	info.MillMinY -= info.GridSize / 2.0 ;
+        if (t > 0 && t < 1) {
+            Real x = arc.cx + arc.r * cos(q * M_PI / 2);
+            Real y = arc.cy + arc.r * sin(q * M_PI / 2);
 
-	info.Gx = (info.MillMaxX - info.MillMinX)/(info.GridMaxX + 0.5);
-	info.Gy = (info.MillMaxY - info.MillMinY)/(info.GridMaxY + 0.5);
+            minX = min(minX, x);
+            maxX = max(maxX, x);
+            minY = min(minY, y);
+            maxY = max(maxY, y);
+        }
+    }
 }
 
-//Second Pass
+/*
+ * The lines the compensated surface bends along are
+ * origin + (k + 0.5) * g for k = 0 .. max
+ */
+struct SplitGrid {
+    Real originX, originY;
+    double gx, gy;
+    unsigned int maxX, maxY;
+};
 
-string getKey(int gx, int gy)
+static void add_piece(const GCodeCommand &command, Real x, Real y, bool first, CommandArena &out)
 {
-    stringstream ss;
+    GCodeCommand piece(command.opcode, command.getName(), x, y);
 
-    ss << gx << "," << gy;
-    return ss.str();
+    if (first && command.hasFeedRate())
+        piece.addArgument('F', command.getFeedRate());
+
+    out.push_back(piece);
 }
 
 /*
- * This makes sure we have a variable assigned to a given cell
+ * Cuts a move where it crosses the grid lines, and in pieces no longer than
+ * info.SplitOver if that is set.  A crossing that would leave a piece
+ * shorter than SPLIT_MIN_FRACTION of a cell is skipped, the bend it misses
+ * is too small to matter.  The feed rate goes with the first piece, the
+ * last one is the original command.
  */
-void ensure_cell_variable(int gx, int gy)
+void PCBProbeJob::split_segment(const GCodeCommand &command, const SplitGrid &grid, vector<Real> &cuts, CommandArena &out)
 {
-    string key = getKey(gx, gy);
+    size_t before = out.size();
+    Real from_x = info.Pos.x;
+    Real from_y = info.Pos.y;
+    Real dist_x = command.getXCoord() - from_x;
+    Real dist_y = command.getYCoord() - from_y;
+    Real length = sqrt(dist_x * dist_x + dist_y * dist_y);
+
+    cuts.clear();
+    grid_crossings(from_x, command.getXCoord(), grid.originX, grid.gx, grid.maxX, cuts);
+    grid_crossings(from_y, command.getYCoord(), grid.originY, grid.gy, grid.maxY, cuts);
+    sort(cuts.begin(), cuts.end());
+    cuts.push_back(1);
+
+    Real min_step = SPLIT_MIN_FRACTION * min(grid.gx, grid.gy) / length;
+    Real t0 = 0;
+    bool first = true;
+
+    for (size_t i = 0; i < cuts.size(); i++) {
+        Real t = cuts[i];
+
+        if (t < 1 && (t - t0 < min_step || 1 - t < min_step))
+            continue;
+
+        if (info.SplitOver > 0) {
+            unsigned int n = (unsigned int)ceil((t - t0) * length / info.SplitOver);
 
-    if (cellVariables.find(key) == cellVariables.end()) {
-        cellVariables[key] = nextVariableNumber++;
+            for (unsigned int j = 1; j < n; j++) {
+                Real tj = t0 + (t - t0) * j / n;
+
+                add_piece(command, from_x + dist_x * tj, from_y + dist_y * tj, first, out);
+                first = false;
+            }
+        }
+
+        if (t < 1) {
+            add_piece(command, from_x + dist_x * t, from_y + dist_y * t, first, out);
+            first = false;
+        }
+        t0 = t;
+    }
+
+    size_t index = out.push_back(command);
+
+    if (!first)
+        out[index].removeArgument('F');
+
+    unsigned long pieces = out.size() - before;
+
+    if (pieces > 1) {
+        stats.MovesSplit++;
+        stats.PiecesAdded += pieces - 1;
+        stats.MostPieces = max(stats.MostPieces, pieces);
     }
 }
 
 /*
- * This functions returns true if a cell has a variable associated, false otherwise
+ * Sets or adds a centre offset, rounding error about a zero offset would
+ * print as -0.0000
+ */
+static void set_word(GCodeCommand &command, char argName, Real value)
+{
+    if (fabs(value) < 1e-9)
+        value = 0;
+
+    if (command.hasArgument(argName))
+        command.setArgument(argName, value);
+    else
+        command.addArgument(argName, value);
+}
+
+/*
+ * Arcs are cut the same way into shorter arcs, each with its own centre
+ * offset, and into pieces of at most a quarter turn whatever their
+ * length so the depth never has to follow a whole circle.  The last piece
+ * is the original command given the offset from where it now starts (an
+ * R becomes I J).
  */
-bool cellHasVariable(int gx, int gy)
+void PCBProbeJob::split_arc(const GCodeCommand &command, const ArcGeometry &arc, const SplitGrid &grid, vector<Real> &cuts, CommandArena &out)
 {
-    string key = getKey(gx, gy);
+    size_t before = out.size();
+    Real length = arc.r * arc.sweep;
+    Real min_step = SPLIT_MIN_FRACTION * min(grid.gx, grid.gy) / length;
+    unsigned int parts = (unsigned int)ceil(arc.sweep / ARC_MAX_SWEEP - 1e-9);
+    Real from_x = info.Pos.x;
+    Real from_y = info.Pos.y;
+    bool first = true;
+    size_t next = 0;
+
+    cuts.clear();
+    arc_crossings(arc, true, grid.originX, grid.gx, grid.maxX, cuts);
+    arc_crossings(arc, false, grid.originY, grid.gy, grid.maxY, cuts);
+    sort(cuts.begin(), cuts.end());
+
+    for (unsigned int p = 1; p <= parts; p++) {
+        Real part_end = (Real)p / parts;
+        Real t0 = (Real)(p - 1) / parts;
+
+        //The grid crossings in this part, then its end
+        for (;;) {
+            Real t = (next < cuts.size() && cuts[next] < part_end)? cuts[next++] : part_end;
+
+            if (t < part_end && (t - t0 < min_step || part_end - t < min_step))
+                continue;
+
+            unsigned int n = (info.SplitOver > 0)? (unsigned int)ceil((t - t0) * length / info.SplitOver) : 1;
+
+            for (unsigned int j = 1; j <= n; j++) {
+                Real tj = (j == n)? t : t0 + (t - t0) * j / n;
+
+                if (tj >= 1)
+                    break;
+
+                Real angle = arc_angle(arc, tj);
+                Real x = arc.cx + arc.r * cos(angle);
+                Real y = arc.cy + arc.r * sin(angle);
+                GCodeCommand piece(command.opcode, command.getName(), x, y);
+
+                set_word(piece, 'I', arc.cx - from_x);
+                set_word(piece, 'J', arc.cy - from_y);
+                if (first && command.hasFeedRate())
+                    piece.addArgument('F', command.getFeedRate());
+
+                out.push_back(piece);
+                first = false;
+                from_x = x;
+                from_y = y;
+            }
+
+            t0 = t;
+            if (t == part_end)
+                break;
+        }
+    }
+
+    size_t index = out.push_back(command);
+
+    if (!first) {
+        GCodeCommand &last = out[index];
+
+        last.removeArgument('F');
+        last.removeArgument('R');
+        set_word(last, 'I', arc.cx - from_x);
+        set_word(last, 'J', arc.cy - from_y);
+    }
+
+    unsigned long pieces = out.size() - before;
 
-    return (cellVariables.find(key) != cellVariables.end());
+    if (pieces > 1) {
+        stats.MovesSplit++;
+        stats.PiecesAdded += pieces - 1;
+        stats.MostPieces = max(stats.MostPieces, pieces);
+    }
 }
 
-int cell_variable(int gx, int gy)
+SplitGrid PCBProbeJob::split_grid() const
 {
-    string key = getKey(gx, gy);
-    return cellVariables[key];
+    SplitGrid grid;
+
+    if (info.UseHeightMap) {
+        grid.gx = heightMap.getStepX();
+        grid.gy = heightMap.getStepY();
+        grid.originX = heightMap.getOriginX() - grid.gx / 2;
+        grid.originY = heightMap.getOriginY() - grid.gy / 2;
+        grid.maxX = heightMap.getNodesX() - 1;
+        grid.maxY = heightMap.getNodesY() - 1;
+    } else {
+        grid.gx = info.Gx;
+        grid.gy = info.Gy;
+        grid.originX = info.MillMinX;
+        grid.originY = info.MillMinY;
+        grid.maxX = info.GridMaxX;
+        grid.maxY = info.GridMaxY;
+    }
+
+    return grid;
 }
 
 /*
- * Given a co-ordinate we can work out a grid x and y number
- * so we can lookup stuff 
+ * Runs once the grid is known, cutting moves are split where they cross
+ * the grid so every piece gets its own compensation
  */
-
-void grid_ref(Real x, Real y, unsigned int &ref_x, unsigned int &ref_y)
+void PCBProbeJob::SplitSegments()
 {
+    CommandArena split;
+    vector<Real> cuts;
+    SplitGrid grid = split_grid();
+    StageTimer timer(stats, STAGE_SPLIT);
 
-    Real zero_x = x - info.MillMinX;
-    Real zero_y = y - info.MillMinY;
+    stats.MovesSplit = stats.PiecesAdded = stats.MostPieces = 0;
+    info.ResetPos();
 
-    ref_x = (unsigned int)floor(zero_x / info.Gx);
-    ref_y = (unsigned int)floor(zero_y / info.Gy);
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        const GCodeCommand &cmd = cmdList[i];
+
+        ArcGeometry arc;
+
+        if ((cmd.opcode == GCODE_G00 || cmd.opcode == GCODE_G01) &&
+                info.Pos.z < 0 && cmd.hasXCoord() && cmd.hasYCoord()) {
+            split_segment(cmd, grid, cuts, split);
+        } else if (is_arc(cmd.opcode) && info.Pos.z < 0 && arc_geometry(cmd, info.Pos.x, info.Pos.y, arc)) {
+            split_arc(cmd, arc, grid, cuts, split);
+        } else {
+            split.push_back(cmd);
+        }
+
+        if (is_move(cmd.opcode))
+            moveTo(cmd);
+    }
+
+    cmdList.swap(split);
 }
 
 /*
- * Given a co-ordinate we need to interpolate the values from
- * the surrounding cells
+ * A run of straight cutting moves, points[0] is where the first one
+ * starts and moves[k] ends at points[k + 1]
  */
-string interpolate(Real x, Real y, bool isLinearMotionCommand)
+struct MoveRun {
+    vector<size_t> moves;
+    vector<Real> x, y;
+    Real minU, maxU, minV, maxV;    //Extent in grid cells
+};
+
+static Real point_segment_distance(Real x, Real y, Real ax, Real ay, Real bx, Real by)
 {
+    Real dx = bx - ax, dy = by - ay;
+    Real len2 = dx * dx + dy * dy;
+    Real t = (len2 > 0)? ((x - ax) * dx + (y - ay) * dy) / len2 : 0;
 
-    unsigned int cellx, celly;
-    grid_ref(x, y, cellx, celly);
+    t = (t < 0)? 0 : (t > 1)? 1 : t;
 
-    Real os_x = ((x - info.MillMinX) - ((Real) cellx * info.Gx)) / info.Gx;
-    Real os_y = ((y - info.MillMinY) - ((Real) celly * info.Gy)) / info.Gy;
+    Real ex = ax + t * dx - x, ey = ay + t * dy - y;
 
-    unsigned int px_cell = cellx + (os_x > 0.5 ? 1 : -1);
-    unsigned int py_cell = celly + (os_y > 0.5 ? 1 : -1);
+    return sqrt(ex * ex + ey * ey);
+}
 
-    if (px_cell < 0 || px_cell > info.GridMaxX) {
-        px_cell = cellx;
-    }
-    if (py_cell < 0 || py_cell > info.GridMaxY) {
-        py_cell = celly;
-    }
+/*
+ * Douglas-Peucker over the run, keep[k] tells whether points[k] stays
+ */
+static void simplify_run(const MoveRun &run, Real tolerance, vector<char> &keep)
+{
+    vector<pair<size_t, size_t> > stack;
+    size_t n = run.x.size();
 
-    Real x_pc = 0.5 + (os_x > 0.5 ? 1 - os_x : os_x);
-    Real y_pc = 0.5 + (os_y > 0.5 ? 1 - os_y : os_y);
+    keep.assign(n, 0);
+    keep[0] = keep[n - 1] = 1;
+    stack.push_back(make_pair((size_t)0, n - 1));
 
-    /*
-     * Now we can make sure that each of our cells has a variable in it...
-     */
-    ensure_cell_variable(cellx, celly);
-    ensure_cell_variable(px_cell, celly);
-    ensure_cell_variable(cellx, py_cell);
-    ensure_cell_variable(px_cell, py_cell);
+    while (!stack.empty()) {
+        size_t a = stack.back().first, b = stack.back().second;
+        size_t farthest = a;
+        Real dmax = 0;
 
-    /*
-     * Now we can work out the interpolation...
-     */
-	stringstream ss;
-	string depthParameter = isLinearMotionCommand? "#3" : "#7";
+        stack.pop_back();
+        for (size_t k = a + 1; k < b; k++) {
+            Real d = point_segment_distance(run.x[k], run.y[k], run.x[a], run.y[a], run.x[b], run.y[b]);
 
-    ss.precision(3);
-    ss << fixed << (x_pc * y_pc) << "*#" << cell_variable(cellx, celly) << " + " <<
-            ((1 - x_pc) * y_pc) << "*#" << cell_variable(px_cell, celly) << " + " <<
-            (x_pc * (1 - y_pc)) << "*#" << cell_variable(cellx, py_cell) << " + " <<
-            ((1 - x_pc) * (1 - y_pc)) << "*#" << cell_variable(px_cell, py_cell) << " + " <<
-            depthParameter;
+            if (d > dmax) {
+                dmax = d;
+                farthest = k;
+            }
+        }
 
-    return ss.str();
+        if (dmax > tolerance) {
+            keep[farthest] = 1;
+            stack.push_back(make_pair(a, farthest));
+            stack.push_back(make_pair(farthest, b));
+        }
+    }
 }
 
 /*
- * Last phase ... add the depth sensing bit to the file
+ * Writes the moves of the run that are kept at out, a feed rate on a
+ * dropped move goes to the next kept one
  */
-void DoInterpolation()
+size_t PCBProbeJob::flush_run(MoveRun &run, vector<char> &keep, size_t out)
 {
-    list<GCodeCommand>::iterator it = cmdList.begin();
+    if (run.moves.empty())
+        return out;
 
-    info.ResetPos();
-    while (it != cmdList.end()) {
-        GCodeCommand cmd = *it;
+    simplify_run(run, info.MergeTolerance, keep);
 
-        if (cmd.name == "G00" || cmd.name == "G01") {
-            /*
-             * We have a move command, if our z is below zero then this will
-             * count towards our area
-             */
-            moveTo(cmd);
+    bool carry = false;
+    Real feed = 0;
 
-            if (info.Pos.z < 0) {
-                /*
-                 * First thing we do is allocate a variable number to the grid
-                 * square (if it hasn't already got one)
-                 */
-                string zformula = interpolate(info.Pos.x, info.Pos.y, true);
-                it->setZFormula(zformula);
+    for (size_t k = 0; k < run.moves.size(); k++) {
+        const GCodeCommand &cmd = cmdList[run.moves[k]];
+
+        if (!keep[k + 1]) {
+            if (cmd.hasFeedRate()) {
+                carry = true;
+                feed = cmd.getFeedRate();
             }
+            info.MergedLines++;
+            continue;
+        }
 
-		} else if (cmd.name == "G82") {
-			moveTo(cmd);
+        cmdList[out] = cmd;
+        if (carry && !cmdList[out].hasFeedRate())
+            cmdList[out].addArgument('F', feed);
+        carry = false;
+        out++;
+    }
 
-			string zformula = interpolate(info.Pos.x, info.Pos.y, false);
-			it->setZFormula(zformula);
-		}
+    run.moves.clear();
+    run.x.clear();
+    run.y.clear();
 
-        it++;
-    }
+    return out;
+}
+
+/*
+ * Only plain X Y moves are dropped, the first one of a run may set the
+ * feed rate
+ */
+bool PCBProbeJob::is_mergeable(const GCodeCommand &cmd, bool first) const
+{
+    unsigned long long xy = GCodeCommand::letterBit('X') | GCodeCommand::letterBit('Y');
+    unsigned long long allowed = first? xy | GCodeCommand::letterBit('F') : xy;
 
+    return cmd.opcode == GCODE_G01 && info.Pos.z < 0 && (cmd.argMask & xy) == xy &&
+            (cmd.argMask & ~allowed) == 0 && cmd.wordCount == cmd.argCount && cmd.extra == NULL;
 }
 
-void GenerateGCodeWithProbing(const char *outfile_path)
+/*
+ * Merges runs of nearly collinear cutting moves, points stay within
+ * info.MergeTolerance of the merged move.  A run never spans more than one
+ * square of the grid (where the compensated surface is a single bilinear
+ * patch), so the compensation is the same as for the moves split on the
+ * grid.
+ */
+void PCBProbeJob::MergeSegments()
 {
-    ofstream out(outfile_path);
+    info.MergedLines = 0;
 
-    if (!out.is_open()) {
-        cerr << "Unable to open file: " << outfile_path << endl;
+    if (!(info.MergeTolerance > 0))
         return;
-    }
 
-    list<GCodeCommand>::iterator it = cmdList.begin();
+    StageTimer timer(stats, STAGE_MERGE);
 
-    while (it != cmdList.end()) {
-        GCodeCommand cmd = *it;
+    //The mesh is refined where there are many points, so it sees them all
+    if (info.Adaptive && !info.UseHeightMap)
+        build_mesh();
 
-        /*
-         * We'll put our stuff right after the G21
-         */
-        if (cmd.name == "G21" || cmd.name == "G20") {
-            Real clear_height;
-            Real traverse_height; //Traverse height
-            Real probe_depth;     //Probe max depth, stop at this position if not triggered
-            Real initial_probe;   // Initial probe Z position to find worksurface
-            Real traverse_speed; // Traver Speed
-            Real probe_speed; //Probe Speed
-                
-            if (info.UnitType == UNIT_INCHES) {
-                clear_height = 0.47244;
-                traverse_height = 0.01969;
-                probe_depth = -0.03937;
-                initial_probe = -0.1969;
-                traverse_speed = 400 / 25.4;
-                probe_speed = 60/25.4;
-            } else {
-                clear_height = 12.0;
-                traverse_height = 0.5;
-                probe_depth = -1;
-                initial_probe = -5;
-                traverse_speed = 400;
-                probe_speed = 60;
+    SplitGrid grid = split_grid();
+    MoveRun run;
+    vector<char> keep;
+    size_t out = 0;
 
+    info.ResetPos();
+
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        const GCodeCommand &cmd = cmdList[i];
+        bool mergeable = is_mergeable(cmd, run.moves.empty());
+
+        if (mergeable) {
+            Real u = (cmd.getXCoord() - grid.originX) / grid.gx - 0.5;
+            Real v = (cmd.getYCoord() - grid.originY) / grid.gy - 0.5;
+
+            if (!run.moves.empty()) {
+                Real minU = min(run.minU, u), maxU = max(run.maxU, u);
+                Real minV = min(run.minV, v), maxV = max(run.maxV, v);
+
+                if (ceil(maxU) - floor(minU) > 1 || ceil(maxV) - floor(minV) > 1) {
+                    out = flush_run(run, keep, out);
+                    mergeable = is_mergeable(cmd, true);
+                } else {
+                    run.minU = minU; run.maxU = maxU;
+                    run.minV = minV; run.maxV = maxV;
+                }
             }
-            
-            out << cmd.ToString() << endl;
-            out << "\n"
-                    "(Processed with pcb-probe by Ivan de Jesus Deras 2013 [Lee Essen, 2011] )"
-                    "\n"
-                    "\n"
-                    "#1=" << clear_height << "			(clearance height)\n"
-                    "#2=" << traverse_height << "			(traverse height)\n"
-                    "#3=" << info.MillRouteDepth << "		(route depth)\n"
-                    "#4=" << probe_depth << "			(probe depth)\n"
-                    "#5=" << traverse_speed << "			(traverse speed)\n"
-                    "#6=" << probe_speed << "			(probe speed)\n";
-			
-	    if (info.HasDrillSpots)
-		out << "#7=" << info.DrillSpotDepth << "		(drill spot depth)\n";
-
-	    out << endl << endl;
-            out <<  "M05			(stop motor)\n"
-                    "(MSG,PROBE: Position to within 5mm [~0.2 inches] of surface & resume)\n"
-                    "M60			(pause, wait for resume)\n"
-                    "G49			(clear any tool offsets)\n"
-                    "G92.1			(zero co-ordinate offsets)\n"
-                    "G91			(use relative coordinates)\n"
-                    "G38.2 Z" << initial_probe << " F[#6]	(probe to find worksurface)\n"
-                    "G90			(back to absolute)\n"
-                    "G92 Z0			(zero Z)\n"
-                    "G00 Z[#1]		(safe height)\n"
-                    "(MSG,PROBE: Z-Axis calibrate complete, beginning probe)\n"
-                    "\n"
-                    "(probe routine)\n"
-                    "(params: x y traverse_height probe_depth traverse_speed probe_speed)\n"
-                    "O100 sub\n"
-                    "G00 X[#1] Y[#2] Z[#3] F[#5]\n"
-                    "G38.2 Z[#4] F[#6]\n"
-                    "G00 Z[#3]\n"
-                    "O100 endsub\n"
-                    "\n";
 
-            /*
-             * Now we can create the code for the depth sensing bit... but
-             * we should do it in a fairly optimal way
-             */
+            if (mergeable && run.moves.empty()) {
+                run.x.push_back(info.Pos.x);
+                run.y.push_back(info.Pos.y);
+                run.minU = min((info.Pos.x - grid.originX) / grid.gx - 0.5, u);
+                run.maxU = max((info.Pos.x - grid.originX) / grid.gx - 0.5, u);
+                run.minV = min((info.Pos.y - grid.originY) / grid.gy - 0.5, v);
+                run.maxV = max((info.Pos.y - grid.originY) / grid.gy - 0.5, v);
 
-            unsigned int gx, gy, rgx;
+                if (ceil(run.maxU) - floor(run.minU) > 1 || ceil(run.maxV) - floor(run.minV) > 1)
+                    mergeable = false;
+            }
+        }
+
+        if (mergeable) {
+            run.moves.push_back(i);
+            run.x.push_back(cmd.getXCoord());
+            run.y.push_back(cmd.getYCoord());
+        } else {
+            out = flush_run(run, keep, out);
+            run.x.clear();
+            run.y.clear();
+            cmdList[out++] = cmd;
+        }
 
-            for (gy = 0; gy <= info.GridMaxY; gy++) {
-                for (rgx = 0; rgx <= info.GridMaxX; rgx++) {
-                    if (gy & 1) {
-                        gx = info.GridMaxX - rgx;
-                    } else {
-                        gx = rgx;
-                    }
+        if (is_move(cmd.opcode))
+            moveTo(cmd);
+    }
 
-                    // Find the point in the centre of the grid square...
-                    Real px = info.MillMinX + ((Real) gx * info.Gx) + (info.Gx / 2);
-                    Real py = info.MillMinY + ((Real) gy * info.Gy) + (info.Gy / 2);
+    out = flush_run(run, keep, out);
+    cmdList.truncate(out);
+    info.ResetPos();
+}
 
-                    if (!cellHasVariable(gx, gy))
-                        continue;
+void PCBProbeJob::LoadHeightMap(const char *path)
+{
+    StageTimer timer(stats, STAGE_HEIGHTMAP);
 
-                    int var = cell_variable(gx, gy);
+    if (!heightMap.load(path))
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to read height map: ") + path);
 
-                    out << "(PROBE[" << gx << "," << gy << "] " << px << " " << py << " -> " << var << ")" << endl;
-                    out << "O100 call [" << px << "] [" << py << "] [#2] [#4] [#5] [#6]" << endl;
-                    out << "#" << var << " = #5063" << endl;
-                }
-            }
+    info.UseHeightMap = true;
+}
 
-            /*
-             * Now before we go into the main mill bit we need to give you a chance
-             * to undo the probe connections
-             */
-            out << "\n"
-                    "\n"
-                    "G00 Z[#1]		(safe height)\n"
-                    "(MSG,PROBE: Probe complete, remove connections & resume)\n"
-                    "M60			(pause, wait for resume)\n"
-                    "(MSG,PROBE: Beginning etch)\n"
-                    "\n"
-                    "\n";
+/*
+ * What the moves of a stretch of the file cut: the bounds, the depth of
+ * its last cut and of its last drill spot
+ */
+struct ToolpathExtent {
+    bool cuts;
+    Real minX, minY, maxX, maxY;
+    Real routeDepth;
+    bool hasDrillSpots;
+    bool hasDrillDepth;
+    Real drillDepth;
+};
+
+/*
+ * Follows a move from pos, adding it to the extent if it cuts
+ */
+static void extend(ToolpathExtent &extent, Position &pos, const GCodeCommand &cmd)
+{
+    if (cmd.opcode == GCODE_G82) {
+        move_to(pos, cmd);
+
+        extent.hasDrillSpots = true;
+        if (cmd.hasZCoord()) {
+            extent.hasDrillDepth = true;
+            extent.drillDepth = cmd.getZCoord();
+        }
+        return;
+    }
+
+    ArcGeometry arc;
+    bool bulges = is_arc(cmd.opcode) && arc_geometry(cmd, pos.x, pos.y, arc);
+
+    move_to(pos, cmd);
+    if (!(pos.z < 0))
+        return;
+
+    if (!extent.cuts) {
+        extent.cuts = true;
+        extent.minX = extent.maxX = pos.x;
+        extent.minY = extent.maxY = pos.y;
+    } else {
+        extent.minX = min(extent.minX, pos.x);
+        extent.maxX = max(extent.maxX, pos.x);
+        extent.minY = min(extent.minY, pos.y);
+        extent.maxY = max(extent.maxY, pos.y);
+    }
+    extent.routeDepth = pos.z;
+
+    if (bulges)
+        arc_extent(arc, extent.minX, extent.minY, extent.maxX, extent.maxY);
+}
+
+/*
+ * Adds the extent of the stretch that comes next
+ */
+static void merge_extent(ToolpathExtent &extent, const ToolpathExtent &next)
+{
+    if (next.cuts) {
+        if (!extent.cuts) {
+            extent.minX = next.minX;
+            extent.maxX = next.maxX;
+            extent.minY = next.minY;
+            extent.maxY = next.maxY;
         } else {
-            out << cmd.ToString() << endl;
+            extent.minX = min(extent.minX, next.minX);
+            extent.maxX = max(extent.maxX, next.maxX);
+            extent.minY = min(extent.minY, next.minY);
+            extent.maxY = max(extent.maxY, next.maxY);
         }
+        extent.cuts = true;
+        extent.routeDepth = next.routeDepth;
+    }
+
+    extent.hasDrillSpots = extent.hasDrillSpots || next.hasDrillSpots;
+    if (next.hasDrillDepth) {
+        extent.hasDrillDepth = true;
+        extent.drillDepth = next.drillDepth;
+    }
+}
 
-        it++;
+/*
+ * The lengths are scaled for inches at every G20 as it comes
+ */
+void PCBProbeJob::set_units(int opcode, ToolpathSummary &summary)
+{
+    if (opcode == GCODE_G20) {
+        //Units in inches
+        info.GridSize = info.GridSize / 25.4;
+        info.SplitOver = info.SplitOver / 25.4;
+        info.MergeTolerance = info.MergeTolerance / 25.4;
+        info.UnitType = UNIT_INCHES;
+        summary.InchSwitches++;
+    } else if (opcode == GCODE_G21) {
+        info.UnitType = UNIT_MM;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * The board is where the file cuts, what it doesn't tell keeps its value
+ */
+void PCBProbeJob::use_extent(const ToolpathExtent &extent, ToolpathSummary &summary)
+{
+    if (extent.cuts) {
+        info.MillMinX = extent.minX;
+        info.MillMinY = extent.minY;
+        info.MillMaxX = extent.maxX;
+        info.MillMaxY = extent.maxY;
+        info.MillRouteDepth = extent.routeDepth;
+    }
+    info.HasDrillSpots = extent.hasDrillSpots;
+    if (extent.hasDrillDepth)
+        info.DrillSpotDepth = extent.drillDepth;
+
+    summary.UnitType = info.UnitType;
+    summary.HasDrillSpots = info.HasDrillSpots;
+    summary.MillMinX = info.MillMinX;
+    summary.MillMinY = info.MillMinY;
+    summary.MillMaxX = info.MillMaxX;
+    summary.MillMaxY = info.MillMaxY;
+    summary.MillRouteDepth = info.MillRouteDepth;
+    summary.DrillSpotDepth = info.DrillSpotDepth;
+    summary.LineCount = currentLine;
+}
+
+/*
+ * Reads the commands and finds the extent of the cutting in one pass,
+ * without keeping the commands unless keep is set
+ */
+void PCBProbeJob::parse_input(GCodeReader &in, ToolpathSummary &summary, bool keep)
+{
+    string_view line;
+    GCodeCommand cmd;
+    ExtraTable extras;
+    ToolpathExtent extent = ToolpathExtent();
+
+    currentLine = 0;
+    summary.InchSwitches = 0;
+    info.ResetPos();
+
+    while (in.nextLine(line)) {
+
+        currentLine++;
+        try {
+            ParseGCodeLine(line, cmd, extras);
+        } catch (const ProbeError &e) {
+            throw ProbeError(e.getStatus(), to_string(currentLine) + ": " + e.what());
+        }
+
+        set_units(cmd.opcode, summary);
+        if (is_move(cmd.opcode))
+            extend(extent, info.Pos, cmd);
+
+        if (keep && cmd.opcode != GCODE_NONE)
+            cmdList.push_back(cmd);
+    }
+
+    use_extent(extent, summary);
+}
+
+/*
+ * A newline aligned piece of the file, parsed on a thread of its own
+ */
+struct ParseChunk {
+    string_view text;
+    unsigned long lines;
+    size_t commands;
+    size_t first;           //Index of its first command in cmdList
+    Position start;         //Where the tool is when the chunk begins
+    ToolpathExtent extent;
+
+    MoveTrail trail;
+    unsigned int inchSwitches;  //G20 commands in it
+    int units;              //Opcode of its last G20 or G21, GCODE_NONE if none
+
+    //The first line that doesn't parse, 0 if none
+    unsigned long errorLine;
+    int errorStatus;
+    string error;
+    exception_ptr failure;  //Anything else that went wrong
+};
+
+/*
+ * Runs work(0) .. work(n - 1) at once, one of them on this thread
+ */
+static void run_on_threads(unsigned int n, const function<void(unsigned int)> &work)
+{
+    vector<thread> threads;
+
+    for (unsigned int k = 1; k < n; k++)
+        threads.push_back(thread(work, k));
+    work(0);
+    for (size_t k = 0; k < threads.size(); k++)
+        threads[k].join();
+}
+
+/*
+ * Calls line() on every line of the chunk as GCodeReader::nextLine gives
+ * them, the text after the last newline included
+ */
+template <typename LineFunction>
+static void chunk_lines(const ParseChunk &chunk, LineFunction line)
+{
+    const char *data = chunk.text.data();
+    size_t length = chunk.text.size();
+    size_t pos = 0;
+
+    while (pos <= length) {
+        const char *start = data + pos;
+        const char *nl = static_cast<const char *>(memchr(start, '\n', length - pos));
+        size_t len = (nl != NULL)? (size_t)(nl - start) : length - pos;
+
+        pos += len + 1;
+        line(string_view(start, len));
+    }
+}
+
+static void count_chunk(ParseChunk &chunk)
+{
+    chunk_lines(chunk, [&chunk](string_view line) {
+        chunk.lines++;
+        chunk.commands += HasCommand(line);
+    });
+}
+
+/*
+ * Parses the chunk into its place in out, noting where it leaves the tool
+ */
+static void parse_chunk(ParseChunk &chunk, CommandArena &out)
+{
+    unsigned long line_number = 0;
+    size_t index = chunk.first;
+    GCodeCommand cmd;
+    ExtraTable extras;
+
+    try {
+        chunk_lines(chunk, [&](string_view line) {
+            line_number++;
+            if (chunk.errorLine != 0)
+                return;
+
+            try {
+                ParseGCodeLine(line, cmd, extras);
+            } catch (const ProbeError &e) {
+                chunk.errorLine = line_number;
+                chunk.errorStatus = e.getStatus();
+                chunk.error = e.what();
+                return;
+            }
+            if (cmd.opcode == GCODE_NONE)
+                return;
+
+            out.put(index++, cmd);
+            if (is_move(cmd.opcode)) {
+                chunk.trail.follow(cmd);
+            } else if (cmd.opcode == GCODE_G20 || cmd.opcode == GCODE_G21) {
+                chunk.inchSwitches += (cmd.opcode == GCODE_G20);
+                chunk.units = cmd.opcode;
+            }
+        });
+    } catch (...) {
+        chunk.failure = current_exception();
+    }
+}
+
+/*
+ * The same as parse_input with the file cut in nchunks pieces at line
+ * ends.  The pieces are first counted at once (lines with a command are
+ * told from blank and comment lines without parsing them), so each one
+ * knows where its commands go in cmdList.  Then they are parsed at once,
+ * each noting the last coordinate its moves set on every axis and its
+ * unit changes.  From those a pass over the pieces in order finds where
+ * the tool is as each one begins, then every piece is followed from there
+ * for its extent at once.  The extents are merged in file order.
+ */
+void PCBProbeJob::parse_chunks(GCodeReader &in, unsigned int nchunks, ToolpathSummary &summary)
+{
+    string_view data = in.contents();
+    vector<ParseChunk> chunks(nchunks);
+    size_t begin = 0;
+    unsigned int n = 0;
+
+    while (n < nchunks) {
+        size_t end = data.size();
+        size_t target = max(begin, (size_t)((unsigned long long)data.size() * (n + 1) / nchunks));
+
+        if (n + 1 < nchunks) {
+            const char *nl = static_cast<const char *>(memchr(data.data() + target, '\n', data.size() - target));
+
+            if (nl != NULL)
+                end = nl - data.data();
+        }
+
+        ParseChunk &chunk = chunks[n++];
+
+        chunk.text = data.substr(begin, end - begin);
+        chunk.lines = 0;
+        chunk.commands = 0;
+        chunk.extent = ToolpathExtent();
+        chunk.trail.reset();
+        chunk.inchSwitches = 0;
+        chunk.units = GCODE_NONE;
+        chunk.errorLine = 0;
+        if (end == data.size())
+            break;
+        begin = end + 1;
+    }
+
+    run_on_threads(n, [&chunks](unsigned int k) { count_chunk(chunks[k]); });
+
+    size_t total = 0;
+
+    for (unsigned int k = 0; k < n; k++) {
+        chunks[k].first = total;
+        total += chunks[k].commands;
+    }
+    cmdList.extend(total);
+
+    run_on_threads(n, [this, &chunks](unsigned int k) { parse_chunk(chunks[k], cmdList); });
+
+    //Errors, units and where every piece begins, in file order
+    currentLine = 0;
+    summary.InchSwitches = 0;
+    info.ResetPos();
+    for (unsigned int k = 0; k < n; k++) {
+        ParseChunk &chunk = chunks[k];
+
+        if (chunk.failure || chunk.errorLine != 0) {
+            cmdList.clear();
+            if (chunk.failure)
+                rethrow_exception(chunk.failure);
+            throw ProbeError(chunk.errorStatus, to_string(currentLine + chunk.errorLine) + ": " + chunk.error);
+        }
+        currentLine += chunk.lines;
+
+        chunk.start = info.Pos;
+        chunk.trail.apply(info.Pos);
+
+        for (unsigned int i = 0; i < chunk.inchSwitches; i++)
+            set_units(GCODE_G20, summary);
+        if (chunk.units == GCODE_G21)
+            set_units(GCODE_G21, summary);
+    }
+
+    run_on_threads(n, [this, &chunks](unsigned int k) {
+        ParseChunk &chunk = chunks[k];
+        Position pos = chunk.start;
+
+        for (size_t i = chunk.first; i < chunk.first + chunk.commands; i++) {
+            const GCodeCommand &cmd = cmdList[i];
+
+            if (is_move(cmd.opcode))
+                extend(chunk.extent, pos, cmd);
+        }
+    });
+
+    ToolpathExtent extent = chunks[0].extent;
+
+    for (unsigned int k = 1; k < n; k++)
+        merge_extent(extent, chunks[k].extent);
+
+    stats.ParseChunks = n;
+    use_extent(extent, summary);
+}
+
+/*
+ * Takes what parsing would have found from a cached summary
+ */
+void PCBProbeJob::use_summary(const ToolpathSummary &summary)
+{
+    for (unsigned int k = 0; k < summary.InchSwitches; k++) {
+        info.GridSize = info.GridSize / 25.4;
+        info.SplitOver = info.SplitOver / 25.4;
+        info.MergeTolerance = info.MergeTolerance / 25.4;
+    }
+
+    info.UnitType = summary.UnitType;
+    info.HasDrillSpots = summary.HasDrillSpots;
+    info.MillMinX = summary.MillMinX;
+    info.MillMinY = summary.MillMinY;
+    info.MillMaxX = summary.MillMaxX;
+    info.MillMaxY = summary.MillMaxY;
+    info.MillRouteDepth = summary.MillRouteDepth;
+    info.DrillSpotDepth = summary.DrillSpotDepth;
+    currentLine = summary.LineCount;
+}
+
+void PCBProbeJob::LoadAndSplitSegments(const char *infile_path, const char *cache_path)
+{
+    LoadSegments(infile_path, cache_path);
+    SizeGrid();
+    SplitSegments();
+}
+
+/*
+ * With a cache path, the parsed commands come from the cache if it was
+ * made from this very file, otherwise the file is parsed and the cache
+ * written for the next run
+ */
+void PCBProbeJob::LoadSegments(const char *infile_path, const char *cache_path)
+{
+    GCodeReader in;
+    ToolpathSummary summary;
+    uint64_t hash = 0;
+    StageTimer timer(stats, STAGE_PARSE);
+
+    if (!in.open(infile_path))
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to open file: ") + infile_path);
+
+    cmdList.clear();
+    meshBuilt = false;
+    info.CacheHit = false;
+    info.CacheWritten = false;
+
+    if (cache_path != NULL) {
+        hash = HashContents(in.contents());
+        info.CacheHit = ReadToolpathCache(cache_path, hash, in.size(), summary, cmdList);
+    }
+
+    if (info.CacheHit) {
+        use_summary(summary);
+    } else {
+        unsigned int nchunks = (unsigned int)min((size_t)max(info.Threads, 1u), in.size() / PARSE_CHUNK_BYTES);
+
+        stats.ParseChunks = 1;
+        if (nchunks > 1)
+            parse_chunks(in, nchunks, summary);
+        else
+            parse_input(in, summary);
+        if (cache_path != NULL)
+            info.CacheWritten = WriteToolpathCache(cache_path, hash, in.size(), summary, cmdList);
+    }
+    in.close();
+    stats.LinesParsed = currentLine;
+    stats.CommandsStored = cmdList.size();
+}
+
+/*
+ * Lays the probe grid over the board once its bounds are known
+ */
+void PCBProbeJob::SizeGrid()
+{
+	info.GridMaxX = (unsigned int)ceil((info.MillMaxX - info.MillMinX) / info.GridSize);
+    info.GridMaxY = (unsigned int)ceil((info.MillMaxY - info.MillMinY) / info.GridSize);
+
+	info.MillMinX -= info.GridSize / 2.0;
+	info.MillMinY -= info.GridSize / 2.0 ;
+
+	info.Gx = (info.MillMaxX - info.MillMinX)/(info.GridMaxX + 0.5);
+	info.Gy = (info.MillMaxY - info.MillMinY)/(info.GridMaxY + 0.5);
+}
+
+//Second Pass
+
+/*
+ * This makes sure we have a variable assigned to a given cell,
+ * returns the variable number
+ */
+int PCBProbeJob::ensure_cell_variable(unsigned int gx, unsigned int gy)
+{
+    int &slot = cellVariables.at(gx, gy);
+    MeshEdge edge;
+
+    if (slot != 0)
+        return slot;
+
+    int var = slot = nextVariableNumber++;
+
+    if (info.Adaptive && probeMesh.onEdge(gx, gy, edge)) {
+        DerivedVariable derived;
+
+        derived.var = var;
+        derived.varA = ensure_cell_variable(edge.ax, edge.ay);
+        derived.varB = ensure_cell_variable(edge.bx, edge.by);
+        derived.weightA = edge.weightA;
+        derivedVariables.push_back(derived);
+        cellDerived.at(gx, gy) = 1;
+    }
+
+    return var;
+}
+
+/*
+ * This functions returns true if a cell has a variable associated, false otherwise
+ */
+bool PCBProbeJob::cellHasVariable(unsigned int gx, unsigned int gy) const
+{
+    return cellVariables.get(gx, gy) != 0;
+}
+
+/*
+ * True if the cell's parameter comes from a probe rather than from the
+ * probes around it
+ */
+bool PCBProbeJob::cellIsProbed(unsigned int gx, unsigned int gy) const
+{
+    return cellHasVariable(gx, gy) && !(info.Adaptive && cellDerived.get(gx, gy));
+}
+
+int PCBProbeJob::cell_variable(unsigned int gx, unsigned int gy) const
+{
+    return cellVariables.get(gx, gy);
+}
+
+/*
+ * Given a co-ordinate we can work out a grid x and y number
+ * so we can lookup stuff 
+ */
+
+void PCBProbeJob::grid_ref(Real x, Real y, unsigned int &ref_x, unsigned int &ref_y) const
+{
+
+    Real zero_x = x - info.MillMinX;
+    Real zero_y = y - info.MillMinY;
+
+    ref_x = (unsigned int)floor(zero_x / info.Gx);
+    ref_y = (unsigned int)floor(zero_y / info.Gy);
+}
+
+/*
+ * The four cells around a co-ordinate on the uniform grid and their
+ * weights
+ */
+void PCBProbeJob::uniform_cells(Real x, Real y, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const
+{
+    unsigned int cellx, celly;
+    grid_ref(x, y, cellx, celly);
+
+    Real os_x = ((x - info.MillMinX) - ((Real) cellx * info.Gx)) / info.Gx;
+    Real os_y = ((y - info.MillMinY) - ((Real) celly * info.Gy)) / info.Gy;
+
+    unsigned int px_cell = cellx + (os_x > 0.5 ? 1 : -1);
+    unsigned int py_cell = celly + (os_y > 0.5 ? 1 : -1);
+
+    //Below cell 0 wraps around, so it is past the grid too
+    if (px_cell > info.GridMaxX) {
+        px_cell = cellx;
+    }
+    if (py_cell > info.GridMaxY) {
+        py_cell = celly;
+    }
+
+    Real x_pc = 0.5 + (os_x > 0.5 ? 1 - os_x : os_x);
+    Real y_pc = 0.5 + (os_y > 0.5 ? 1 - os_y : os_y);
+
+    gx[0] = cellx;   gy[0] = celly;
+    gx[1] = px_cell; gy[1] = celly;
+    gx[2] = cellx;   gy[2] = py_cell;
+    gx[3] = px_cell; gy[3] = py_cell;
+
+    weights[0] = x_pc * y_pc;
+    weights[1] = (1 - x_pc) * y_pc;
+    weights[2] = x_pc * (1 - y_pc);
+    weights[3] = (1 - x_pc) * (1 - y_pc);
+}
+
+/*
+ * The same on the adaptive mesh.  Corners that would only get a weight
+ * printed as zero give it to the heaviest one, so they are not probed
+ * for nothing.
+ */
+void PCBProbeJob::mesh_cells(Real x, Real y, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const
+{
+    Real u = (x - info.MillMinX) / info.Gx - 0.5;
+    Real v = (y - info.MillMinY) / info.Gy - 0.5;
+    int heaviest = 0;
+
+    probeMesh.locate(u, v, gx, gy, weights);
+
+    for (int k = 1; k < 4; k++)
+        if (weights[k] > weights[heaviest])
+            heaviest = k;
+
+    for (int k = 0; k < 4; k++) {
+        if (k != heaviest && weights[k] < MESH_MIN_WEIGHT) {
+            weights[heaviest] += weights[k];
+            weights[k] = 0;
+            gx[k] = gx[heaviest];
+            gy[k] = gy[heaviest];
+        }
+    }
+}
+
+/*
+ * The nodes of the bicubic patch around a co-ordinate and their weights,
+ * nodes with a weight printed as zero give it to the heaviest one.
+ * Returns how many are left.
+ */
+int PCBProbeJob::cubic_cells(Real x, Real y, unsigned int gx[CUBIC_TERMS], unsigned int gy[CUBIC_TERMS], Real weights[CUBIC_TERMS]) const
+{
+    unsigned int nx[4], ny[4];
+    Real wx[4], wy[4];
+    int cx = CubicAxis((x - info.MillMinX) / info.Gx - 0.5, info.GridMaxX, nx, wx);
+    int cy = CubicAxis((y - info.MillMinY) / info.Gy - 0.5, info.GridMaxY, ny, wy);
+    int count = 0;
+    int heaviest = 0;
+
+    for (int b = 0; b < cy; b++) {
+        for (int a = 0; a < cx; a++) {
+            gx[count] = nx[a];
+            gy[count] = ny[b];
+            weights[count] = wx[a] * wy[b];
+            if (weights[count] > weights[heaviest])
+                heaviest = count;
+            count++;
+        }
+    }
+
+    int kept = 0;
+
+    for (int k = 0; k < count; k++) {
+        if (k != heaviest && fabs(weights[k]) < CUBIC_MIN_WEIGHT) {
+            weights[heaviest] += weights[k];
+            continue;
+        }
+        if (k == heaviest)
+            heaviest = kept;
+        gx[kept] = gx[k];
+        gy[kept] = gy[k];
+        weights[kept] = weights[k];
+        kept++;
+    }
+
+    return kept;
+}
+
+/*
+ * The bicubic Z of a co-ordinate DoInterpolation compensated, its nodes
+ * have their variables already
+ */
+void PCBProbeJob::cubic_formula(Real x, Real y, int depthParam, CubicFormula &cubic) const
+{
+    unsigned int gx[CUBIC_TERMS], gy[CUBIC_TERMS];
+
+    cubic.count = cubic_cells(x, y, gx, gy, cubic.weights);
+    for (int k = 0; k < cubic.count; k++)
+        cubic.vars[k] = cell_variable(gx[k], gy[k]);
+    cubic.depthParam = depthParam;
+}
+
+/*
+ * Adds up how much cutting there is around every node and builds the
+ * mesh from it
+ */
+void PCBProbeJob::build_mesh()
+{
+    probeMesh.reset(info.GridMaxX, info.GridMaxY);
+    info.ResetPos();
+
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        const GCodeCommand &cmd = cmdList[i];
+        Position from = info.Pos;
+
+        if (!is_move(cmd.opcode))
+            continue;
+
+        moveTo(cmd);
+
+        Real u = (info.Pos.x - info.MillMinX) / info.Gx - 0.5;
+        Real v = (info.Pos.y - info.MillMinY) / info.Gy - 0.5;
+
+        if (cmd.opcode == GCODE_G82 || info.Pos.z < 0)
+            probeMesh.addPoint(u, v);
+
+        if (cmd.opcode != GCODE_G82 && info.Pos.z < 0 && from.z < 0)
+            probeMesh.addCut((from.x - info.MillMinX) / info.Gx - 0.5, (from.y - info.MillMinY) / info.Gy - 0.5, u, v);
+    }
+
+    probeMesh.build(MESH_MAX_SIZE, info.AdaptiveDensity);
+    meshBuilt = true;
+    info.ResetPos();
+}
+
+/*
+ * Given a co-ordinate we need to interpolate the values from
+ * the surrounding cells
+ */
+void PCBProbeJob::interpolate(Real x, Real y, bool isLinearMotionCommand, ZFormula &zformula)
+{
+    unsigned int gx[4], gy[4];
+    Real weights[4];
+
+    stats.Interpolations++;
+    uniform_cells(x, y, gx, gy, weights);
+
+    if (info.Adaptive) {
+        for (int k = 0; k < 4; k++) {
+            unsigned char &used = uniformProbes.at(gx[k], gy[k]);
+
+            //The uniform grid never probes cells outside of it
+            if (!used && gx[k] <= info.GridMaxX && gy[k] <= info.GridMaxY) {
+                used = 1;
+                info.UniformProbeCount++;
+            }
+        }
+        mesh_cells(x, y, gx, gy, weights);
+    }
+
+    make_formula(gx, gy, weights, isLinearMotionCommand, zformula);
+
+    //The output weighs the bicubic patch instead, its nodes are probed too
+    if (info.Surface == SURFACE_BICUBIC) {
+        unsigned int cx[CUBIC_TERMS], cy[CUBIC_TERMS];
+        Real cubic[CUBIC_TERMS];
+        int count = cubic_cells(x, y, cx, cy, cubic);
+
+        for (int k = 0; k < count; k++)
+            ensure_cell_variable(cx[k], cy[k]);
+    }
+}
+
+void PCBProbeJob::make_formula(const unsigned int gx[4], const unsigned int gy[4], const Real weights[4], bool isLinearMotionCommand, ZFormula &zformula)
+{
+    /*
+     * Now we can make sure that each of our cells has a variable in it...
+     */
+    for (int k = 0; k < 4; k++) {
+        zformula.vars[k] = ensure_cell_variable(gx[k], gy[k]);
+        zformula.weights[k] = weights[k];
+    }
+    zformula.depthParam = isLinearMotionCommand? 3 : 7;
+}
+
+/*
+ * Runs the weight kernel on the points gathered so far
+ */
+void PCBProbeJob::run_weight_kernel(WeightBatch &batch, const vector<PendingPoint> &points) const
+{
+    WeightGrid grid;
+
+    grid.MinX = (double)info.MillMinX;
+    grid.MinY = (double)info.MillMinY;
+    grid.Gx = info.Gx;
+    grid.Gy = info.Gy;
+    grid.MaxX = (int)info.GridMaxX;
+    grid.MaxY = (int)info.GridMaxY;
+
+    batch.resize(points.size());
+    for (size_t p = 0; p < points.size(); p++) {
+        batch.X[p] = (double)points[p].x;
+        batch.Y[p] = (double)points[p].y;
+    }
+
+    ComputeWeights(grid, batch, info.WeightKernel);
+}
+
+/*
+ * The cells and weights the kernel found for point p, or those of the long
+ * double path where it couldn't decide
+ */
+void PCBProbeJob::batch_cells(const WeightBatch &batch, size_t p, const PendingPoint &point, unsigned int gx[4], unsigned int gy[4], Real weights[4]) const
+{
+    if (batch.Exact[p]) {
+        gx[0] = gx[2] = batch.CellX[p];
+        gx[1] = gx[3] = batch.NextX[p];
+        gy[0] = gy[1] = batch.CellY[p];
+        gy[2] = gy[3] = batch.NextY[p];
+        for (int k = 0; k < 4; k++)
+            weights[k] = batch.Weights[k][p];
+    } else {
+        uniform_cells(point.x, point.y, gx, gy, weights);
+    }
+}
+
+/*
+ * Gives the commands of the points gathered so far their formulas, in
+ * order so the variables are numbered the same as one point at a time
+ */
+void PCBProbeJob::interpolate_batch(WeightBatch &batch, vector<PendingPoint> &points)
+{
+    run_weight_kernel(batch, points);
+
+    for (size_t p = 0; p < points.size(); p++) {
+        GCodeCommand &cmd = cmdList[points[p].command];
+        unsigned int gx[4], gy[4];
+        Real weights[4];
+        ZFormula zformula;
+
+        batch_cells(batch, p, points[p], gx, gy, weights);
+        stats.Interpolations++;
+        make_formula(gx, gy, weights, cmd.opcode != GCODE_G82, zformula);
+        cmd.setZFormula(zformula);
+    }
+
+    points.clear();
+}
+
+/*
+ * A range of cmdList given its formulas on a thread of its own.  Until
+ * the variables are numbered, its formulas hold numbers from 1 for the
+ * cells in the order the chunk first touches them.
+ */
+struct InterpolationChunk {
+    size_t begin;
+    size_t end;
+    Position start;         //Where the tool is when the chunk begins
+
+    CellGrid<int> local;    //Number of every cell touched
+    vector<pair<unsigned int, unsigned int> > cells;    //Cell of every number
+    vector<int> vars;       //Variable of every number
+    unsigned long interpolations;
+};
+
+/*
+ * Where the moves before index leave the tool, found from the last one
+ * that sets each axis
+ */
+static Position position_before(const CommandArena &commands, size_t index)
+{
+    Position pos = Position();
+    bool hasX = false, hasY = false, hasZ = false;
+
+    while (index-- > 0 && !(hasX && hasY && hasZ)) {
+        const GCodeCommand &cmd = commands[index];
+
+        if (!is_move(cmd.opcode))
+            continue;
+
+        if (!hasX && cmd.hasXCoord()) {
+            pos.x = cmd.getXCoord();
+            hasX = true;
+        }
+        if (!hasY && cmd.hasYCoord()) {
+            pos.y = cmd.getYCoord();
+            hasY = true;
+        }
+        if (!hasZ && cmd.hasZCoord()) {
+            pos.z = cmd.getZCoord();
+            hasZ = true;
+        }
+    }
+
+    return pos;
+}
+
+/*
+ * The formula of a point with the chunk numbers of its cells
+ */
+static void local_formula(InterpolationChunk &chunk, const unsigned int gx[4], const unsigned int gy[4], const Real weights[4], bool isLinearMotionCommand, GCodeCommand &cmd)
+{
+    ZFormula zformula;
+
+    for (int k = 0; k < 4; k++) {
+        int &number = chunk.local.at(gx[k], gy[k]);
+
+        if (number == 0) {
+            chunk.cells.push_back(make_pair(gx[k], gy[k]));
+            number = (int)chunk.cells.size();
+        }
+        zformula.vars[k] = number;
+        zformula.weights[k] = weights[k];
+    }
+    zformula.depthParam = isLinearMotionCommand? 3 : 7;
+
+    chunk.interpolations++;
+    cmd.setZFormula(zformula);
+}
+
+/*
+ * The loop of DoInterpolation over one chunk, from where it starts
+ */
+void PCBProbeJob::interpolate_chunk(InterpolationChunk &chunk)
+{
+    bool batched = info.WeightKernel != WEIGHT_KERNEL_NONE;
+    vector<PendingPoint> points;
+    WeightBatch batch;
+    Position pos = chunk.start;
+    auto flush = [&]() {
+        run_weight_kernel(batch, points);
+        for (size_t p = 0; p < points.size(); p++) {
+            GCodeCommand &cmd = cmdList[points[p].command];
+            unsigned int gx[4], gy[4];
+            Real weights[4];
+
+            batch_cells(batch, p, points[p], gx, gy, weights);
+            local_formula(chunk, gx, gy, weights, cmd.opcode != GCODE_G82, cmd);
+        }
+        points.clear();
+    };
+
+    chunk.local.reset(info.GridMaxX + 1, info.GridMaxY + 1);
+
+    for (size_t i = chunk.begin; i < chunk.end; i++) {
+        GCodeCommand &cmd = cmdList[i];
+
+        if (!is_move(cmd.opcode))
+            continue;
+
+        move_to(pos, cmd);
+        if (cmd.opcode != GCODE_G82 && !(pos.z < 0))
+            continue;
+
+        PendingPoint point;
+
+        point.command = i;
+        point.x = pos.x;
+        point.y = pos.y;
+        if (batched) {
+            points.push_back(point);
+        } else {
+            unsigned int gx[4], gy[4];
+            Real weights[4];
+
+            uniform_cells(point.x, point.y, gx, gy, weights);
+            local_formula(chunk, gx, gy, weights, cmd.opcode != GCODE_G82, cmd);
+        }
+
+        if (points.size() >= WEIGHT_BATCH_SIZE)
+            flush();
+    }
+
+    if (!points.empty())
+        flush();
+}
+
+/*
+ * DoInterpolation on the uniform grid with cmdList cut in nchunks ranges.
+ * Every range finds where it starts by looking back for the last move
+ * setting each axis, a few commands at most, instead of a pass over all
+ * the ranges before it.  Then the ranges are interpolated at once with
+ * their own cell numbers, which are given variables in file order (the
+ * cells each range touched, in the order it did) so they are numbered as
+ * in one pass, and put in the formulas at once.
+ */
+void PCBProbeJob::interpolate_chunks(unsigned int nchunks)
+{
+    vector<InterpolationChunk> chunks(nchunks);
+    size_t size = cmdList.size();
+
+    for (unsigned int k = 0; k < nchunks; k++) {
+        chunks[k].begin = size * k / nchunks;
+        chunks[k].end = size * (k + 1) / nchunks;
+        chunks[k].interpolations = 0;
+    }
+
+    run_on_threads(nchunks, [this, &chunks](unsigned int k) {
+        chunks[k].start = position_before(cmdList, chunks[k].begin);
+        interpolate_chunk(chunks[k]);
+    });
+    info.Pos = position_before(cmdList, size);
+
+    for (unsigned int k = 0; k < nchunks; k++) {
+        InterpolationChunk &chunk = chunks[k];
+
+        chunk.vars.resize(chunk.cells.size());
+        for (size_t c = 0; c < chunk.cells.size(); c++)
+            chunk.vars[c] = ensure_cell_variable(chunk.cells[c].first, chunk.cells[c].second);
+        stats.Interpolations += chunk.interpolations;
+    }
+
+    run_on_threads(nchunks, [this, &chunks](unsigned int k) {
+        InterpolationChunk &chunk = chunks[k];
+
+        for (size_t i = chunk.begin; i < chunk.end; i++) {
+            GCodeCommand &cmd = cmdList[i];
+
+            if (cmd.hasZFormula) {
+                for (int v = 0; v < 4; v++)
+                    cmd.zformula.vars[v] = chunk.vars[cmd.zformula.vars[v] - 1];
+            }
+        }
+    });
+}
+
+/*
+ * With a height map the final Z is known now, no parameters needed
+ */
+void PCBProbeJob::set_height(GCodeCommand &cmd, Real depth)
+{
+    Real z = ((info.Surface == SURFACE_BICUBIC)? heightMap.cubicAt(info.Pos.x, info.Pos.y) :
+                                                 heightMap.at(info.Pos.x, info.Pos.y)) + depth;
+
+    stats.Interpolations++;
+    if (!heightMap.contains(info.Pos.x, info.Pos.y))
+        info.HeightMapOutside++;
+
+    if (cmd.hasZCoord())
+        cmd.setZCoord(z);
+    else
+        cmd.addArgument('Z', z);
+}
+
+/*
+ * Follows the tool through one split command and compensates it if it
+ * cuts, one point at a time
+ */
+void PCBProbeJob::compensate(GCodeCommand &cmd)
+{
+    ZFormula zformula;
+
+    if (cmd.opcode == GCODE_G00 || cmd.opcode == GCODE_G01 || is_arc(cmd.opcode)) {
+        moveTo(cmd);
+
+        if (!(info.Pos.z < 0))
+            return;
+        if (info.UseHeightMap) {
+            set_height(cmd, info.MillRouteDepth);
+        } else {
+            interpolate(info.Pos.x, info.Pos.y, true, zformula);
+            cmd.setZFormula(zformula);
+        }
+    } else if (cmd.opcode == GCODE_G82) {
+        moveTo(cmd);
+
+        if (info.UseHeightMap) {
+            set_height(cmd, info.DrillSpotDepth);
+        } else {
+            interpolate(info.Pos.x, info.Pos.y, false, zformula);
+            cmd.setZFormula(zformula);
+        }
+    }
+}
+
+void PCBProbeJob::ResolveHeights()
+{
+    info.ResetPos();
+    info.HeightMapOutside = 0;
+
+    for (size_t i = 0; i < cmdList.size(); i++)
+        compensate(cmdList[i]);
+}
+
+/*
+ * Last phase ... add the depth sensing bit to the file
+ */
+void PCBProbeJob::DoInterpolation()
+{
+    StageTimer timer(stats, STAGE_INTERPOLATE);
+
+    stats.Interpolations = 0;
+    stats.CellsAllocated = 0;
+
+    if (info.UseHeightMap) {
+        ResolveHeights();
+        return;
+    }
+
+    bool cubic = info.Surface == SURFACE_BICUBIC;
+
+    if (cubic && (info.Adaptive || info.QuadParams))
+        throw ProbeError(PROBE_ERROR_ARGUMENTS, "The bicubic surface can't be combined with --adaptive or --quad-params");
+
+    info.ResetPos();
+    if (!sharedVariables) {
+        cellVariables.reset(info.GridMaxX + 1, info.GridMaxY + 1);
+        nextVariableNumber = 2000;
+    }
+    sharedVariables = false;
+    firstVariable = nextVariableNumber;
+    derivedVariables.clear();
+    info.UniformProbeCount = 0;
+
+    if (info.Adaptive) {
+        cellDerived.reset(info.GridMaxX + 1, info.GridMaxY + 1);
+        uniformProbes.reset(info.GridMaxX + 1, info.GridMaxY + 1);
+        if (!meshBuilt)
+            build_mesh();
+        meshBuilt = false;
+    }
+
+    unsigned int nchunks = (unsigned int)min((size_t)max(info.Threads, 1u), cmdList.size() / INTERPOLATE_CHUNK_COMMANDS);
+
+    if (!info.Adaptive && !cubic && nchunks > 1) {
+        interpolate_chunks(nchunks);
+        stats.CellsAllocated = nextVariableNumber - firstVariable;
+        return;
+    }
+
+    //The adaptive mesh and the bicubic patches are located one point at a time
+    bool batched = !info.Adaptive && !cubic && info.WeightKernel != WEIGHT_KERNEL_NONE;
+    vector<PendingPoint> points;
+    WeightBatch batch;
+
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        GCodeCommand &cmd = cmdList[i];
+        ZFormula zformula;
+        PendingPoint point;
+
+        if (cmd.opcode == GCODE_G00 || cmd.opcode == GCODE_G01 || is_arc(cmd.opcode)) {
+            /*
+             * We have a move command, if our z is below zero then this will
+             * count towards our area
+             */
+            moveTo(cmd);
+
+            if (info.Pos.z < 0) {
+                /*
+                 * First thing we do is allocate a variable number to the grid
+                 * square (if it hasn't already got one)
+                 */
+                if (batched) {
+                    point.command = i;
+                    point.x = info.Pos.x;
+                    point.y = info.Pos.y;
+                    points.push_back(point);
+                } else {
+                    interpolate(info.Pos.x, info.Pos.y, true, zformula);
+                    cmd.setZFormula(zformula);
+                }
+            }
+
+		} else if (cmd.opcode == GCODE_G82) {
+			moveTo(cmd);
+
+			if (batched) {
+				point.command = i;
+				point.x = info.Pos.x;
+				point.y = info.Pos.y;
+				points.push_back(point);
+			} else {
+				interpolate(info.Pos.x, info.Pos.y, false, zformula);
+				cmd.setZFormula(zformula);
+			}
+		}
+
+        if (points.size() >= WEIGHT_BATCH_SIZE)
+            interpolate_batch(batch, points);
+    }
+
+    if (!points.empty())
+        interpolate_batch(batch, points);
+
+    stats.CellsAllocated = nextVariableNumber - firstVariable;
+
+}
+
+/*
+ * Takes the parameters other gave the cells, the next DoInterpolation
+ * goes on numbering after them.  For a file cut on the same board after
+ * the one of other, on the same grid.
+ */
+void PCBProbeJob::ShareVariables(const PCBProbeJob &other)
+{
+    cellVariables = other.cellVariables;
+    nextVariableNumber = other.nextVariableNumber;
+    sharedVariables = true;
+}
+
+static int quad_params(const QuadBlock &block)
+{
+    bool hasU = block.x1 != block.x0;
+    bool hasV = block.y1 != block.y0;
+
+    return 1 + hasU + hasV + (hasU && hasV);
+}
+
+/*
+ * Gives the quads the cutting lines are in their coefficient parameters,
+ * from QUAD_FIRST_PARAM to QUAD_LAST_PARAM and then after the probes.
+ * There is only room for a few hundred, so they go to the quads with the
+ * most lines for the parameters they take, and are numbered in the order
+ * the cut first reaches those quads.
+ */
+void PCBProbeJob::assign_quads()
+{
+    vector<QuadBlock> found;
+    vector<unsigned long> lines;
+
+    quadBlocks.clear();
+    quadIndex.clear();
+    variableCells.assign(nextVariableNumber - 2000, make_pair(0u, 0u));
+
+    for (unsigned int gy = 0; gy <= info.GridMaxY; gy++)
+        for (unsigned int gx = 0; gx <= info.GridMaxX; gx++)
+            if (cellHasVariable(gx, gy))
+                variableCells[cell_variable(gx, gy) - 2000] = make_pair(gx, gy);
+
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        QuadFormula quad;
+        QuadKey key;
+
+        if (!cmdList[i].hasZFormula || !quad_key(cmdList[i].zformula, quad, key))
+            continue;
+
+        map<QuadKey, size_t>::const_iterator it = quadIndex.find(key);
+
+        if (it != quadIndex.end()) {
+            lines[it->second]++;
+            continue;
+        }
+
+        QuadBlock block;
+
+        block.x0 = get<0>(key);
+        block.y0 = get<1>(key);
+        block.x1 = get<2>(key);
+        block.y1 = get<3>(key);
+        block.depthParam = get<4>(key);
+        block.param = 0;
+
+        quadIndex[key] = found.size();
+        found.push_back(block);
+        lines.push_back(1);
+    }
+
+    //chosen is 1 for a quad below the probes, 2 for one after them
+    vector<size_t> order(found.size());
+    vector<char> chosen(found.size(), 0);
+    int room[3] = { 0, QUAD_LAST_PARAM - QUAD_FIRST_PARAM + 1, max(LAST_KEPT_PARAM + 1 - nextVariableNumber, 0) };
+
+    for (size_t q = 0; q < order.size(); q++)
+        order[q] = q;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return lines[a] * quad_params(found[b]) > lines[b] * quad_params(found[a]);
+    });
+    for (size_t k = 0; k < order.size(); k++) {
+        int count = quad_params(found[order[k]]);
+
+        for (int r = 1; r <= 2 && chosen[order[k]] == 0; r++) {
+            if (count <= room[r]) {
+                chosen[order[k]] = r;
+                room[r] -= count;
+            }
+        }
+    }
+
+    vector<size_t> index(found.size());
+    int param[3] = { 0, QUAD_FIRST_PARAM, nextVariableNumber };
+
+    for (int r = 1; r <= 2; r++) {
+        for (size_t q = 0; q < found.size(); q++) {
+            if (chosen[q] != r)
+                continue;
+
+            index[q] = quadBlocks.size();
+            found[q].param = param[r];
+            param[r] += quad_params(found[q]);
+            quadBlocks.push_back(found[q]);
+        }
+    }
+
+    for (map<QuadKey, size_t>::iterator it = quadIndex.begin(); it != quadIndex.end(); ) {
+        if (chosen[it->second]) {
+            it->second = index[it->second];
+            ++it;
+        } else {
+            it = quadIndex.erase(it);
+        }
+    }
+
+    info.QuadCount = quadBlocks.size();
+}
+
+/*
+ * The quad of a formula blending four corners, and the position in it.
+ * Returns false if the formula is not the bilinear blend of a quad (a
+ * mesh corner given to its neighbour).
+ */
+bool PCBProbeJob::quad_key(const ZFormula &zformula, QuadFormula &quad, QuadKey &key) const
+{
+    unsigned int gx[4], gy[4];
+
+    for (int k = 0; k < 4; k++) {
+        gx[k] = variableCells[zformula.vars[k] - 2000].first;
+        gy[k] = variableCells[zformula.vars[k] - 2000].second;
+    }
+
+    unsigned int x0 = *min_element(gx, gx + 4), x1 = *max_element(gx, gx + 4);
+    unsigned int y0 = *min_element(gy, gy + 4), y1 = *max_element(gy, gy + 4);
+
+    quad.hasU = x1 != x0;
+    quad.hasV = y1 != y0;
+    quad.u = 0;
+    quad.v = 0;
+    for (int k = 0; k < 4; k++) {
+        if (quad.hasU && gx[k] == x1)
+            quad.u += zformula.weights[k];
+        if (quad.hasV && gy[k] == y1)
+            quad.v += zformula.weights[k];
+    }
+
+    for (unsigned int cy = y0; ; cy = y1) {
+        for (unsigned int cx = x0; ; cx = x1) {
+            Real weight = 0;
+            Real bilinear = (quad.hasU? (cx == x1? quad.u : 1 - quad.u) : 1) *
+                            (quad.hasV? (cy == y1? quad.v : 1 - quad.v) : 1);
+
+            for (int k = 0; k < 4; k++)
+                if (gx[k] == cx && gy[k] == cy)
+                    weight += zformula.weights[k];
+
+            if (fabs(weight - bilinear) > 1e-9 || !cellHasVariable(cx, cy))
+                return false;
+            if (cx == x1)
+                break;
+        }
+        if (cy == y1)
+            break;
+    }
+
+    key = QuadKey(x0, y0, x1, y1, zformula.depthParam);
+    return true;
+}
+
+/*
+ * The same Z from the coefficients of its quad.  Returns false if it is
+ * not in a quad or its quad got no parameters, the line keeps its four
+ * weights then.
+ */
+bool PCBProbeJob::quad_formula(const ZFormula &zformula, QuadFormula &quad) const
+{
+    QuadKey key;
+
+    if (!quad_key(zformula, quad, key))
+        return false;
+
+    map<QuadKey, size_t>::const_iterator it = quadIndex.find(key);
+
+    if (it == quadIndex.end())
+        return false;
+
+    quad.param = quadBlocks[it->second].param;
+    return true;
+}
+
+void PCBProbeJob::put_quad_block(GCodeWriter &out, const QuadBlock &block) const
+{
+    int v00 = cell_variable(block.x0, block.y0);
+    int param = block.param;
+
+    out << "#" << param << " = [#" << v00 << " + #" << block.depthParam << "]\n";
+
+    if (block.x1 != block.x0)
+        out << "#" << ++param << " = [#" << cell_variable(block.x1, block.y0) << " - #" << v00 << "]\n";
+    if (block.y1 != block.y0)
+        out << "#" << ++param << " = [#" << cell_variable(block.x0, block.y1) << " - #" << v00 << "]\n";
+    if (block.x1 != block.x0 && block.y1 != block.y0) {
+        out << "#" << ++param << " = [#" << cell_variable(block.x1, block.y1)
+            << " - #" << cell_variable(block.x1, block.y0)
+            << " - #" << cell_variable(block.x0, block.y1) << " + #" << v00 << "]\n";
+    }
+}
+
+/*
+ * Finds the surface from initial_probe down, then probes every cell
+ * that has a parameter
+ */
+void PCBProbeJob::put_probes(GCodeWriter &out, Real initial_probe)
+{
+    out <<  "M05			(stop motor)\n"
+            "(MSG,PROBE: Position to within 5mm [~0.2 inches] of surface & resume)\n"
+            "M60			(pause, wait for resume)\n"
+            "G49			(clear any tool offsets)\n"
+            "G92.1			(zero co-ordinate offsets)\n"
+            "G91			(use relative coordinates)\n"
+            "G38.2 Z" << initial_probe << " F[#6]	(probe to find worksurface)\n"
+            "G90			(back to absolute)\n"
+            "G92 Z0			(zero Z)\n"
+            "G00 Z[#1]		(safe height)\n"
+            "(MSG,PROBE: Z-Axis calibrate complete, beginning probe)\n"
+            "\n"
+            "(probe routine)\n"
+            "(params: x y traverse_height probe_depth traverse_speed probe_speed)\n"
+            "O100 sub\n"
+            "G00 X[#1] Y[#2] Z[#3] F[#5]\n"
+            "G38.2 Z[#4] F[#6]\n"
+            "G00 Z[#3]\n"
+            "O100 endsub\n"
+            "\n";
+
+    /*
+     * Now we can create the code for the depth sensing bit... but
+     * we should do it in a fairly optimal way
+     */
+
+    vector<ProbePoint> probes;
+    unsigned int gx, gy, rgx;
+
+    for (gy = 0; gy <= info.GridMaxY; gy++) {
+        for (rgx = 0; rgx <= info.GridMaxX; rgx++) {
+            if (gy & 1) {
+                gx = info.GridMaxX - rgx;
+            } else {
+                gx = rgx;
+            }
+
+            if (!cellIsProbed(gx, gy))
+                continue;
+
+            // Find the point in the centre of the grid square...
+            ProbePoint probe;
+
+            probe.x = info.MillMinX + ((Real) gx * info.Gx) + (info.Gx / 2);
+            probe.y = info.MillMinY + ((Real) gy * info.Gy) + (info.Gy / 2);
+            probe.gx = gx;
+            probe.gy = gy;
+            probe.var = cell_variable(gx, gy);
+            probes.push_back(probe);
+        }
+    }
+
+    info.ProbeTravelSerpentine = TourLength(probes);
+    if (info.ProbeOrder == PROBE_ORDER_OPTIMIZED)
+        OrderProbes(probes, PROBE_ORDER_WORK_LIMIT);
+    info.ProbeTravel = TourLength(probes);
+
+    for (size_t p = 0; p < probes.size(); p++) {
+        const ProbePoint &probe = probes[p];
+
+        out << "(PROBE[" << probe.gx << "," << probe.gy << "] " << probe.x << " " << probe.y << " -> " << probe.var << ")\n";
+        out << "O100 call [" << probe.x << "] [" << probe.y << "] [#2] [#4] [#5] [#6]\n";
+        out << "#" << probe.var << " = #5063\n";
+        info.ProbeCount++;
+    }
+
+    if (!derivedVariables.empty()) {
+        out << "\n(heights blended from the coarser probes around them)\n";
+
+        for (size_t d = 0; d < derivedVariables.size(); d++) {
+            const DerivedVariable &derived = derivedVariables[d];
+
+            out << "#" << derived.var << " = [";
+            out.putFixed(derived.weightA, 4);
+            out << "*#" << derived.varA << " + ";
+            out.putFixed(1 - derived.weightA, 4);
+            out << "*#" << derived.varB << "]\n";
+        }
+    }
+}
+
+/*
+ * What goes right after every G20 or G21: the parameters, the probe
+ * routine and the probes, or a note when the heights come from a map
+ */
+void PCBProbeJob::put_header(GCodeWriter &out, const GCodeCommand &cmd, bool useQuads, unsigned long long &quadBytes)
+{
+    if (info.UseHeightMap) {
+        out.putCommand(cmd);
+        out << "\n"
+                "(Processed with pcb-probe by Ivan de Jesus Deras 2013 [Lee Essen, 2011] )\n"
+                "(Z compensated from a measured height map, no probing)\n"
+                "\n";
+        return;
+    }
+
+    Real clear_height;
+    Real traverse_height; //Traverse height
+    Real probe_depth;     //Probe max depth, stop at this position if not triggered
+    Real initial_probe;   // Initial probe Z position to find worksurface
+    Real traverse_speed; // Traver Speed
+    Real probe_speed; //Probe Speed
+        
+    if (info.UnitType == UNIT_INCHES) {
+        clear_height = 0.47244;
+        traverse_height = 0.01969;
+        probe_depth = -0.03937;
+        initial_probe = -0.1969;
+        traverse_speed = 400 / 25.4;
+        probe_speed = 60/25.4;
+    } else {
+        clear_height = 12.0;
+        traverse_height = 0.5;
+        probe_depth = -1;
+        initial_probe = -5;
+        traverse_speed = 400;
+        probe_speed = 60;
+
+    }
+    
+    out.putCommand(cmd);
+    out << "\n"
+            "(Processed with pcb-probe by Ivan de Jesus Deras 2013 [Lee Essen, 2011] )"
+            "\n"
+            "\n"
+            "#1=" << clear_height << "			(clearance height)\n"
+            "#2=" << traverse_height << "			(traverse height)\n"
+            "#3=" << info.MillRouteDepth << "		(route depth)\n"
+            "#4=" << probe_depth << "			(probe depth)\n"
+            "#5=" << traverse_speed << "			(traverse speed)\n"
+            "#6=" << probe_speed << "			(probe speed)\n";
+
+    if (info.HasDrillSpots)
+        out << "#7=" << info.DrillSpotDepth << "		(drill spot depth)\n";
+
+    out << "\n\n";
+    if (info.ProbedBefore) {
+        out << "(no probing, the heights are in #2000 to #" << nextVariableNumber - 1
+            << " from the first program of the session)\n"
+               "(MSG,PROBE: Using the heights probed before, the board and Z zero must not have moved)\n";
+    } else {
+        put_probes(out, initial_probe);
+    }
+
+    if (!quadBlocks.empty() && useQuads) {
+        unsigned long long start = out.size();
+
+        out << "\n(coefficients of the quads most lines are in)\n";
+        for (size_t q = 0; q < quadBlocks.size(); q++)
+            put_quad_block(out, quadBlocks[q]);
+        quadBytes += out.size() - start;
+    }
+
+    if (info.ProbedBefore) {
+        out << "\n"
+                "\n"
+                "G00 Z[#1]		(safe height)\n"
+                "(MSG,PROBE: Beginning etch)\n"
+                "\n"
+                "\n";
+        return;
+    }
+
+    /*
+     * Now before we go into the main mill bit we need to give you a chance
+     * to undo the probe connections
+     */
+    out << "\n"
+            "\n"
+            "G00 Z[#1]		(safe height)\n"
+            "(MSG,PROBE: Probe complete, remove connections & resume)\n"
+            "M60			(pause, wait for resume)\n"
+            "(MSG,PROBE: Beginning etch)\n"
+            "\n"
+            "\n";
+}
+
+void PCBProbeJob::GenerateGCodeWithProbing(const char *outfile_path)
+{
+    GCodeWriter out;
+    GCodeWriter blend;      //Counts the lines in quad form as four weights
+    unsigned long long quadBytes = 0;
+    StageTimer timer(stats, STAGE_OUTPUT);
+
+    if (!out.open(outfile_path))
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to open file: ") + outfile_path);
+
+    info.ProbeCount = 0;
+    info.ProbeTravelSerpentine = 0;
+    info.ProbeTravel = 0;
+    info.QuadCount = 0;
+    info.QuadLines = 0;
+
+    bool useQuads = info.QuadParams && !info.UseHeightMap;
+    bool useCubic = info.Surface == SURFACE_BICUBIC && !info.UseHeightMap;
+
+    if (useQuads) {
+        assign_quads();
+        blend.open(NULL);
+    }
+
+    //The bicubic formulas are worked out here from where the tool is
+    info.ResetPos();
+
+    for (size_t i = 0; i < cmdList.size(); i++) {
+        const GCodeCommand &cmd = cmdList[i];
+        QuadFormula quad;
+        CubicFormula cubic;
+
+        if (useCubic && is_move(cmd.opcode))
+            moveTo(cmd);
+
+        /*
+         * We'll put our stuff right after the G21
+         */
+        if (cmd.opcode == GCODE_G21 || cmd.opcode == GCODE_G20) {
+            put_header(out, cmd, useQuads, quadBytes);
+        } else if (useCubic && cmd.hasZFormula) {
+            cubic_formula(info.Pos.x, info.Pos.y, cmd.zformula.depthParam, cubic);
+            out.putCommand(cmd, NULL, &cubic);
+        } else if (useQuads && cmd.hasZFormula && quad_formula(cmd.zformula, quad)) {
+            unsigned long long start = out.size();
+
+            out.putCommand(cmd, &quad);
+            quadBytes += out.size() - start;
+            blend.putCommand(cmd);
+            info.QuadLines++;
+        } else {
+            out.putCommand(cmd);
+        }
+    }
+
+    stats.OutputBytes = out.size();
+    info.BlendBytes = out.size() - quadBytes + blend.size();
+    if (!out.close())
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to write file: ") + outfile_path);
+}
+
+/*
+ * Reads the next command of a file that was parsed once already
+ */
+static bool next_command(GCodeReader &in, GCodeCommand &cmd, ExtraTable &extras)
+{
+    string_view line;
+
+    while (in.nextLine(line)) {
+        ParseGCodeLine(line, cmd, extras);
+        if (cmd.opcode != GCODE_NONE)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Splits one command of the file as SplitSegments would and compensates
+ * the pieces, following the tool through them
+ */
+void PCBProbeJob::stream_command(const GCodeCommand &cmd, const SplitGrid &grid, vector<Real> &cuts, CommandArena &pieces)
+{
+    ArcGeometry arc;
+
+    //The pieces start where the command does, and end where it does
+    pieces.truncate(0);
+    if ((cmd.opcode == GCODE_G00 || cmd.opcode == GCODE_G01) &&
+            info.Pos.z < 0 && cmd.hasXCoord() && cmd.hasYCoord()) {
+        split_segment(cmd, grid, cuts, pieces);
+    } else if (is_arc(cmd.opcode) && info.Pos.z < 0 && arc_geometry(cmd, info.Pos.x, info.Pos.y, arc)) {
+        split_arc(cmd, arc, grid, cuts, pieces);
+    } else {
+        pieces.push_back(cmd);
+    }
+
+    for (size_t i = 0; i < pieces.size(); i++)
+        compensate(pieces[i]);
+}
+
+/*
+ * Writes a compensated piece, with the probing after a G20 or G21
+ */
+void PCBProbeJob::write_piece(GCodeWriter &out, const GCodeCommand &piece)
+{
+    unsigned long long quadBytes = 0;
+
+    if (piece.opcode == GCODE_G21 || piece.opcode == GCODE_G20)
+        put_header(out, piece, false, quadBytes);
+    else
+        out.putCommand(piece);
+}
+
+/*
+ * Commands passed from one thread of a pipelined pass to the next, with
+ * what they have past their fixed sizes
+ */
+struct CommandBatch {
+    CommandArena commands;
+};
+
+/*
+ * Two threads joined by a ring of full batches and a ring taking the
+ * empty ones back.  There are only PIPELINE_BATCHES batches, so the
+ * producer waits once they are all full and memory stays bounded.
+ */
+struct BatchLink {
+    BatchLink() : full(PIPELINE_BATCHES), empty(PIPELINE_BATCHES), batches(PIPELINE_BATCHES)
+    {
+        for (size_t k = 0; k < batches.size(); k++) {
+            batches[k].commands.reserve(PIPELINE_BATCH_COMMANDS);
+            empty.push(&batches[k]);
+        }
+    }
+
+    void abort()
+    {
+        full.abort();
+        empty.abort();
+    }
+
+    void addStats(QueueStats &stats) const
+    {
+        RingStats sent = full.stats();
+        RingStats returned = empty.stats();
+
+        stats.Batches += sent.Pushes;
+        stats.OccupancySum += sent.OccupancySum;
+        stats.MaxOccupancy = max(stats.MaxOccupancy, sent.MaxOccupancy);
+        stats.Capacity = batches.size();
+        stats.ProducerStalls += returned.PopWaits + sent.PushWaits;
+        stats.ProducerStallSeconds += returned.PopWaitSeconds + sent.PushWaitSeconds;
+        stats.ConsumerStalls += sent.PopWaits;
+        stats.ConsumerStallSeconds += sent.PopWaitSeconds;
+    }
+
+    SpscRing<CommandBatch *> full;
+    SpscRing<CommandBatch *> empty;
+    vector<CommandBatch> batches;
+};
+
+/*
+ * The first thread of a pipelined pass, parses the file into batches
+ */
+static void read_stage(GCodeReader &in, BatchLink &link, unsigned long &lines, exception_ptr &failure)
+{
+    try {
+        string_view line;
+        GCodeCommand cmd;
+        ExtraTable extras;
+        CommandBatch *batch;
+        unsigned long line_number = 0;
+
+        if (!link.empty.pop(batch))
+            return;
+        batch->commands.truncate(0);
+
+        while (in.nextLine(line)) {
+            line_number++;
+            try {
+                ParseGCodeLine(line, cmd, extras);
+            } catch (const ProbeError &e) {
+                throw ProbeError(e.getStatus(), to_string(line_number) + ": " + e.what());
+            }
+
+            if (cmd.opcode == GCODE_NONE)
+                continue;
+            batch->commands.push_back(cmd);
+            if (batch->commands.size() < PIPELINE_BATCH_COMMANDS)
+                continue;
+            if (!link.full.push(batch) || !link.empty.pop(batch))
+                return;
+            batch->commands.truncate(0);
+        }
+
+        lines = line_number;
+        if (!batch->commands.empty() && !link.full.push(batch))
+            return;
+        link.full.close();
+    } catch (...) {
+        failure = current_exception();
+        link.abort();
+    }
+}
+
+/*
+ * The last thread of a pipelined pass, formats and writes the pieces
+ */
+void PCBProbeJob::write_stage(BatchLink &link, GCodeWriter &out, exception_ptr &failure)
+{
+    try {
+        CommandBatch *batch;
+
+        while (link.full.pop(batch)) {
+            for (size_t i = 0; i < batch->commands.size(); i++)
+                write_piece(out, batch->commands[i]);
+            if (!link.empty.push(batch))
+                return;
+        }
+    } catch (...) {
+        failure = current_exception();
+        link.abort();
+    }
+}
+
+/*
+ * The middle of a pipelined pass: every parsed command goes through
+ * process, and with a link after it the pieces process leaves are
+ * passed on.  Returns once the file is done or a link was aborted.
+ */
+static void process_stage(BatchLink &parsed, BatchLink *compensated, const function<void(const GCodeCommand &, CommandArena &)> &process)
+{
+    CommandArena pieces;
+    CommandBatch *batch, *next = NULL;
+
+    if (compensated != NULL) {
+        if (!compensated->empty.pop(next))
+            return;
+        next->commands.truncate(0);
+    }
+
+    while (parsed.full.pop(batch)) {
+        for (size_t i = 0; i < batch->commands.size(); i++) {
+            process(batch->commands[i], pieces);
+            if (next == NULL)
+                continue;
+
+            if (next->commands.size() + pieces.size() > PIPELINE_BATCH_COMMANDS && !next->commands.empty()) {
+                if (!compensated->full.push(next) || !compensated->empty.pop(next))
+                    return;
+                next->commands.truncate(0);
+            }
+            for (size_t k = 0; k < pieces.size(); k++)
+                next->commands.push_back(pieces[k]);
+        }
+        if (!parsed.empty.push(batch))
+            return;
+    }
+
+    if (next != NULL && !next->commands.empty() && !compensated->full.push(next))
+        return;
+    if (compensated != NULL)
+        compensated->full.close();
+}
+
+/*
+ * A pass over the file on threads of its own: one parses it, this one
+ * gives every command to process and, with out, one more formats and
+ * writes the pieces process leaves.  Each thread waits when the next one
+ * is behind, so the pass takes about as long as its slowest thread and
+ * holds no more than PIPELINE_BATCHES batches between two of them.  The
+ * file is parsed again from the start, returns how many lines it has.
+ */
+unsigned long PCBProbeJob::run_pipeline(GCodeReader &in, GCodeWriter *out, const function<void(const GCodeCommand &, CommandArena &)> &process)
+{
+    BatchLink parsed, compensated;
+    exception_ptr readFailure, writeFailure, failure;
+    unsigned long lines = 0;
+
+    in.rewind();
+    thread reader(read_stage, ref(in), ref(parsed), ref(lines), ref(readFailure));
+    thread writer;
+
+    if (out != NULL)
+        writer = thread(&PCBProbeJob::write_stage, this, ref(compensated), ref(*out), ref(writeFailure));
+
+    try {
+        process_stage(parsed, (out != NULL)? &compensated : NULL, process);
+    } catch (...) {
+        failure = current_exception();
+        compensated.abort();
+    }
+    parsed.abort();
+
+    reader.join();
+    if (writer.joinable())
+        writer.join();
+
+    stats.Pipelined = true;
+    parsed.addStats(stats.Queues[QUEUE_READ]);
+    if (out != NULL)
+        compensated.addStats(stats.Queues[QUEUE_WRITE]);
+
+    if (readFailure)
+        rethrow_exception(readFailure);
+    if (failure)
+        rethrow_exception(failure);
+    if (writeFailure)
+        rethrow_exception(writeFailure);
+
+    return lines;
+}
+
+/*
+ * parse_input without keeping the commands, the parsing on a thread of
+ * its own
+ */
+void PCBProbeJob::scan_pipelined(GCodeReader &in, ToolpathSummary &summary)
+{
+    ToolpathExtent extent = ToolpathExtent();
+
+    summary.InchSwitches = 0;
+    info.ResetPos();
+
+    currentLine = run_pipeline(in, NULL, [&](const GCodeCommand &cmd, CommandArena &) {
+        set_units(cmd.opcode, summary);
+        if (is_move(cmd.opcode))
+            extend(extent, info.Pos, cmd);
+    });
+
+    use_extent(extent, summary);
+}
+
+/*
+ * Reads the file again from the start, splitting and compensating every
+ * command as it comes.  Only the pieces of one command are kept at a
+ * time.  Without out the pass just gives the cells their variables.
+ */
+void PCBProbeJob::stream_pass(GCodeReader &in, GCodeWriter *out)
+{
+    CommandArena pieces;
+    vector<Real> cuts;
+    SplitGrid grid = split_grid();
+    GCodeCommand cmd;
+    ExtraTable extras;
+
+    info.ResetPos();
+    stats.MovesSplit = stats.PiecesAdded = stats.MostPieces = 0;
+    stats.Interpolations = 0;
+
+    if (info.Pipeline) {
+        run_pipeline(in, out, [&](const GCodeCommand &cmd, CommandArena &pieces) {
+            stream_command(cmd, grid, cuts, pieces);
+        });
+        return;
+    }
+
+    in.rewind();
+    while (next_command(in, cmd, extras)) {
+        stream_command(cmd, grid, cuts, pieces);
+        if (out == NULL)
+            continue;
+
+        for (size_t i = 0; i < pieces.size(); i++)
+            write_piece(*out, pieces[i]);
+    }
+}
+
+/*
+ * The whole job in passes over the file instead of holding it: one for
+ * the bounds and units, one giving the cells their variables in the order
+ * the cut reaches them (skipped with a height map), and one writing the
+ * output with the probes ahead of it.  The output is the same as from the
+ * stages run one by one, memory only grows with the grid.  With
+ * info.Pipeline every pass is a pipeline of threads.
+ */
+void PCBProbeJob::StreamGCode(const char *infile_path, const char *outfile_path)
+{
+    GCodeReader in;
+    GCodeWriter out;
+    ToolpathSummary summary;
+
+    if (info.Adaptive || info.QuadParams || info.MergeTolerance > 0)
+        throw ProbeError(PROBE_ERROR_ARGUMENTS, "Streaming can't be combined with --adaptive, --quad-params or --merge-tolerance");
+    if (info.Surface == SURFACE_BICUBIC && !info.UseHeightMap)
+        throw ProbeError(PROBE_ERROR_ARGUMENTS, "Streaming only takes the bicubic surface with a height map");
+
+    if (!in.open(infile_path))
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to open file: ") + infile_path);
+    in.setRelease(true);
+
+    StageTimer timer(stats, STAGE_PARSE);
+
+    cmdList.clear();
+    meshBuilt = false;
+    info.CacheHit = false;
+    info.CacheWritten = false;
+    stats.ParseChunks = 1;
+    stats.Pipelined = false;
+    for (int q = 0; q < QUEUE_COUNT; q++)
+        stats.Queues[q] = QueueStats();
+    if (info.Pipeline)
+        scan_pipelined(in, summary);
+    else
+        parse_input(in, summary, false);
+    stats.LinesParsed = currentLine;
+    stats.CommandsStored = 0;
+    SizeGrid();
+    timer.stop();
+
+    stats.Interpolations = 0;
+    stats.CellsAllocated = 0;
+    if (!info.UseHeightMap) {
+        StageTimer numbering(stats, STAGE_INTERPOLATE);
+
+        cellVariables.reset(info.GridMaxX + 1, info.GridMaxY + 1);
+        nextVariableNumber = 2000;
+        derivedVariables.clear();
+        info.UniformProbeCount = 0;
+        stream_pass(in, NULL);
+        stats.CellsAllocated = nextVariableNumber - 2000;
+    }
+
+    StageTimer output(stats, STAGE_OUTPUT);
+
+    if (!out.open(outfile_path))
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to open file: ") + outfile_path);
+
+    info.ProbeCount = 0;
+    info.ProbeTravelSerpentine = 0;
+    info.ProbeTravel = 0;
+    info.QuadCount = 0;
+    info.QuadLines = 0;
+    info.HeightMapOutside = 0;
+    stream_pass(in, &out);
+    in.close();
+
+    stats.OutputBytes = out.size();
+    info.BlendBytes = out.size();
+    if (!out.close())
+        throw ProbeError(PROBE_ERROR_FILE, string("Unable to write file: ") + outfile_path);
+}
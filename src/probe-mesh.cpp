@@ -0,0 +1,168 @@
+#include <cmath>
+#include <algorithm>
+#include "probe-mesh.h"
+
+using namespace std;
+
+void ProbeMesh::reset(unsigned int maxX, unsigned int maxY)
+{
+    this->maxX = maxX;
+    this->maxY = maxY;
+    cellsX = max(maxX, 1u);
+    cellsY = max(maxY, 1u);
+    cellWeight.reset(cellsX, cellsY);
+    leafOf.reset(cellsX, cellsY);
+    weightSum.clear();
+    leaves.clear();
+}
+
+unsigned int ProbeMesh::cellOf(Real u, unsigned int count) const
+{
+    if (!(u > 0))
+        return 0;
+
+    Real c = floor(u);
+
+    return (c >= count)? count - 1 : (unsigned int)c;
+}
+
+/*
+ * Cuts have been split on the cell edges already, so a cut counts in the
+ * cell of its middle
+ */
+void ProbeMesh::addCut(Real u0, Real v0, Real u1, Real v1)
+{
+    Real length = sqrt((u1 - u0) * (u1 - u0) + (v1 - v0) * (v1 - v0));
+
+    cellWeight.at(cellOf((u0 + u1) / 2, cellsX), cellOf((v0 + v1) / 2, cellsY)) += length;
+}
+
+void ProbeMesh::addPoint(Real u, Real v)
+{
+    cellWeight.at(cellOf(u, cellsX), cellOf(v, cellsY)) += MESH_POINT_WEIGHT;
+}
+
+Real ProbeMesh::weightIn(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) const
+{
+    size_t stride = cellsX + 1;
+
+    return weightSum[y1 * stride + x1] - weightSum[y0 * stride + x1]
+            - weightSum[y1 * stride + x0] + weightSum[y0 * stride + x0];
+}
+
+void ProbeMesh::subdivide(unsigned int x0, unsigned int y0, unsigned int size, unsigned int maxSize, Real splitDensity)
+{
+    if (x0 >= cellsX || y0 >= cellsY)
+        return;
+
+    unsigned int cx1 = min(x0 + size, cellsX);
+    unsigned int cy1 = min(y0 + size, cellsY);
+    Real weight = weightIn(x0, y0, cx1, cy1);
+
+    Real area = (Real)(cx1 - x0) * (cy1 - y0);
+
+    //Split where there is more cutting than splitDensity per cell
+    if (size > 1 && (size > maxSize || weight > splitDensity * area)) {
+        unsigned int half = size / 2;
+
+        subdivide(x0, y0, half, maxSize, splitDensity);
+        subdivide(x0 + half, y0, half, maxSize, splitDensity);
+        subdivide(x0, y0 + half, half, maxSize, splitDensity);
+        subdivide(x0 + half, y0 + half, half, maxSize, splitDensity);
+        return;
+    }
+
+    MeshLeaf leaf;
+
+    leaf.x0 = x0;
+    leaf.y0 = y0;
+    leaf.x1 = min(x0 + size, maxX);
+    leaf.y1 = min(y0 + size, maxY);
+    leaf.weight = weight;
+
+    for (unsigned int cy = y0; cy < cy1; cy++)
+        for (unsigned int cx = x0; cx < cx1; cx++)
+            leafOf.at(cx, cy) = (unsigned int)leaves.size();
+
+    leaves.push_back(leaf);
+}
+
+void ProbeMesh::build(unsigned int maxSize, Real splitDensity)
+{
+    size_t stride = cellsX + 1;
+
+    weightSum.assign(stride * (cellsY + 1), 0);
+    for (unsigned int cy = 0; cy < cellsY; cy++) {
+        Real row = 0;
+
+        for (unsigned int cx = 0; cx < cellsX; cx++) {
+            row += cellWeight.get(cx, cy);
+            weightSum[(cy + 1) * stride + cx + 1] = weightSum[cy * stride + cx + 1] + row;
+        }
+    }
+
+    unsigned int root = 1;
+
+    while (root < cellsX || root < cellsY)
+        root *= 2;
+
+    leaves.clear();
+    subdivide(0, 0, root, maxSize, splitDensity);
+}
+
+void ProbeMesh::locate(Real u, Real v, unsigned int nx[4], unsigned int ny[4], Real w[4]) const
+{
+    u = min(max(u, (Real)0), (Real)maxX);
+    v = min(max(v, (Real)0), (Real)maxY);
+
+    const MeshLeaf &leaf = leaves[leafOf.get(cellOf(u, cellsX), cellOf(v, cellsY))];
+    Real fu = (leaf.x1 > leaf.x0)? (u - leaf.x0) / (leaf.x1 - leaf.x0) : 0;
+    Real fv = (leaf.y1 > leaf.y0)? (v - leaf.y0) / (leaf.y1 - leaf.y0) : 0;
+
+    nx[0] = leaf.x0; ny[0] = leaf.y0;
+    nx[1] = leaf.x1; ny[1] = leaf.y0;
+    nx[2] = leaf.x0; ny[2] = leaf.y1;
+    nx[3] = leaf.x1; ny[3] = leaf.y1;
+
+    w[0] = (1 - fu) * (1 - fv);
+    w[1] = fu * (1 - fv);
+    w[2] = (1 - fu) * fv;
+    w[3] = fu * fv;
+}
+
+/*
+ * Leaves with nothing cut in them are never blended over, so their edges
+ * don't constrain the nodes around them
+ */
+bool ProbeMesh::onEdge(unsigned int x, unsigned int y, MeshEdge &edge) const
+{
+    unsigned int span = 0;
+
+    for (unsigned int cy = (y > 0)? y - 1 : 0; cy <= y && cy < cellsY; cy++) {
+        for (unsigned int cx = (x > 0)? x - 1 : 0; cx <= x && cx < cellsX; cx++) {
+            const MeshLeaf &leaf = leaves[leafOf.get(cx, cy)];
+
+            if (leaf.weight == 0)
+                continue;
+
+            if ((y == leaf.y0 || y == leaf.y1) && x > leaf.x0 && x < leaf.x1 && leaf.x1 - leaf.x0 > span) {
+                span = leaf.x1 - leaf.x0;
+                edge.ax = leaf.x0;
+                edge.bx = leaf.x1;
+                edge.ay = edge.by = y;
+                edge.weightA = (Real)(leaf.x1 - x) / span;
+            }
+
+            if ((x == leaf.x0 || x == leaf.x1) && y > leaf.y0 && y < leaf.y1 && leaf.y1 - leaf.y0 > span) {
+                span = leaf.y1 - leaf.y0;
+                edge.ay = leaf.y0;
+                edge.by = leaf.y1;
+                edge.ax = edge.bx = x;
+                edge.weightA = (Real)(leaf.y1 - y) / span;
+            }
+        }
+    }
+
+    return span > 0;
+}
+
@@ -0,0 +1,489 @@
+#include <algorithm>
+#include <cmath>
+#include "probe-order.h"
+
+using namespace std;
+
+#define IMPROVE_EPSILON 1e-7    //Smallest gain worth a move
+#define SEGMENT_MAX     3       //Longest run of points moved by Or-opt
+
+/*
+ * Uniform buckets over the points, about two per bucket, used to find
+ * close points without looking at all of them
+ */
+class PointBuckets {
+public:
+    PointBuckets(const vector<double> &xs, const vector<double> &ys) : xs(xs), ys(ys)
+    {
+        size_t n = xs.size();
+
+        minX = *min_element(xs.begin(), xs.end());
+        minY = *min_element(ys.begin(), ys.end());
+
+        double w = *max_element(xs.begin(), xs.end()) - minX;
+        double h = *max_element(ys.begin(), ys.end()) - minY;
+
+        size = sqrt((w * h) / (n / 2.0 + 1));
+        if (!(size > 0))
+            size = max(max(w, h), 1.0);
+
+        nx = (unsigned int)(w / size) + 1;
+        ny = (unsigned int)(h / size) + 1;
+        cells.resize((size_t)nx * ny);
+        slot.resize(n);
+
+        for (size_t i = 0; i < n; i++)
+            insert((int)i);
+    }
+
+    void remove(int p)
+    {
+        vector<int> &cell = cells[cellOf(p)];
+        int last = cell.back();
+
+        cell[slot[p]] = last;
+        slot[last] = slot[p];
+        cell.pop_back();
+    }
+
+    /*
+     * Visits the buckets in rings around (x, y).  visit() sees every point
+     * of ring r, then done(r) is asked whether the points still unseen,
+     * all at least r * size away, can be skipped.
+     */
+    template<typename Visit, typename Done>
+    void search(double x, double y, Visit visit, Done done) const
+    {
+        int cx = clampCell((x - minX) / size, nx);
+        int cy = clampCell((y - minY) / size, ny);
+        int rmax = (int)max(nx, ny);
+
+        for (int r = 0; r <= rmax; r++) {
+            for (int by = cy - r; by <= cy + r; by++) {
+                if (by < 0 || by >= (int)ny)
+                    continue;
+
+                bool edge = (by == cy - r || by == cy + r);
+                int step = edge? 1 : 2 * r;
+
+                for (int bx = cx - r; bx <= cx + r; bx += (step > 0? step : 1)) {
+                    if (bx < 0 || bx >= (int)nx)
+                        continue;
+
+                    for (int p : cells[(size_t)by * nx + bx])
+                        visit(p);
+                }
+            }
+
+            if (done(r * size))
+                return;
+        }
+    }
+
+private:
+    static int clampCell(double v, unsigned int n)
+    {
+        int c = (int)v;
+
+        return (c < 0)? 0 : (c >= (int)n)? (int)n - 1 : c;
+    }
+
+    size_t cellOf(int p) const
+    {
+        return (size_t)clampCell((ys[p] - minY) / size, ny) * nx + clampCell((xs[p] - minX) / size, nx);
+    }
+
+    void insert(int p)
+    {
+        vector<int> &cell = cells[cellOf(p)];
+
+        slot[p] = cell.size();
+        cell.push_back(p);
+    }
+
+    const vector<double> &xs;
+    const vector<double> &ys;
+    double minX, minY, size;
+    unsigned int nx, ny;
+    vector<vector<int> > cells;
+    vector<size_t> slot;
+};
+
+class TourImprover {
+public:
+    TourImprover(const vector<double> &xs, const vector<double> &ys, unsigned long long workLimit)
+        : xs(xs), ys(ys), workLimit(workLimit)
+    {
+        n = (int)xs.size();
+        pos.resize(n);
+        work = 0;
+    }
+
+    double dist(int a, int b) const
+    {
+        return hypot(xs[a] - xs[b], ys[a] - ys[b]);
+    }
+
+    /*
+     * The work is counted in points looked at, moves tried and points
+     * moved, so where the search stops doesn't depend on the machine
+     */
+    bool expired() const
+    {
+        return work >= workLimit;
+    }
+
+    /*
+     * Nearest neighbour tour from point 0.  Returns false if it ran out
+     * of work.
+     */
+    bool nearestNeighbour(vector<int> &order)
+    {
+        PointBuckets buckets(xs, ys);
+        int cur = 0;
+
+        order.clear();
+        order.push_back(cur);
+        buckets.remove(cur);
+
+        while ((int)order.size() < n) {
+            int best = -1;
+            double bestDist = 0;
+
+            buckets.search(xs[cur], ys[cur],
+                [&](int p) {
+                    double d = dist(cur, p);
+
+                    work++;
+                    if (best < 0 || d < bestDist) {
+                        best = p;
+                        bestDist = d;
+                    }
+                },
+                [&](double reach) {
+                    return best >= 0 && bestDist <= reach;
+                });
+
+            order.push_back(best);
+            buckets.remove(best);
+            cur = best;
+
+            if ((order.size() & 1023) == 0 && expired())
+                return false;
+        }
+
+        return true;
+    }
+
+    void buildNeighbours()
+    {
+        PointBuckets buckets(xs, ys);
+        unsigned int k = min(PROBE_ORDER_NEIGHBORS, n - 1);
+        vector<pair<double, int> > found;
+
+        neighbours.resize((size_t)n * k);
+        this->k = k;
+
+        for (int a = 0; a < n; a++) {
+            found.clear();
+            buckets.search(xs[a], ys[a],
+                [&](int p) {
+                    work++;
+                    if (p != a)
+                        found.push_back(make_pair(dist(a, p), p));
+                },
+                [&](double reach) {
+                    if (found.size() < k)
+                        return false;
+
+                    nth_element(found.begin(), found.begin() + (k - 1), found.end());
+                    return found[k - 1].first <= reach;
+                });
+
+            partial_sort(found.begin(), found.begin() + k, found.end());
+            for (unsigned int i = 0; i < k; i++)
+                neighbours[(size_t)a * k + i] = found[i].second;
+        }
+    }
+
+    void improve(vector<int> &order)
+    {
+        this->order.swap(order);
+        for (int i = 0; i < n; i++)
+            pos[this->order[i]] = i;
+
+        bool improved = true;
+
+        while (improved && !expired()) {
+            improved = twoOpt();
+            improved = orOpt() || improved;
+        }
+
+        this->order.swap(order);
+    }
+
+private:
+    void reverse(int i, int j)
+    {
+        std::reverse(order.begin() + i, order.begin() + j + 1);
+        for (int p = i; p <= j; p++)
+            pos[order[p]] = p;
+        work += j - i + 1;
+    }
+
+    /*
+     * Reverses a stretch of the path.  Point 0 never moves, the far end
+     * is open so the last stretch can be flipped on its own.
+     */
+    bool twoOpt()
+    {
+        bool improved = false;
+
+        for (int i = 0; i < n - 1; i++) {
+            if ((i & 255) == 0 && expired())
+                return improved;
+
+            int a = order[i];
+            int b = order[i + 1];
+            double dab = dist(a, b);
+
+            work++;
+
+            if (dist(a, order[n - 1]) < dab - IMPROVE_EPSILON) {
+                reverse(i + 1, n - 1);
+                improved = true;
+                continue;
+            }
+
+            for (unsigned int m = 0; m < k; m++) {
+                int c = neighbours[(size_t)a * k + m];
+                double dac = dist(a, c);
+                int j = pos[c];
+
+                work++;
+
+                if (dac >= dab)
+                    break;
+
+                double delta;
+
+                if (j > i + 1) {
+                    //a-b ... c-e becomes a-c ... b-e
+                    delta = dac - dab;
+                    if (j + 1 < n)
+                        delta += dist(b, order[j + 1]) - dist(c, order[j + 1]);
+
+                    if (delta < -IMPROVE_EPSILON) {
+                        reverse(i + 1, j);
+                        improved = true;
+                        break;
+                    }
+                } else if (j + 1 < i) {
+                    //c-e ... a-b becomes c-a ... e-b
+                    int e = order[j + 1];
+
+                    delta = dac + dist(e, b) - dist(c, e) - dab;
+                    if (delta < -IMPROVE_EPSILON) {
+                        reverse(j + 1, i);
+                        improved = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        return improved;
+    }
+
+    /*
+     * Insertion cost of the run s0..s1 between u and v (v < 0 at the end
+     * of the path), reversed if that is cheaper
+     */
+    double insertCost(int u, int v, int s0, int s1, bool &reversed) const
+    {
+        double forward = dist(u, s0);
+        double backward = dist(u, s1);
+
+        if (v >= 0) {
+            double uv = dist(u, v);
+
+            forward += dist(s1, v) - uv;
+            backward += dist(s0, v) - uv;
+        }
+
+        reversed = backward < forward;
+        return reversed? backward : forward;
+    }
+
+    void moveRun(int i, int len, int j, bool reversed)
+    {
+        //The run order[i..i+len-1] goes right after order[j]
+        vector<int> run(order.begin() + i, order.begin() + i + len);
+
+        if (reversed)
+            std::reverse(run.begin(), run.end());
+
+        int lo, hi;
+
+        if (j < i) {
+            copy_backward(order.begin() + j + 1, order.begin() + i, order.begin() + i + len);
+            copy(run.begin(), run.end(), order.begin() + j + 1);
+            lo = j + 1;
+            hi = i + len - 1;
+        } else {
+            copy(order.begin() + i + len, order.begin() + j + 1, order.begin() + i);
+            copy(run.begin(), run.end(), order.begin() + j + 1 - len);
+            lo = i;
+            hi = j;
+        }
+
+        for (int p = lo; p <= hi; p++)
+            pos[order[p]] = p;
+        work += hi - lo + 1;
+    }
+
+    /*
+     * Moves runs of up to SEGMENT_MAX points next to one of their
+     * neighbours
+     */
+    bool orOpt()
+    {
+        bool improved = false;
+
+        for (int len = 1; len <= SEGMENT_MAX; len++) {
+            for (int i = 1; i + len <= n; i++) {
+                if ((i & 255) == 0 && expired())
+                    return improved;
+
+                int p = order[i - 1];
+                int s0 = order[i];
+                int s1 = order[i + len - 1];
+                int nx = (i + len < n)? order[i + len] : -1;
+                double gain = dist(p, s0);
+
+                work++;
+                if (nx >= 0)
+                    gain += dist(s1, nx) - dist(p, nx);
+
+                if (gain <= IMPROVE_EPSILON)
+                    continue;
+
+                int bestJ = -1;
+                bool bestReversed = false;
+                double bestDelta = -IMPROVE_EPSILON;
+
+                for (int end = 0; end < 2; end++) {
+                    int s = end? s1 : s0;
+
+                    for (unsigned int m = 0; m < k; m++) {
+                        int c = neighbours[(size_t)s * k + m];
+                        int j = pos[c];
+
+                        if (j >= i - 1 && j < i + len)
+                            continue;
+
+                        //Try the edges on both sides of c
+                        for (int side = 0; side < 2; side++) {
+                            int u = side? j - 1 : j;
+
+                            if (u < 0 || (u >= i - 1 && u < i + len))
+                                continue;
+
+                            int v = (u + 1 < n)? order[u + 1] : -1;
+                            bool reversed;
+
+                            work++;
+                            double delta = insertCost(order[u], v, s0, s1, reversed) - gain;
+
+                            if (delta < bestDelta) {
+                                bestDelta = delta;
+                                bestJ = u;
+                                bestReversed = reversed;
+                            }
+                        }
+                    }
+                }
+
+                if (bestJ >= 0) {
+                    moveRun(i, len, bestJ, bestReversed);
+                    improved = true;
+                }
+            }
+        }
+
+        return improved;
+    }
+
+    const vector<double> &xs;
+    const vector<double> &ys;
+    unsigned long long work;
+    unsigned long long workLimit;
+    int n;
+    unsigned int k;
+    vector<int> order;
+    vector<int> pos;
+    vector<int> neighbours;
+};
+
+static double path_length(const TourImprover &tour, const vector<int> &order)
+{
+    double length = 0;
+
+    for (size_t i = 1; i < order.size(); i++)
+        length += tour.dist(order[i - 1], order[i]);
+
+    return length;
+}
+
+Real TourLength(const vector<ProbePoint> &points)
+{
+    Real length = 0;
+
+    for (size_t i = 1; i < points.size(); i++)
+        length += hypot(points[i].x - points[i - 1].x, points[i].y - points[i - 1].y);
+
+    return length;
+}
+
+void OrderProbes(vector<ProbePoint> &points, unsigned long long workLimit)
+{
+    int n = (int)points.size();
+
+    if (n < 4)
+        return;
+
+    vector<double> xs(n), ys(n);
+
+    for (int i = 0; i < n; i++) {
+        xs[i] = (double)points[i].x;
+        ys[i] = (double)points[i].y;
+    }
+
+    TourImprover tour(xs, ys, workLimit);
+    vector<int> given(n), order;
+
+    for (int i = 0; i < n; i++)
+        given[i] = i;
+
+    double givenLength = path_length(tour, given);
+
+    //Start from whichever is shorter, the nearest neighbour tour or the given one
+    if (!tour.nearestNeighbour(order) || path_length(tour, order) >= givenLength)
+        order = given;
+
+    if (!tour.expired()) {
+        tour.buildNeighbours();
+        tour.improve(order);
+    }
+
+    if (path_length(tour, order) >= givenLength)
+        return;
+
+    vector<ProbePoint> ordered(n);
+
+    for (int i = 0; i < n; i++)
+        ordered[i] = points[order[i]];
+
+    points.swap(ordered);
+}
+
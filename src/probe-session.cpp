@@ -0,0 +1,94 @@
+#include <algorithm>
+#include "probe-session.h"
+
+using namespace std;
+
+/*
+ * Runs one stage of a job, an error names the file
+ */
+template <typename Stage>
+static void run_stage(const SessionFile &file, Stage stage)
+{
+    try {
+        stage();
+    } catch (const ProbeError &e) {
+        throw ProbeError(e.getStatus(), file.InPath + ": " + e.what());
+    }
+}
+
+void RunSession(const vector<SessionFile> &files, vector<PCBProbeJob> &jobs)
+{
+    size_t n = files.size();
+
+    if (n == 0)
+        return;
+    if (jobs[0].info.Adaptive || jobs[0].info.UseHeightMap)
+        throw ProbeError(PROBE_ERROR_ARGUMENTS, "A session can't be combined with --adaptive or --heightmap");
+
+    for (size_t k = 0; k < n; k++)
+        run_stage(files[k], [&]() { jobs[k].LoadSegments(files[k].InPath.c_str()); });
+
+    /*
+     * The board is where any of the files cuts, a file that doesn't cut
+     * (drill spots only) never set its route depth
+     */
+    PCBProbeInfo bounds = jobs[0].info;
+    bool cuts = false;
+
+    for (size_t k = 0; k < n; k++) {
+        const PCBProbeInfo &info = jobs[k].info;
+
+        if (info.UnitType != jobs[0].info.UnitType) {
+            throw ProbeError(PROBE_ERROR_FILE, files[k].InPath + ": not in the units of " +
+                             files[0].InPath + ", the files of a session share one grid");
+        }
+        if (!(info.MillRouteDepth < 0))
+            continue;
+
+        if (!cuts) {
+            bounds.MillMinX = info.MillMinX;
+            bounds.MillMinY = info.MillMinY;
+            bounds.MillMaxX = info.MillMaxX;
+            bounds.MillMaxY = info.MillMaxY;
+            cuts = true;
+        } else {
+            bounds.MillMinX = min(bounds.MillMinX, info.MillMinX);
+            bounds.MillMinY = min(bounds.MillMinY, info.MillMinY);
+            bounds.MillMaxX = max(bounds.MillMaxX, info.MillMaxX);
+            bounds.MillMaxY = max(bounds.MillMaxY, info.MillMaxY);
+        }
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        PCBProbeJob &job = jobs[k];
+
+        if (cuts) {
+            job.info.MillMinX = bounds.MillMinX;
+            job.info.MillMinY = bounds.MillMinY;
+            job.info.MillMaxX = bounds.MillMaxX;
+            job.info.MillMaxY = bounds.MillMaxY;
+        }
+        job.SizeGrid();
+
+        run_stage(files[k], [&]() {
+            job.SplitSegments();
+            job.MergeSegments();
+        });
+    }
+
+    //Every file numbers the cells it adds after those of the files before it
+    for (size_t k = 0; k < n; k++) {
+        if (k > 0)
+            jobs[k].ShareVariables(jobs[k - 1]);
+        run_stage(files[k], [&]() { jobs[k].DoInterpolation(); });
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        PCBProbeJob &job = jobs[k];
+
+        if (k + 1 < n)
+            job.ShareVariables(jobs[n - 1]);
+        job.info.ProbedBefore = k > 0;
+        run_stage(files[k], [&]() { job.GenerateGCodeWithProbing(files[k].OutPath.c_str()); });
+    }
+}
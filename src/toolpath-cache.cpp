@@ -0,0 +1,252 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "toolpath-cache.h"
+#include "gcode-reader.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
+
+using namespace std;
+
+#define CACHE_WRITE_BLOCK   (1 << 20)
+
+/*
+ * Fixed size fields only, the file is read back by the same build (the
+ * sizes of Real and of the records are checked)
+ */
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t realBytes;
+    uint32_t recordBytes;       //sizeof(CachedCommand)
+    int32_t unitType;
+    uint32_t inchSwitches;
+    uint32_t hasDrillSpots;
+    uint64_t inputHash;
+    uint64_t inputSize;
+    uint64_t lineCount;
+    uint64_t commandCount;
+    uint64_t commandOffset;
+    uint64_t commandBytes;
+    Real millMinX;
+    Real millMinY;
+    Real millMaxX;
+    Real millMaxY;
+    Real millRouteDepth;
+    Real drillSpotDepth;
+};
+
+/*
+ * A command in the file, followed by its argCount values.  Records start
+ * on CACHE_RECORD_ALIGN so the values can be read in place.
+ */
+struct CachedCommand {
+    uint64_t argMask;
+    unsigned char opcode;
+    unsigned char argCount;
+    unsigned char wordCount;
+    char name[GCODE_MAX_NAME + 1];
+    char argWords[GCODE_MAX_WORDS];
+};
+
+#define CACHE_RECORD_ALIGN  alignof(Real)
+
+static size_t record_size(unsigned int argCount)
+{
+    size_t n = sizeof(CachedCommand) + argCount * sizeof(Real);
+
+    return (n + CACHE_RECORD_ALIGN - 1) / CACHE_RECORD_ALIGN * CACHE_RECORD_ALIGN;
+}
+
+static inline uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+uint64_t HashContents(string_view data)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t n = data.size();
+    uint64_t h = 0xcbf29ce484222325ULL ^ n;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, p + i, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+
+    uint64_t tail = 0;
+
+    for (size_t k = 0; i + k < n; k++)
+        tail |= (uint64_t)p[i + k] << (8 * k);
+
+    return mix(h ^ mix(tail));
+}
+
+static uint64_t command_offset()
+{
+    return (sizeof(CacheHeader) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+bool ReadToolpathCache(const char *path, uint64_t hash, uint64_t size, ToolpathSummary &summary, CommandArena &commands)
+{
+    GCodeReader in;
+    CacheHeader header;
+
+    commands.clear();
+
+    if (!in.open(path) || in.size() < sizeof(header))
+        return false;
+
+    string_view data = in.contents();
+
+    memcpy(&header, data.data(), sizeof(header));
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CACHE_VERSION ||
+            header.realBytes != sizeof(Real) ||
+            header.recordBytes != sizeof(CachedCommand) ||
+            header.inputHash != hash ||
+            header.inputSize != size ||
+            header.commandOffset != command_offset() ||
+            header.commandOffset + header.commandBytes != data.size())
+        return false;
+
+    const char *p = data.data() + header.commandOffset;
+    const char *end = p + header.commandBytes;
+    GCodeCommand cmd;
+
+    commands.reserve(header.commandCount);
+    for (uint64_t k = 0; k < header.commandCount; k++) {
+        CachedCommand record;
+
+        if ((size_t)(end - p) < sizeof(record))
+            break;
+        memcpy(&record, p, sizeof(record));
+
+        if (record.argCount > GCODE_MAX_ARGS || record.wordCount > GCODE_MAX_WORDS ||
+                __builtin_popcountll(record.argMask) != record.argCount ||
+                (size_t)(end - p) < record_size(record.argCount))
+            break;
+
+        cmd.Clear();
+        cmd.opcode = record.opcode;
+        cmd.argCount = record.argCount;
+        cmd.wordCount = record.wordCount;
+        cmd.argMask = record.argMask;
+        memcpy(cmd.name, record.name, sizeof(cmd.name));
+        memcpy(cmd.argWords, record.argWords, sizeof(cmd.argWords));
+        memcpy(cmd.argValues, p + sizeof(record), record.argCount * sizeof(Real));
+        commands.push_back(cmd);
+
+        p += record_size(record.argCount);
+    }
+
+    if (p != end || commands.size() != header.commandCount) {
+        commands.clear();
+        return false;
+    }
+
+    summary.UnitType = header.unitType;
+    summary.InchSwitches = header.inchSwitches;
+    summary.HasDrillSpots = header.hasDrillSpots != 0;
+    summary.MillMinX = header.millMinX;
+    summary.MillMinY = header.millMinY;
+    summary.MillMaxX = header.millMaxX;
+    summary.MillMaxY = header.millMaxY;
+    summary.MillRouteDepth = header.millRouteDepth;
+    summary.DrillSpotDepth = header.drillSpotDepth;
+    summary.LineCount = header.lineCount;
+
+    return true;
+}
+
+bool WriteToolpathCache(const char *path, uint64_t hash, uint64_t size, const ToolpathSummary &summary, const CommandArena &commands)
+{
+    CacheHeader header;
+    char padding[CACHE_ALIGN] = { 0 };
+    string temp = string(path) + ".tmp" + to_string((unsigned long)getpid()) + "-" + to_string((uintptr_t)&commands);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.realBytes = sizeof(Real);
+    header.recordBytes = sizeof(CachedCommand);
+    header.unitType = summary.UnitType;
+    header.inchSwitches = summary.InchSwitches;
+    header.hasDrillSpots = summary.HasDrillSpots;
+    header.inputHash = hash;
+    header.inputSize = size;
+    header.lineCount = summary.LineCount;
+    header.commandCount = commands.size();
+    header.commandOffset = command_offset();
+    header.commandBytes = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        if (commands[i].extra != NULL)
+            return false;   //A record only holds what fits in place
+        header.commandBytes += record_size(commands[i].argCount);
+    }
+    header.millMinX = summary.MillMinX;
+    header.millMinY = summary.MillMinY;
+    header.millMaxX = summary.MillMaxX;
+    header.millMaxY = summary.MillMaxY;
+    header.millRouteDepth = summary.MillRouteDepth;
+    header.drillSpotDepth = summary.DrillSpotDepth;
+
+    FILE *f = fopen(temp.c_str(), "wb");
+
+    if (f == NULL)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(padding, 1, header.commandOffset - sizeof(header), f) == header.commandOffset - sizeof(header);
+
+    vector<char> block;
+
+    block.reserve(CACHE_WRITE_BLOCK + record_size(GCODE_MAX_ARGS));
+    for (size_t i = 0; ok && i < commands.size(); i++) {
+        const GCodeCommand &cmd = commands[i];
+        CachedCommand record;
+        size_t at = block.size();
+
+        memset(&record, 0, sizeof(record));
+        record.argMask = cmd.argMask;
+        record.opcode = cmd.opcode;
+        record.argCount = cmd.argCount;
+        record.wordCount = cmd.wordCount;
+        memcpy(record.name, cmd.name, sizeof(record.name));
+        memcpy(record.argWords, cmd.argWords, sizeof(record.argWords));
+
+        block.resize(at + record_size(cmd.argCount), 0);
+        memcpy(&block[at], &record, sizeof(record));
+        memcpy(&block[at + sizeof(record)], cmd.argValues, cmd.argCount * sizeof(Real));
+
+        if (block.size() >= CACHE_WRITE_BLOCK || i + 1 == commands.size()) {
+            ok = fwrite(&block[0], 1, block.size(), f) == block.size();
+            block.clear();
+        }
+    }
+
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(temp.c_str(), path) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,266 @@
+#include <cmath>
+#include "weight-kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WEIGHT_KERNEL_X86
+#endif
+
+using namespace std;
+
+#define EDGE_SLACK      1e-9    //Offsets in a cell closer than this to 0, 0.5 or 1 are not decided here
+#define ROUND_SLACK     1e-6    //Nor weights this close to a rounding boundary of 3 decimals
+
+static const char *kernelNames[] = { "none", "scalar", "sse4.1", "avx2" };
+
+void WeightBatch::resize(size_t n)
+{
+    X.resize(n);
+    Y.resize(n);
+    CellX.resize(n);
+    CellY.resize(n);
+    NextX.resize(n);
+    NextY.resize(n);
+    for (int k = 0; k < 4; k++)
+        Weights[k].resize(n);
+    Exact.resize(n);
+}
+
+int BestWeightKernel()
+{
+#ifdef WEIGHT_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return WEIGHT_KERNEL_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return WEIGHT_KERNEL_SSE41;
+#endif
+
+    return WEIGHT_KERNEL_SCALAR;
+}
+
+const char *WeightKernelName(int kernel)
+{
+    if (kernel < WEIGHT_KERNEL_NONE || kernel > WEIGHT_KERNEL_AVX2)
+        return "unknown";
+
+    return kernelNames[kernel];
+}
+
+/*
+ * Cell, neighbour and weight of the cell along one axis.  Returns false if
+ * the point is not for this kernel to decide.
+ */
+static inline bool scalar_axis(double pos, double min, double size, int max, int32_t &cell, int32_t &next, double &weight)
+{
+    double f = (pos - min) / size;
+    double c = floor(f);
+    double os = f - c;
+    bool up = os > 0.5;
+    double n = c + (up? 1 : -1);
+
+    if (n < 0 || n > max)
+        n = c;
+
+    cell = (int32_t)c;
+    next = (int32_t)n;
+    weight = 0.5 + (up? 1 - os : os);
+
+    return c >= 0 && c <= max && os >= EDGE_SLACK && os <= 1 - EDGE_SLACK && fabs(os - 0.5) >= EDGE_SLACK;
+}
+
+static inline bool scalar_rounds(double w)
+{
+    double s = w * 1000;
+
+    return fabs(s - floor(s) - 0.5) >= ROUND_SLACK;
+}
+
+static void scalar_weights(const WeightGrid &grid, WeightBatch &batch, size_t from, size_t to)
+{
+    for (size_t i = from; i < to; i++) {
+        double wx, wy;
+        bool exact = scalar_axis(batch.X[i], grid.MinX, grid.Gx, grid.MaxX, batch.CellX[i], batch.NextX[i], wx);
+
+        exact = scalar_axis(batch.Y[i], grid.MinY, grid.Gy, grid.MaxY, batch.CellY[i], batch.NextY[i], wy) && exact;
+
+        batch.Weights[0][i] = wx * wy;
+        batch.Weights[1][i] = (1 - wx) * wy;
+        batch.Weights[2][i] = wx * (1 - wy);
+        batch.Weights[3][i] = (1 - wx) * (1 - wy);
+
+        exact = exact && scalar_rounds(wx) && scalar_rounds(wy);
+        for (int k = 0; k < 4; k++)
+            exact = exact && scalar_rounds(batch.Weights[k][i]);
+        batch.Exact[i] = exact;
+    }
+}
+
+#ifdef WEIGHT_KERNEL_X86
+
+/*
+ * The same as scalar_axis two points at a time, bad gets the lanes that
+ * are not for this kernel to decide
+ */
+__attribute__((target("sse4.1")))
+static inline __m128d sse_axis(__m128d pos, double min, double size, int max, int32_t *cell, int32_t *next, __m128d &bad)
+{
+    const __m128d half = _mm_set1_pd(0.5), one = _mm_set1_pd(1), zero = _mm_setzero_pd();
+    const __m128d slack = _mm_set1_pd(EDGE_SLACK), top = _mm_set1_pd(max);
+    const __m128d sign = _mm_set1_pd(-0.0);
+
+    __m128d f = _mm_div_pd(_mm_sub_pd(pos, _mm_set1_pd(min)), _mm_set1_pd(size));
+    __m128d c = _mm_floor_pd(f);
+    __m128d os = _mm_sub_pd(f, c);
+    __m128d up = _mm_cmpgt_pd(os, half);
+    __m128d n = _mm_add_pd(c, _mm_blendv_pd(_mm_set1_pd(-1), one, up));
+
+    n = _mm_blendv_pd(n, c, _mm_or_pd(_mm_cmplt_pd(n, zero), _mm_cmpgt_pd(n, top)));
+
+    _mm_storel_epi64((__m128i *)cell, _mm_cvttpd_epi32(c));
+    _mm_storel_epi64((__m128i *)next, _mm_cvttpd_epi32(n));
+
+    bad = _mm_or_pd(bad, _mm_or_pd(_mm_cmplt_pd(c, zero), _mm_cmpgt_pd(c, top)));
+    bad = _mm_or_pd(bad, _mm_or_pd(_mm_cmplt_pd(os, slack), _mm_cmpgt_pd(os, _mm_sub_pd(one, slack))));
+    bad = _mm_or_pd(bad, _mm_cmplt_pd(_mm_andnot_pd(sign, _mm_sub_pd(os, half)), slack));
+
+    return _mm_add_pd(half, _mm_blendv_pd(os, _mm_sub_pd(one, os), up));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128d sse_rounding(__m128d w)
+{
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d s = _mm_mul_pd(w, _mm_set1_pd(1000));
+    __m128d off = _mm_sub_pd(_mm_sub_pd(s, _mm_floor_pd(s)), _mm_set1_pd(0.5));
+
+    return _mm_cmplt_pd(_mm_andnot_pd(sign, off), _mm_set1_pd(ROUND_SLACK));
+}
+
+__attribute__((target("sse4.1")))
+static void sse_weights(const WeightGrid &grid, WeightBatch &batch)
+{
+    const __m128d one = _mm_set1_pd(1);
+    size_t n = batch.size();
+    size_t i;
+
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128d bad = _mm_setzero_pd();
+        __m128d wx = sse_axis(_mm_loadu_pd(&batch.X[i]), grid.MinX, grid.Gx, grid.MaxX, &batch.CellX[i], &batch.NextX[i], bad);
+        __m128d wy = sse_axis(_mm_loadu_pd(&batch.Y[i]), grid.MinY, grid.Gy, grid.MaxY, &batch.CellY[i], &batch.NextY[i], bad);
+        __m128d w[4];
+
+        w[0] = _mm_mul_pd(wx, wy);
+        w[1] = _mm_mul_pd(_mm_sub_pd(one, wx), wy);
+        w[2] = _mm_mul_pd(wx, _mm_sub_pd(one, wy));
+        w[3] = _mm_mul_pd(_mm_sub_pd(one, wx), _mm_sub_pd(one, wy));
+
+        bad = _mm_or_pd(bad, _mm_or_pd(sse_rounding(wx), sse_rounding(wy)));
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_pd(&batch.Weights[k][i], w[k]);
+            bad = _mm_or_pd(bad, sse_rounding(w[k]));
+        }
+
+        int mask = _mm_movemask_pd(bad);
+
+        batch.Exact[i] = !(mask & 1);
+        batch.Exact[i + 1] = !(mask & 2);
+    }
+
+    scalar_weights(grid, batch, i, n);
+}
+
+/*
+ * And four at a time
+ */
+__attribute__((target("avx2")))
+static inline __m256d avx_axis(__m256d pos, double min, double size, int max, int32_t *cell, int32_t *next, __m256d &bad)
+{
+    const __m256d half = _mm256_set1_pd(0.5), one = _mm256_set1_pd(1), zero = _mm256_setzero_pd();
+    const __m256d slack = _mm256_set1_pd(EDGE_SLACK), top = _mm256_set1_pd(max);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+
+    __m256d f = _mm256_div_pd(_mm256_sub_pd(pos, _mm256_set1_pd(min)), _mm256_set1_pd(size));
+    __m256d c = _mm256_floor_pd(f);
+    __m256d os = _mm256_sub_pd(f, c);
+    __m256d up = _mm256_cmp_pd(os, half, _CMP_GT_OQ);
+    __m256d n = _mm256_add_pd(c, _mm256_blendv_pd(_mm256_set1_pd(-1), one, up));
+
+    n = _mm256_blendv_pd(n, c, _mm256_or_pd(_mm256_cmp_pd(n, zero, _CMP_LT_OQ), _mm256_cmp_pd(n, top, _CMP_GT_OQ)));
+
+    _mm_storeu_si128((__m128i *)cell, _mm256_cvttpd_epi32(c));
+    _mm_storeu_si128((__m128i *)next, _mm256_cvttpd_epi32(n));
+
+    bad = _mm256_or_pd(bad, _mm256_or_pd(_mm256_cmp_pd(c, zero, _CMP_LT_OQ), _mm256_cmp_pd(c, top, _CMP_GT_OQ)));
+    bad = _mm256_or_pd(bad, _mm256_or_pd(_mm256_cmp_pd(os, slack, _CMP_LT_OQ),
+                                         _mm256_cmp_pd(os, _mm256_sub_pd(one, slack), _CMP_GT_OQ)));
+    bad = _mm256_or_pd(bad, _mm256_cmp_pd(_mm256_andnot_pd(sign, _mm256_sub_pd(os, half)), slack, _CMP_LT_OQ));
+
+    return _mm256_add_pd(half, _mm256_blendv_pd(os, _mm256_sub_pd(one, os), up));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d avx_rounding(__m256d w)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d s = _mm256_mul_pd(w, _mm256_set1_pd(1000));
+    __m256d off = _mm256_sub_pd(_mm256_sub_pd(s, _mm256_floor_pd(s)), _mm256_set1_pd(0.5));
+
+    return _mm256_cmp_pd(_mm256_andnot_pd(sign, off), _mm256_set1_pd(ROUND_SLACK), _CMP_LT_OQ);
+}
+
+__attribute__((target("avx2")))
+static void avx_weights(const WeightGrid &grid, WeightBatch &batch)
+{
+    const __m256d one = _mm256_set1_pd(1);
+    size_t n = batch.size();
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d bad = _mm256_setzero_pd();
+        __m256d wx = avx_axis(_mm256_loadu_pd(&batch.X[i]), grid.MinX, grid.Gx, grid.MaxX, &batch.CellX[i], &batch.NextX[i], bad);
+        __m256d wy = avx_axis(_mm256_loadu_pd(&batch.Y[i]), grid.MinY, grid.Gy, grid.MaxY, &batch.CellY[i], &batch.NextY[i], bad);
+        __m256d w[4];
+
+        w[0] = _mm256_mul_pd(wx, wy);
+        w[1] = _mm256_mul_pd(_mm256_sub_pd(one, wx), wy);
+        w[2] = _mm256_mul_pd(wx, _mm256_sub_pd(one, wy));
+        w[3] = _mm256_mul_pd(_mm256_sub_pd(one, wx), _mm256_sub_pd(one, wy));
+
+        bad = _mm256_or_pd(bad, _mm256_or_pd(avx_rounding(wx), avx_rounding(wy)));
+        for (int k = 0; k < 4; k++) {
+            _mm256_storeu_pd(&batch.Weights[k][i], w[k]);
+            bad = _mm256_or_pd(bad, avx_rounding(w[k]));
+        }
+
+        int mask = _mm256_movemask_pd(bad);
+
+        for (int k = 0; k < 4; k++)
+            batch.Exact[i + k] = !(mask & (1 << k));
+    }
+
+    scalar_weights(grid, batch, i, n);
+}
+
+#endif
+
+void ComputeWeights(const WeightGrid &grid, WeightBatch &batch, int kernel)
+{
+    static const int best = BestWeightKernel();
+
+    if (kernel > best)
+        kernel = best;
+
+#ifdef WEIGHT_KERNEL_X86
+    if (kernel == WEIGHT_KERNEL_AVX2) {
+        avx_weights(grid, batch);
+        return;
+    }
+    if (kernel == WEIGHT_KERNEL_SSE41) {
+        sse_weights(grid, batch);
+        return;
+    }
+#endif
+
+    scalar_weights(grid, batch, 0, batch.size());
+}